@@ -0,0 +1,200 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  An arena allocates from large blocks by moving a pointer, and frees
+  everything at once when it is reset. A reset keeps the memory: when
+  the arena had to take more than one block, they are replaced by one
+  block that holds the most the arena has held, so that repeating the
+  same work, such as converting the next file of a batch, doesn't call
+  malloc() at all.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+struct arena_block {
+    struct arena_block *next;
+    size_t capacity;
+    size_t used;
+    size_t last; /* where the last allocation starts */
+};
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_BLOCK_SIZE 65536
+
+static size_t align(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static unsigned char *block_data(struct arena_block *b)
+{
+    return (unsigned char *)b + align(sizeof(struct arena_block));
+}
+
+static struct arena_block *create_block(size_t capacity, struct arena_block *next)
+{
+    struct arena_block *b = (struct arena_block *)malloc(align(sizeof(struct arena_block)) + capacity);
+    if (!b)
+        return 0;
+    b->next = next;
+    b->capacity = capacity;
+    b->used = 0;
+    b->last = 0;
+    return b;
+}
+
+/* Adds \a delta (which may be negative) to the bytes allocated from \a a. */
+static void add_size(struct arena *a, long delta)
+{
+    a->size += delta;
+    if (a->size > a->peak)
+        a->peak = a->size;
+}
+
+void arena_init(struct arena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+/**
+  Returns \a size bytes from the arena \a a, aligned for any type.
+  They stay valid until the arena is reset, or released to a mark
+  taken before. Returns 0 if there is no memory left.
+*/
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *b = a->blocks;
+    size = align(size);
+    if (!b || (b->capacity - b->used < size)) {
+        /* Each block is at least twice the previous one, so that a
+           large conversion takes few blocks */
+        size_t capacity = b ? 2 * b->capacity : ARENA_BLOCK_SIZE;
+        while (capacity < size)
+            capacity *= 2;
+        b = create_block(capacity, b);
+        if (!b)
+            return 0;
+        a->blocks = b;
+    }
+    b->last = b->used;
+    b->used += size;
+    add_size(a, size);
+    return block_data(b) + b->last;
+}
+
+/**
+  Makes the \a old_size bytes at \a p, from arena \a a, \a new_size
+  bytes long, and returns where they are now. Grows in place if \a p
+  is the last allocation, otherwise copies. \a p may be 0. Returns 0,
+  leaving \a p as it was, if there is no memory left.
+*/
+void *arena_grow(struct arena *a, void *p, size_t old_size, size_t new_size)
+{
+    struct arena_block *b = a->blocks;
+    void *result;
+    if (p && (p == block_data(b) + b->last)
+        && (b->capacity - b->last >= align(new_size))) {
+        add_size(a, (long)align(new_size) - (long)(b->used - b->last));
+        b->used = b->last + align(new_size);
+        return p;
+    }
+    result = arena_alloc(a, new_size);
+    if (result && p)
+        memcpy(result, p, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+/**
+  Gives back the bytes after the first \a size bytes at \a p to the
+  arena \a a, if \a p is the last allocation.
+*/
+void arena_shrink(struct arena *a, void *p, size_t size)
+{
+    struct arena_block *b = a->blocks;
+    if (b && (p == block_data(b) + b->last) && (align(size) <= b->used - b->last)) {
+        a->size -= (b->used - b->last) - align(size);
+        b->used = b->last + align(size);
+    }
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    char *result = (char *)arena_alloc(a, strlen(s) + 1);
+    if (result)
+        strcpy(result, s);
+    return result;
+}
+
+/* Stores the current state of the arena \a a in \a m. */
+void arena_mark(const struct arena *a, struct arena_mark *m)
+{
+    m->block = a->blocks;
+    m->used = a->blocks ? a->blocks->used : 0;
+    m->size = a->size;
+}
+
+/**
+  Frees what was allocated from the arena \a a since the mark \a m
+  was taken.
+*/
+void arena_release(struct arena *a, const struct arena_mark *m)
+{
+    while (a->blocks != m->block) {
+        struct arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    if (a->blocks) {
+        a->blocks->used = m->used;
+        a->blocks->last = m->used;
+    }
+    a->size = m->size;
+}
+
+/**
+  Frees everything allocated from the arena \a a, keeping the memory
+  for later allocations.
+*/
+void arena_reset(struct arena *a)
+{
+    struct arena_block *b = a->blocks;
+    if (b && (b->next || (b->capacity < a->peak))) {
+        size_t capacity = (a->peak + ARENA_BLOCK_SIZE - 1) / ARENA_BLOCK_SIZE * ARENA_BLOCK_SIZE;
+        arena_destroy(a);
+        b = a->blocks = create_block(capacity, 0);
+    }
+    if (b) {
+        b->used = 0;
+        b->last = 0;
+    }
+    a->size = 0;
+    a->peak = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+    struct arena_block *b = a->blocks;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->blocks = 0;
+}
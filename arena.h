@@ -0,0 +1,50 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+/* Memory that is handed out piece by piece and taken back all at
+   once. An arena must only be used by one thread at a time. */
+struct arena {
+    struct arena_block *blocks; /* the block being allocated from first */
+    size_t size; /* bytes allocated */
+    size_t peak; /* the most bytes allocated since the last reset */
+};
+
+/* A point to return an arena to, freeing what was allocated since. */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+    size_t size;
+};
+
+void arena_init(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+void *arena_grow(struct arena *, void *, size_t, size_t);
+void arena_shrink(struct arena *, void *, size_t);
+char *arena_strdup(struct arena *, const char *);
+void arena_mark(const struct arena *, struct arena_mark *);
+void arena_release(struct arena *, const struct arena_mark *);
+void arena_reset(struct arena *);
+void arena_destroy(struct arena *);
+
+#endif
@@ -0,0 +1,784 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Conversion benchmark. Generates a synthetic XM module from a seed,
+  so that the same options always give the same module, converts it
+  a number of times, and prints the time each step takes and the most
+  memory each step of the conversion had allocated as one line of JSON, so that results can be collected and
+  compared over time. With --kernels, times the kernels that check
+  whether pattern channels are empty instead, and with --text-output,
+  times the assembly output against printing it with one fprintf()
+  call per byte, as xm2nes used to.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "xm2nes.h"
+#include "memscan.h"
+
+/* Prints usage message and exits. */
+static void usage()
+{
+    printf(
+        "Usage: xm2nes-bench [--patterns=N] [--rows=N] [--channels=N]\n"
+        "                    [--orders=N] [--density=PERCENT] [--effects=PERCENT]\n"
+        "                    [--duplicates=PERCENT] [--seed=N] [--iterations=N]\n"
+        "                    [--chunk-dictionary] [--order-loops[=DEPTH]]\n"
+        "                    [--adaptive-patterns]\n"
+        "                    [--jobs=N] [--binary] [--kernels] [--text-output]\n"
+        "                    [--output=FILE] [--help]\n");
+    exit(0);
+}
+
+/* Prints help message and exits. */
+static void help()
+{
+    printf("Usage: xm2nes-bench [OPTION...]\n"
+           "Converts a generated XM module and prints the time of each step as JSON.\n\n"
+           "Options:\n\n"
+           "  --patterns=N                    Generate N patterns (64)\n"
+           "  --rows=N                        Generate N rows per pattern, at most 256 (64)\n"
+           "  --channels=N                    Generate N channels (5)\n"
+           "  --orders=N                      Generate an order table of N entries (128)\n"
+           "  --density=PERCENT               Put a note on PERCENT of the rows (50)\n"
+           "  --effects=PERCENT               Put an effect on PERCENT of the rows (20)\n"
+           "  --duplicates=PERCENT            Copy PERCENT of the pattern channels (25)\n"
+           "  --seed=N                        Generate the module from seed N (1)\n"
+           "  --iterations=N                  Convert the module N times (20)\n"
+           "  --chunk-dictionary              Convert with --chunk-dictionary\n"
+           "  --order-loops[=DEPTH]           Convert with --order-loops\n"
+           "  --adaptive-patterns             Convert with --adaptive-patterns\n"
+           "  --jobs=N                        Convert the channels on N threads (1)\n"
+           "  --binary                        Convert to binary output\n"
+           "  --kernels                       Time the empty channel check kernels\n"
+           "                                  instead of converting\n"
+           "  --text-output                   Time the assembly output against\n"
+           "                                  printing it with fprintf()\n"
+           "  --output=FILE                   Store the generated module in FILE and exit\n"
+           "  --help                          Give this help list\n"
+           "  --usage                         Give a short usage message\n");
+    exit(0);
+}
+
+/* The parameters of a generated module. */
+struct generator {
+    int pattern_count;
+    int row_count;
+    int channel_count;
+    int order_count;
+    int density;    /* percentage of rows with a note */
+    int effects;    /* percentage of rows with an effect */
+    int duplicates; /* percentage of pattern channels copied from another */
+    unsigned long seed;
+};
+
+/* The most rows of an XM pattern */
+#define MAX_XM_ROWS 256
+
+/* Returns the next pseudo-random number in [0, 2^31), as rand() would,
+   but with the same sequence on every platform. */
+static unsigned long next_random(unsigned long *state)
+{
+    *state = (*state * 1103515245ul + 12345ul) & 0xFFFFFFFFul;
+    return (*state >> 1) & 0x7FFFFFFFul;
+}
+
+/* Returns a pseudo-random number in [0, n). */
+static int random_below(unsigned long *state, int n)
+{
+    return (int)((next_random(state) >> 7) % (unsigned long)n);
+}
+
+/**
+  Fills \a slot of \a channel with a random note and effect, as
+  described by \a gen. Every note has an instrument, since the converter
+  needs one to look up the instrument's mapping. The DMC channel (4)
+  only gets notes and speed changes, which is all it supports.
+*/
+static void generate_slot(const struct generator *gen, int channel,
+                          unsigned long *state, struct xm_pattern_slot *slot)
+{
+    /* Effects that the converter supports */
+    static const unsigned char effect_types[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0xA, 0xC, 0xE, 0xF };
+    memset(slot, 0, sizeof(*slot));
+    if (random_below(state, 100) < gen->density) {
+        slot->note = 1 + random_below(state, 96);
+        slot->instrument = 1 + random_below(state, 8);
+        if ((channel != 4) && (random_below(state, 4) == 0))
+            slot->volume = 0x10 + random_below(state, 0x40);
+    }
+    if (random_below(state, 100) < gen->effects) {
+        if (channel == 4)
+            slot->effect_type = 0xF;
+        else
+            slot->effect_type = effect_types[random_below(state, sizeof(effect_types))];
+        switch (slot->effect_type) {
+            case 0xC:
+            slot->effect_param = random_below(state, 0x40);
+            break;
+            case 0xE:
+            slot->effect_param = 0xC0 | random_below(state, 16);
+            break;
+            case 0xF:
+            slot->effect_param = 1 + random_below(state, 0x1F);
+            break;
+            default:
+            slot->effect_param = 1 + random_below(state, 0xFF);
+            break;
+        }
+    }
+}
+
+/* Appends a little-endian 16-bit value to \a p. */
+static unsigned char *put_ushort(unsigned char *p, unsigned int value)
+{
+    *p++ = value & 0xFF;
+    *p++ = (value >> 8) & 0xFF;
+    return p;
+}
+
+static unsigned char *put_uint(unsigned char *p, unsigned long value)
+{
+    p = put_ushort(p, value & 0xFFFF);
+    return put_ushort(p, (value >> 16) & 0xFFFF);
+}
+
+/**
+  Appends the packed form of \a slot to \a p: only the fields that
+  are set, unless all of them are.
+*/
+static unsigned char *pack_slot(unsigned char *p, const struct xm_pattern_slot *slot)
+{
+    unsigned char flags = 0x80;
+    if (slot->note && slot->instrument && slot->volume && slot->effect_type && slot->effect_param) {
+        *p++ = slot->note;
+        *p++ = slot->instrument;
+        *p++ = slot->volume;
+        *p++ = slot->effect_type;
+        *p++ = slot->effect_param;
+        return p;
+    }
+    if (slot->note)
+        flags |= 0x01;
+    if (slot->instrument)
+        flags |= 0x02;
+    if (slot->volume)
+        flags |= 0x04;
+    if (slot->effect_type)
+        flags |= 0x08;
+    if (slot->effect_param)
+        flags |= 0x10;
+    *p++ = flags;
+    if (slot->note)
+        *p++ = slot->note;
+    if (slot->instrument)
+        *p++ = slot->instrument;
+    if (slot->volume)
+        *p++ = slot->volume;
+    if (slot->effect_type)
+        *p++ = slot->effect_type;
+    if (slot->effect_param)
+        *p++ = slot->effect_param;
+    return p;
+}
+
+/**
+  Generates the module described by \a gen. Returns the module's data,
+  which must be freed, and stores its size in \a size.
+*/
+static unsigned char *generate_module(const struct generator *gen, size_t *size)
+{
+    unsigned long state = gen->seed;
+    int slot_count = gen->row_count * gen->channel_count;
+    struct xm_pattern_slot *slots;
+    unsigned char *data;
+    unsigned char *p;
+    int i, chn, row;
+
+    /* The slots of each pattern, channel by channel */
+    slots = (struct xm_pattern_slot *)malloc(gen->pattern_count * slot_count * sizeof(struct xm_pattern_slot));
+    for (i = 0; i < gen->pattern_count; ++i) {
+        for (chn = 0; chn < gen->channel_count; ++chn) {
+            struct xm_pattern_slot *column = &slots[(i * gen->channel_count + chn) * gen->row_count];
+            if ((i > 0) && (random_below(&state, 100) < gen->duplicates)) {
+                int source = random_below(&state, i);
+                memcpy(column, &slots[(source * gen->channel_count + chn) * gen->row_count],
+                       gen->row_count * sizeof(struct xm_pattern_slot));
+                continue;
+            }
+            for (row = 0; row < gen->row_count; ++row)
+                generate_slot(gen, chn, &state, &column[row]);
+        }
+    }
+
+    /* Header, then each pattern: its header and up to 5 bytes per slot */
+    data = (unsigned char *)malloc(0x3C + 0x114 + gen->pattern_count * (9 + slot_count * 5));
+    p = data;
+    memcpy(p, "Extended module: ", 17);
+    p += 17;
+    memset(p, 0, 20);
+    memcpy(p, "xm2nes benchmark", 16);
+    p += 20;
+    *p++ = 0x1A;
+    memset(p, 0, 20);
+    memcpy(p, "xm2nes-bench", 12);
+    p += 20;
+    p = put_ushort(p, 0x0104);
+    p = put_uint(p, 0x0114);
+    p = put_ushort(p, gen->order_count);
+    p = put_ushort(p, 0); /* restart position */
+    p = put_ushort(p, gen->channel_count);
+    p = put_ushort(p, gen->pattern_count);
+    p = put_ushort(p, 0); /* instrument count */
+    p = put_ushort(p, 1); /* linear frequency table */
+    p = put_ushort(p, 6);
+    p = put_ushort(p, 125);
+    /* Play every pattern once, then random ones */
+    for (i = 0; i < 256; ++i) {
+        if (i >= gen->order_count)
+            *p++ = 0;
+        else if (i < gen->pattern_count)
+            *p++ = i;
+        else
+            *p++ = random_below(&state, gen->pattern_count);
+    }
+
+    for (i = 0; i < gen->pattern_count; ++i) {
+        unsigned char *size_field;
+        unsigned char *start;
+        p = put_uint(p, 9);
+        *p++ = 0; /* packing type */
+        p = put_ushort(p, gen->row_count);
+        size_field = p;
+        p += 2;
+        start = p;
+        for (row = 0; row < gen->row_count; ++row) {
+            for (chn = 0; chn < gen->channel_count; ++chn)
+                p = pack_slot(p, &slots[(i * gen->channel_count + chn) * gen->row_count + row]);
+        }
+        put_ushort(size_field, p - start);
+    }
+
+    free(slots);
+    *size = p - data;
+    return data;
+}
+
+/* Returns the current time in seconds. */
+static double current_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* The times of a step over all iterations. */
+struct step_result {
+    const char *name;
+    double total;
+    double best;
+};
+
+static void add_step_time(struct step_result *result, double time)
+{
+    result->total += time;
+    if ((result->best < 0) || (time < result->best))
+        result->best = time;
+}
+
+/**
+  Prints \a result as a JSON member. The throughput is the size of
+  the module divided by the best time.
+*/
+static void print_step_result(const struct step_result *result, size_t module_size,
+                              int iterations, int last)
+{
+    printf("\"%s\":{\"best_seconds\":%.6f,\"mean_seconds\":%.6f,\"mb_per_second\":%.3f}%s",
+           result->name, result->best, result->total / iterations,
+           (result->best > 0) ? module_size / result->best / 1000000.0 : 0.0,
+           last ? "" : ",");
+}
+
+/**
+  Times each memscan kernel that the CPU supports, checking whether
+  each channel of each pattern of \a xm is empty, as finding unused
+  channels does. Prints the times as JSON members. Returns 0, or -1 if
+  the kernels disagree.
+*/
+static int time_kernels(const struct xm *xm, int iterations)
+{
+    int best = memscan_best_kernel();
+    int expected_empty = -1;
+    size_t bytes = 0;
+    int kernel, i, chn;
+    for (i = 0; i < xm->header.pattern_count; ++i)
+        bytes += xm->patterns[i].row_count * xm->header.channel_count * sizeof(struct xm_pattern_slot);
+    for (kernel = MEMSCAN_SCALAR; kernel <= best; ++kernel) {
+        struct step_result result;
+        int empty = 0;
+        int n;
+        result.name = memscan_kernel_name(kernel);
+        result.total = 0;
+        result.best = -1;
+        for (n = 0; n < iterations; ++n) {
+            double start = current_time();
+            empty = 0;
+            for (i = 0; i < xm->header.pattern_count; ++i) {
+                const struct xm_pattern *pattern = &xm->patterns[i];
+                for (chn = 0; chn < xm->header.channel_count; ++chn) {
+                    empty += memscan_is_zero_with(kernel, xm_pattern_column(pattern, chn),
+                                                  pattern->row_count * sizeof(struct xm_pattern_slot));
+                }
+            }
+            add_step_time(&result, current_time() - start);
+        }
+        if ((expected_empty != -1) && (empty != expected_empty)) {
+            fprintf(stderr, "xm2nes-bench: the %s kernel finds %d empty channels, not %d\n",
+                    memscan_kernel_name(kernel), empty, expected_empty);
+            return(-1);
+        }
+        expected_empty = empty;
+        print_step_result(&result, bytes, iterations, kernel == best);
+    }
+    printf("},\"empty_channels\":%d", expected_empty);
+    return(0);
+}
+
+/* A line of assembly output; the bytes of a .db line are parsed. */
+struct text_line {
+    const char *text;
+    const unsigned char *bytes;
+    int byte_count; /* 0 if not a .db line */
+};
+
+/* Returns whether \a p up to \a end is a list of hex bytes: $XX,$XX,... */
+static int is_hex_byte_list(const char *p, const char *end)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+    for ( ; p + 3 <= end; p += 4) {
+        if ((p[0] != '$') || !p[1] || !strchr(hex_digits, p[1])
+            || !p[2] || !strchr(hex_digits, p[2]))
+            return 0;
+        if (p + 3 == end)
+            return 1;
+        if (p[3] != ',')
+            return 0;
+    }
+    return 0;
+}
+
+/**
+  Splits the \a size characters of assembly \a text into lines, which
+  are stored in \a lines, and parses the .db lines of hex bytes, as
+  opposed to those of the song header, into \a bytes.
+  Changes each newline of \a text to a null character. Returns the
+  number of lines.
+*/
+static int parse_text_output(char *text, size_t size, struct text_line *lines,
+                             unsigned char *bytes)
+{
+    int count = 0;
+    char *p = text;
+    while (p < text + size) {
+        struct text_line *line = &lines[count++];
+        char *end = (char *)memchr(p, '\n', text + size - p);
+        *end = '\0';
+        line->text = p;
+        line->bytes = bytes;
+        line->byte_count = 0;
+        if (!strncmp(p, ".db ", 4) && is_hex_byte_list(&p[4], end)) {
+            for (p += 4; p < end; p += 4) {
+                *bytes++ = (unsigned char)strtol(&p[1], 0, 16);
+                ++line->byte_count;
+            }
+        }
+        p = end + 1;
+    }
+    return count;
+}
+
+/**
+  Prints the \a count \a lines to \a out the way xm2nes did before it
+  buffered its output: one fprintf() call per byte of a .db line, and
+  one per other line.
+*/
+static void print_lines_with_fprintf(const struct text_line *lines, int count, FILE *out)
+{
+    int i, j;
+    for (i = 0; i < count; ++i) {
+        const struct text_line *line = &lines[i];
+        if (!line->byte_count) {
+            fprintf(out, "%s\n", line->text);
+            continue;
+        }
+        fprintf(out, ".db ");
+        for (j = 0; j < line->byte_count - 1; ++j)
+            fprintf(out, "$%.2X,", line->bytes[j]);
+        fprintf(out, "$%.2X\n", line->bytes[j]);
+    }
+}
+
+/**
+  Reads the contents of \a fp, from the start. Returns them, which must
+  be freed, and stores their size in \a size; or returns 0 on failure.
+*/
+static char *read_back(FILE *fp, size_t *size)
+{
+    long length;
+    char *data;
+    fflush(fp);
+    length = ftell(fp);
+    if (length < 0)
+        return 0;
+    data = (char *)malloc(length + 1);
+    rewind(fp);
+    if (!data || (fread(data, 1, length, fp) != (size_t)length)) {
+        free(data);
+        return 0;
+    }
+    *size = length;
+    return data;
+}
+
+/**
+  Converts \a xm to assembly \a iterations times, and times the output
+  step of each conversion against printing the same text with
+  print_lines_with_fprintf(); both write to a temporary file. Since the
+  output step also lays out the song, the comparison favours fprintf().
+  Prints the times as JSON members. Returns 0, or -1 if the outputs
+  differ or the conversion fails.
+*/
+static int time_text_output(struct xm *xm, struct xm2nes_options *options,
+                            int iterations)
+{
+    struct step_result buffered_result;
+    struct step_result fprintf_result;
+    struct text_line *lines = 0;
+    unsigned char *bytes = 0;
+    char *text = 0;
+    char *copy = 0;
+    char *printed;
+    size_t text_size = 0;
+    size_t printed_size;
+    int line_count = 0;
+    FILE *fp = tmpfile();
+    int ret = 0;
+    int i;
+    if (!fp) {
+        fprintf(stderr, "xm2nes-bench: failed to create a temporary file\n");
+        return(-1);
+    }
+    buffered_result.name = "buffered";
+    buffered_result.total = 0;
+    buffered_result.best = -1;
+    fprintf_result.name = "fprintf";
+    fprintf_result.total = 0;
+    fprintf_result.best = -1;
+
+    for (i = 0; i < iterations; ++i) {
+        struct xm2nes_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        options->stats = &stats;
+        rewind(fp);
+        ret = convert_xm_to_nes(xm, options, fp);
+        if (ret) {
+            fprintf(stderr, "xm2nes-bench: failed to convert module: %s\n", xm2nes_error_message(ret));
+            ret = -1;
+            break;
+        }
+        add_step_time(&buffered_result, stats.step_time[XM2NES_OUTPUT_STEP]);
+        if (i == 0)
+            text = read_back(fp, &text_size);
+    }
+    options->stats = 0;
+    if (!ret && text) {
+        /* Each line has at least a newline, and each byte takes 4 characters */
+        lines = (struct text_line *)malloc((text_size + 1) * sizeof(struct text_line));
+        bytes = (unsigned char *)malloc(text_size / 4 + 1);
+        copy = (char *)malloc(text_size + 1);
+    }
+    if (!ret && (!lines || !bytes || !copy)) {
+        fprintf(stderr, "xm2nes-bench: failed to read back the output\n");
+        ret = -1;
+    }
+    if (!ret) {
+        /* The lines point into a copy, so that the output can be compared */
+        memcpy(copy, text, text_size);
+        line_count = parse_text_output(copy, text_size, lines, bytes);
+        for (i = 0; i < iterations; ++i) {
+            double start;
+            rewind(fp);
+            start = current_time();
+            print_lines_with_fprintf(lines, line_count, fp);
+            add_step_time(&fprintf_result, current_time() - start);
+        }
+        printed = read_back(fp, &printed_size);
+        if (!printed || (printed_size != text_size) || memcmp(printed, text, text_size)) {
+            fprintf(stderr, "xm2nes-bench: the fprintf() output differs\n");
+            ret = -1;
+        }
+        free(printed);
+    }
+    if (!ret) {
+        printf("\"output_bytes\":%lu,\"text_output\":{", (unsigned long)text_size);
+        print_step_result(&fprintf_result, text_size, iterations, 0);
+        print_step_result(&buffered_result, text_size, iterations, 1);
+        printf("}");
+    }
+    free(lines);
+    free(bytes);
+    free(copy);
+    free(text);
+    fclose(fp);
+    return(ret);
+}
+
+int main(int argc, char *argv[])
+{
+    struct generator gen;
+    struct xm2nes_options options;
+    struct step_result read_result;
+    struct step_result step_results[XM2NES_STEP_COUNT];
+    struct step_result total_result;
+    const char *output_filename = 0;
+    int iterations = 20;
+    int binary = 0;
+    int kernels = 0;
+    int text_output = 0;
+    unsigned char *module;
+    size_t module_size;
+    size_t output_size = 0;
+    size_t step_memory[XM2NES_STEP_COUNT];
+    int i, j;
+    (void)argc;
+
+    gen.pattern_count = 64;
+    gen.row_count = 64;
+    gen.channel_count = 5;
+    gen.order_count = 128;
+    gen.density = 50;
+    gen.effects = 20;
+    gen.duplicates = 25;
+    gen.seed = 1;
+    memset(&options, 0, sizeof(options));
+    options.channels = 0x1F;
+    options.order_end_offset = -1;
+    /* Process arguments. */
+    {
+        char *p;
+        while ((p = *(++argv))) {
+            const char *opt = &p[2];
+            if (strncmp("--", p, 2)) {
+                fprintf(stderr, "xm2nes-bench: unexpected argument `%s'\n", p);
+                return(-1);
+            } else if (!strncmp("patterns=", opt, 9)) {
+                gen.pattern_count = strtol(&opt[9], 0, 0);
+            } else if (!strncmp("rows=", opt, 5)) {
+                gen.row_count = strtol(&opt[5], 0, 0);
+            } else if (!strncmp("channels=", opt, 9)) {
+                gen.channel_count = strtol(&opt[9], 0, 0);
+            } else if (!strncmp("orders=", opt, 7)) {
+                gen.order_count = strtol(&opt[7], 0, 0);
+            } else if (!strncmp("density=", opt, 8)) {
+                gen.density = strtol(&opt[8], 0, 0);
+            } else if (!strncmp("effects=", opt, 8)) {
+                gen.effects = strtol(&opt[8], 0, 0);
+            } else if (!strncmp("duplicates=", opt, 11)) {
+                gen.duplicates = strtol(&opt[11], 0, 0);
+            } else if (!strncmp("seed=", opt, 5)) {
+                gen.seed = strtoul(&opt[5], 0, 0);
+            } else if (!strncmp("iterations=", opt, 11)) {
+                iterations = strtol(&opt[11], 0, 0);
+            } else if (!strcmp("chunk-dictionary", opt)) {
+                options.chunk_dictionary = 1;
+            } else if (!strcmp("order-loops", opt)) {
+                options.order_loops = 2;
+            } else if (!strncmp("order-loops=", opt, 12)) {
+                options.order_loops = strtol(&opt[12], 0, 0);
+            } else if (!strcmp("adaptive-patterns", opt)) {
+                options.adaptive_patterns = 1;
+            } else if (!strncmp("jobs=", opt, 5)) {
+                options.jobs = strtol(&opt[5], 0, 0);
+            } else if (!strcmp("binary", opt)) {
+                binary = 1;
+            } else if (!strcmp("kernels", opt)) {
+                kernels = 1;
+            } else if (!strcmp("text-output", opt)) {
+                text_output = 1;
+            } else if (!strncmp("output=", opt, 7)) {
+                output_filename = &opt[7];
+            } else if (!strcmp("help", opt)) {
+                help();
+            } else if (!strcmp("usage", opt)) {
+                usage();
+            } else {
+                fprintf(stderr, "xm2nes-bench: unrecognized option `%s'\n"
+                        "Try `xm2nes-bench --help' for more information.\n", p);
+                return(-1);
+            }
+        }
+    }
+    if ((gen.pattern_count < 1) || (gen.pattern_count > 256)
+        || (gen.row_count < 1) || (gen.row_count > MAX_XM_ROWS)
+        || (gen.channel_count < 1) || (gen.channel_count > 32)
+        || (gen.order_count < 1) || (gen.order_count > 256)
+        || (iterations < 1)) {
+        fprintf(stderr, "xm2nes-bench: parameter out of range\n");
+        return(-1);
+    }
+
+    module = generate_module(&gen, &module_size);
+    if (output_filename) {
+        FILE *out = fopen(output_filename, "wb");
+        if (!out || (fwrite(module, 1, module_size, out) != module_size) || fclose(out)) {
+            fprintf(stderr, "xm2nes-bench: failed to write `%s'\n", output_filename);
+            return(-1);
+        }
+        free(module);
+        return(0);
+    }
+
+    if (kernels) {
+        struct xm xm;
+        int ret = xm_read_memory(module, module_size, 0, &xm);
+        if (ret) {
+            fprintf(stderr, "xm2nes-bench: failed to read module: %s\n", xm2nes_error_message(ret));
+            return(-1);
+        }
+        printf("{\"version\":1,"
+               "\"module\":{\"patterns\":%d,\"rows\":%d,\"channels\":%d,"
+               "\"density\":%d,\"effects\":%d,\"duplicates\":%d,\"seed\":%lu},"
+               "\"iterations\":%d,\"best_kernel\":\"%s\",\"kernels\":{",
+               gen.pattern_count, gen.row_count, gen.channel_count,
+               gen.density, gen.effects, gen.duplicates, gen.seed,
+               iterations, memscan_kernel_name(memscan_best_kernel()));
+        ret = time_kernels(&xm, iterations);
+        printf("}\n");
+        xm_destroy(&xm);
+        free(module);
+        return(ret);
+    }
+
+    if (text_output) {
+        struct xm xm;
+        int ret = xm_read_memory(module, module_size, 0, &xm);
+        if (ret) {
+            fprintf(stderr, "xm2nes-bench: failed to read module: %s\n", xm2nes_error_message(ret));
+            return(-1);
+        }
+        printf("{\"version\":1,"
+               "\"module\":{\"patterns\":%d,\"rows\":%d,\"channels\":%d,\"orders\":%d,"
+               "\"density\":%d,\"effects\":%d,\"duplicates\":%d,\"seed\":%lu},"
+               "\"iterations\":%d,",
+               gen.pattern_count, gen.row_count, gen.channel_count, gen.order_count,
+               gen.density, gen.effects, gen.duplicates, gen.seed, iterations);
+        /* As in a batch, each conversion reuses the memory of the one before */
+        options.arena = xm2nes_arena_create();
+        ret = time_text_output(&xm, &options, iterations);
+        printf("}\n");
+        xm2nes_arena_destroy(options.arena);
+        xm_destroy(&xm);
+        free(module);
+        return(ret);
+    }
+
+    read_result.name = "read";
+    read_result.total = 0;
+    read_result.best = -1;
+    for (j = 0; j < XM2NES_STEP_COUNT; ++j) {
+        step_results[j].name = xm2nes_step_name(j);
+        step_results[j].total = 0;
+        step_results[j].best = -1;
+    }
+    total_result.name = "total";
+    total_result.total = 0;
+    total_result.best = -1;
+
+    /* Reading decodes every pattern, as xm2nes does without --watch */
+    for (i = 0; i < iterations; ++i) {
+        struct xm xm;
+        double start = current_time();
+        int ret = xm_read_memory(module, module_size, 0, &xm);
+        add_step_time(&read_result, current_time() - start);
+        if (ret) {
+            fprintf(stderr, "xm2nes-bench: failed to read module: %s\n", xm2nes_error_message(ret));
+            return(-1);
+        }
+        xm_destroy(&xm);
+    }
+
+    /* As in a batch, each conversion reuses the memory of the one before */
+    options.arena = xm2nes_arena_create();
+    memset(step_memory, 0, sizeof(step_memory));
+    for (i = 0; i < iterations; ++i) {
+        struct xm2nes_stats stats;
+        struct xm2nes_buffer out;
+        struct xm2nes_buffer symbols;
+        double start;
+        int ret;
+        memset(&stats, 0, sizeof(stats));
+        memset(&out, 0, sizeof(out));
+        memset(&symbols, 0, sizeof(symbols));
+        options.stats = &stats;
+        start = current_time();
+        ret = xm2nes_convert_memory(module, module_size, &options, &out,
+                                    binary ? &symbols : 0);
+        add_step_time(&total_result, current_time() - start);
+        if (ret) {
+            fprintf(stderr, "xm2nes-bench: failed to convert module: %s\n", xm2nes_error_message(ret));
+            return(-1);
+        }
+        for (j = 0; j < XM2NES_STEP_COUNT; ++j) {
+            add_step_time(&step_results[j], stats.step_time[j]);
+            if (stats.step_memory[j] > step_memory[j])
+                step_memory[j] = stats.step_memory[j];
+        }
+        output_size = out.size + symbols.size;
+        free(out.data);
+        free(symbols.data);
+    }
+    xm2nes_arena_destroy(options.arena);
+
+    printf("{\"version\":1,"
+           "\"module\":{\"patterns\":%d,\"rows\":%d,\"channels\":%d,\"orders\":%d,"
+           "\"density\":%d,\"effects\":%d,\"duplicates\":%d,\"seed\":%lu,\"bytes\":%lu},"
+           "\"options\":{\"chunk_dictionary\":%d,\"order_loops\":%d,\"adaptive_patterns\":%d,\"jobs\":%d,\"binary\":%d},"
+           "\"iterations\":%d,\"output_bytes\":%lu,\"steps\":{",
+           gen.pattern_count, gen.row_count, gen.channel_count, gen.order_count,
+           gen.density, gen.effects, gen.duplicates, gen.seed, (unsigned long)module_size,
+           options.chunk_dictionary, options.order_loops, options.adaptive_patterns, (options.jobs > 1) ? options.jobs : 1, binary,
+           iterations, (unsigned long)output_size);
+    print_step_result(&read_result, module_size, iterations, 0);
+    for (j = 0; j < XM2NES_STEP_COUNT; ++j)
+        print_step_result(&step_results[j], module_size, iterations, 0);
+    print_step_result(&total_result, module_size, iterations, 1);
+    /* The arena only grows during a conversion, so each value includes
+       the earlier ones */
+    printf("},\"peak_arena_bytes\":{");
+    for (j = 0; j < XM2NES_STEP_COUNT; ++j) {
+        printf("\"%s\":%lu%s", xm2nes_step_name(j), (unsigned long)step_memory[j],
+               (j < XM2NES_STEP_COUNT - 1) ? "," : "");
+    }
+    printf("}}\n");
+
+    free(module);
+    return(0);
+}
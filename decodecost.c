@@ -0,0 +1,158 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "xm2nes.h"
+
+/* The name of each cost in a cost file, and where it is stored */
+static const struct {
+    const char *name;
+    size_t offset;
+} cost_fields[] = {
+    { "row", offsetof(struct decode_costs, row) },
+    { "flags", offsetof(struct decode_costs, flags) },
+    { "chunk", offsetof(struct decode_costs, chunk) },
+    { "format", offsetof(struct decode_costs, format) },
+    { "skip", offsetof(struct decode_costs, skip) },
+    { "note", offsetof(struct decode_costs, note) },
+    { "end_row", offsetof(struct decode_costs, end_row) },
+    { "release", offsetof(struct decode_costs, release) },
+    { "instrument", offsetof(struct decode_costs, instrument) },
+    { "instrument_long", offsetof(struct decode_costs, instrument_long) },
+    { "speed", offsetof(struct decode_costs, speed) },
+    { "speed_long", offsetof(struct decode_costs, speed_long) },
+    { "volume", offsetof(struct decode_costs, volume) },
+    { "effect", offsetof(struct decode_costs, effect) },
+    { "pattern", offsetof(struct decode_costs, pattern) },
+    { "order", offsetof(struct decode_costs, order) },
+    { "loop_start", offsetof(struct decode_costs, loop_start) },
+    { "loop_end", offsetof(struct decode_costs, loop_end) },
+    { "song_loop", offsetof(struct decode_costs, song_loop) },
+    { "frame_budget", offsetof(struct decode_costs, frame_budget) }
+};
+
+#define COST_FIELD_COUNT (int)(sizeof(cost_fields) / sizeof(cost_fields[0]))
+
+/* Default costs, roughly those of Kent's player. */
+void init_decode_costs(struct decode_costs *costs)
+{
+    costs->row = 20;
+    costs->flags = 16;
+    costs->chunk = 30;
+    costs->format = 12;
+    costs->skip = 24;
+    costs->note = 40;
+    costs->end_row = 10;
+    costs->release = 16;
+    costs->instrument = 26;
+    costs->instrument_long = 32;
+    costs->speed = 14;
+    costs->speed_long = 20;
+    costs->volume = 16;
+    costs->effect = 28;
+    costs->pattern = 48;
+    costs->order = 22;
+    costs->loop_start = 26;
+    costs->loop_end = 20;
+    costs->song_loop = 24;
+    costs->frame_budget = 0;
+}
+
+static void report(void (*diagnostic)(void *, const char *), void *context,
+                   const char *format, ...)
+{
+    char message[1024];
+    va_list args;
+    if (!diagnostic)
+        return;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    diagnostic(context, message);
+}
+
+/**
+  Parses the decode costs defined by the \a size bytes of \a text into
+  \a costs, which should have been initialized with init_decode_costs().
+  The text consists of name:value pairs, separated by whitespace; lines
+  starting with '#' are comments. Errors are passed to \a diagnostic
+  (if not 0) with \a context, prefixed by \a path. Returns XM_NO_ERROR,
+  or XM2NES_DECODE_COSTS_ERROR if the text is invalid.
+*/
+int parse_decode_costs(const char *text, size_t size, const char *path,
+                       struct decode_costs *costs,
+                       void (*diagnostic)(void *, const char *), void *context)
+{
+    size_t pos = 0;
+    int lineno = 1;
+    while (pos < size) {
+        size_t start;
+        int field;
+        char value[32];
+        int len;
+        char *end;
+        if (text[pos] == '\n') {
+            ++lineno;
+            ++pos;
+            continue;
+        }
+        if (isspace((unsigned char)text[pos])) {
+            ++pos;
+            continue;
+        }
+        if (text[pos] == '#') {
+            while ((pos < size) && (text[pos] != '\n'))
+                ++pos;
+            continue;
+        }
+        start = pos;
+        while ((pos < size) && (isalpha((unsigned char)text[pos]) || (text[pos] == '_')))
+            ++pos;
+        for (field = 0; field < COST_FIELD_COUNT; ++field) {
+            if ((strlen(cost_fields[field].name) == pos - start)
+                && !strncmp(&text[start], cost_fields[field].name, pos - start)) {
+                break;
+            }
+        }
+        if (field == COST_FIELD_COUNT) {
+            report(diagnostic, context, "%s:%d: unknown cost `%.*s'", path, lineno,
+                   (int)(pos - start), &text[start]);
+            return XM2NES_DECODE_COSTS_ERROR;
+        }
+        if ((pos == size) || (text[pos] != ':')) {
+            report(diagnostic, context, "%s:%d: : expected", path, lineno);
+            return XM2NES_DECODE_COSTS_ERROR;
+        }
+        ++pos;
+        for (len = 0; (pos < size) && (len < (int)sizeof(value) - 1)
+                 && isalnum((unsigned char)text[pos]); ++len)
+            value[len] = text[pos++];
+        value[len] = '\0';
+        *(int *)((char *)costs + cost_fields[field].offset) = strtol(value, &end, 0);
+        if (!len || *end || (*(int *)((char *)costs + cost_fields[field].offset) < 0)) {
+            report(diagnostic, context, "%s:%d: invalid value for `%s'", path, lineno,
+                   cost_fields[field].name);
+            return XM2NES_DECODE_COSTS_ERROR;
+        }
+    }
+    return XM_NO_ERROR;
+}
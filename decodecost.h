@@ -0,0 +1,53 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DECODECOST_H
+#define DECODECOST_H
+
+#include <stddef.h>
+
+/* Estimated CPU cycles the NES player takes to decode each part of
+   the pattern and order data. */
+struct decode_costs {
+    int row;             /* each row of a channel, even one without data */
+    int flags;           /* the active rows byte of an 8-row chunk */
+    int chunk;           /* a chunk dictionary reference */
+    int format;          /* the format of a pattern, with adaptive patterns */
+    int skip;            /* $F4 and its count */
+    int note;            /* a note, which ends the row */
+    int end_row;         /* $F3 */
+    int release;         /* $F1 */
+    int instrument;      /* $B0-$BF */
+    int instrument_long; /* $F0 and its operand */
+    int speed;           /* $C0-$CF */
+    int speed_long;      /* $F2 and its operand */
+    int volume;          /* $D0-$DF */
+    int effect;          /* $E0-$EF, and its operand */
+    int pattern;         /* starting a pattern: its pointer and row count */
+    int order;           /* a pattern table index in an order table */
+    int loop_start;      /* $FB and its count */
+    int loop_end;        /* $FC */
+    int song_loop;       /* $FE and its offset */
+    int frame_budget;    /* cycles a frame may take, or 0 for no limit */
+};
+
+void init_decode_costs(struct decode_costs *);
+int parse_decode_costs(const char *, size_t, const char *,
+                       struct decode_costs *,
+                       void (*)(void *, const char *), void *);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A directory of converted files, named after a hash of everything
+  the conversion depends on. Each entry starts with the full SHA-256
+  digest of that data, so that an entry is only used for the exact
+  conversion it was made by. Entries are written to a temporary file
+  and renamed into place, so that processes and threads sharing the
+  directory never see a partial entry. When the directory grows beyond
+  its maximum size, the least recently used entries are removed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "diskcache.h"
+
+static const char entry_magic[8] = { 'x', 'm', '2', 'n', 'e', 's', 'C', '3' };
+
+#define DIGEST_SIZE 32
+/* The magic, the key's digest, and the sizes of the output, the symbols
+   and the warnings */
+#define ENTRY_HEADER_SIZE (8 + DIGEST_SIZE + 12)
+#define KEY_LENGTH 16 /* hex digits */
+#define STALE_TEMP_SECONDS 3600
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & 0xFFFFFFFFu)
+
+/* Adds the 64-byte block of \a key to its SHA-256 state. */
+static void sha256_transform(struct disk_cache_key *key)
+{
+    unsigned int w[64];
+    unsigned int a, b, c, d, e, f, g, h;
+    int i;
+    for (i = 0; i < 16; ++i) {
+        w[i] = ((unsigned int)key->block[i*4] << 24) | ((unsigned int)key->block[i*4+1] << 16)
+            | ((unsigned int)key->block[i*4+2] << 8) | key->block[i*4+3];
+    }
+    for (i = 16; i < 64; ++i) {
+        unsigned int s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = (w[i-16] + s0 + w[i-7] + s1) & 0xFFFFFFFFu;
+    }
+    a = key->state[0]; b = key->state[1]; c = key->state[2]; d = key->state[3];
+    e = key->state[4]; f = key->state[5]; g = key->state[6]; h = key->state[7];
+    for (i = 0; i < 64; ++i) {
+        unsigned int s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        unsigned int ch = (e & f) ^ (~e & g);
+        unsigned int t1 = (h + s1 + ch + sha256_k[i] + w[i]) & 0xFFFFFFFFu;
+        unsigned int s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+        unsigned int t2 = (s0 + maj) & 0xFFFFFFFFu;
+        h = g; g = f; f = e;
+        e = (d + t1) & 0xFFFFFFFFu;
+        d = c; c = b; b = a;
+        a = (t1 + t2) & 0xFFFFFFFFu;
+    }
+    key->state[0] += a; key->state[1] += b; key->state[2] += c; key->state[3] += d;
+    key->state[4] += e; key->state[5] += f; key->state[6] += g; key->state[7] += h;
+    for (i = 0; i < 8; ++i)
+        key->state[i] &= 0xFFFFFFFFu;
+}
+
+void disk_cache_key_init(struct disk_cache_key *key)
+{
+    static const unsigned int initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(key->state, initial_state, sizeof(initial_state));
+    key->length = 0;
+}
+
+void disk_cache_key_add(struct disk_cache_key *key, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        key->block[key->length++ & 63] = p[i];
+        if ((key->length & 63) == 0)
+            sha256_transform(key);
+    }
+}
+
+/* Stores the SHA-256 digest of the data added to \a key in \a digest. */
+static void key_digest(const struct disk_cache_key *key, unsigned char *digest)
+{
+    struct disk_cache_key k = *key;
+    unsigned char length[8];
+    unsigned char pad = 0x80;
+    int i;
+    for (i = 0; i < 8; ++i)
+        length[i] = (unsigned char)((key->length * 8) >> (56 - i*8));
+    disk_cache_key_add(&k, &pad, 1);
+    pad = 0;
+    while ((k.length & 63) != 56)
+        disk_cache_key_add(&k, &pad, 1);
+    disk_cache_key_add(&k, length, 8);
+    for (i = 0; i < 32; ++i)
+        digest[i] = (unsigned char)(k.state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void disk_cache_key_add_int(struct disk_cache_key *key, int value)
+{
+    unsigned char bytes[4];
+    bytes[0] = value & 0xFF;
+    bytes[1] = (value >> 8) & 0xFF;
+    bytes[2] = (value >> 16) & 0xFF;
+    bytes[3] = (value >> 24) & 0xFF;
+    disk_cache_key_add(key, bytes, 4);
+}
+
+/* Adds the string \a s, or a marker if it is 0. */
+void disk_cache_key_add_string(struct disk_cache_key *key, const char *s)
+{
+    if (!s) {
+        disk_cache_key_add_int(key, -1);
+        return;
+    }
+    disk_cache_key_add_int(key, strlen(s));
+    disk_cache_key_add(key, s, strlen(s));
+}
+
+/**
+  Returns the path in \a dir of the entry whose key has the given
+  \a digest; it is named after the first bytes. Must be freed.
+*/
+static char *entry_path(const char *dir, const unsigned char *digest)
+{
+    char *path = (char *)malloc(strlen(dir) + KEY_LENGTH + 2);
+    int len = sprintf(path, "%s/", dir);
+    int i;
+    for (i = 0; i < KEY_LENGTH / 2; ++i)
+        len += sprintf(&path[len], "%.2x", digest[i]);
+    return path;
+}
+
+static void write_uint(unsigned char *p, unsigned long value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static unsigned long read_uint(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Copies \a size bytes from \a in to \a out (if not 0). */
+static int copy_bytes(FILE *in, FILE *out, long size)
+{
+    char buf[8192];
+    while (size > 0) {
+        size_t count = fread(buf, 1, (size < (long)sizeof(buf)) ? size : sizeof(buf), in);
+        if (count == 0)
+            return 0;
+        if (out && (fwrite(buf, 1, count, out) != count))
+            return 0;
+        size -= count;
+    }
+    return 1;
+}
+
+/**
+  Looks up the entry of \a key in the cache directory \a dir. If it
+  exists, writes the stored output to \a out, the stored symbols to
+  \a symbols_out (if not 0) and the warnings of the conversion to
+  \a messages_out, and returns 1. The entry is read in full before
+  anything is written, so a miss (0) leaves the files untouched.
+  Returns -1 if writing to \a out or \a symbols_out failed.
+*/
+int disk_cache_fetch(const char *dir, const struct disk_cache_key *key,
+                     FILE *out, FILE *symbols_out, FILE *messages_out)
+{
+    unsigned char digest[DIGEST_SIZE];
+    char *path;
+    FILE *in;
+    unsigned char header[ENTRY_HEADER_SIZE];
+    unsigned char *contents = 0;
+    struct stat st;
+    unsigned long output_size, symbols_size, messages_size, size;
+    int ok = 0;
+    key_digest(key, digest);
+    path = entry_path(dir, digest);
+    in = fopen(path, "rb");
+    if (!in) {
+        free(path);
+        return 0;
+    }
+    /* An entry whose name matches but whose digest doesn't is of another key */
+    if ((fread(header, 1, ENTRY_HEADER_SIZE, in) == ENTRY_HEADER_SIZE)
+        && !memcmp(header, entry_magic, sizeof(entry_magic))
+        && !memcmp(&header[8], digest, DIGEST_SIZE)
+        && !fstat(fileno(in), &st)) {
+        output_size = read_uint(&header[8 + DIGEST_SIZE]);
+        symbols_size = read_uint(&header[12 + DIGEST_SIZE]);
+        messages_size = read_uint(&header[16 + DIGEST_SIZE]);
+        size = output_size + symbols_size + messages_size;
+        if ((unsigned long)st.st_size == ENTRY_HEADER_SIZE + size) {
+            contents = (unsigned char *)malloc(size + 1);
+            ok = contents && (fread(contents, 1, size, in) == size);
+        }
+    }
+    fclose(in);
+    if (ok) {
+        utime(path, 0); /* mark as recently used */
+        if ((fwrite(contents, 1, output_size, out) != output_size)
+            || (symbols_out && (fwrite(&contents[output_size], 1, symbols_size, symbols_out)
+                                != symbols_size))) {
+            ok = -1;
+        }
+        fwrite(&contents[output_size + symbols_size], 1, messages_size, messages_out);
+    }
+    free(contents);
+    free(path);
+    return ok;
+}
+
+/* A file in the cache directory, when evicting. */
+struct dir_entry {
+    char *path;
+    time_t mtime;
+    long size;
+};
+
+static int compare_dir_entries(const void *a, const void *b)
+{
+    const struct dir_entry *e1 = (const struct dir_entry *)a;
+    const struct dir_entry *e2 = (const struct dir_entry *)b;
+    if (e1->mtime != e2->mtime)
+        return (e1->mtime < e2->mtime) ? -1 : 1;
+    return strcmp(e1->path, e2->path);
+}
+
+static int is_entry_name(const char *name)
+{
+    int i;
+    for (i = 0; i < KEY_LENGTH; ++i) {
+        if (!name[i] || !strchr("0123456789abcdef", name[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+  Removes the least recently used entries of the cache directory \a dir
+  until the entries take up at most \a max_size bytes. Also removes
+  temporary files left behind by writers that didn't finish.
+*/
+static void evict(const char *dir, long max_size)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    struct dir_entry *entries = 0;
+    int count = 0;
+    int capacity = 0;
+    long total_size = 0;
+    time_t now = time(0);
+    int i;
+    if (!d)
+        return;
+    while ((de = readdir(d))) {
+        struct stat st;
+        char *path;
+        if (!is_entry_name(de->d_name))
+            continue;
+        path = (char *)malloc(strlen(dir) + strlen(de->d_name) + 2);
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        if (de->d_name[KEY_LENGTH] != '\0') {
+            /* A temporary file */
+            if (now - st.st_mtime > STALE_TEMP_SECONDS)
+                unlink(path);
+            free(path);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = (struct dir_entry *)realloc(entries, capacity * sizeof(struct dir_entry));
+        }
+        entries[count].path = path;
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        total_size += st.st_size;
+        ++count;
+    }
+    closedir(d);
+    if (total_size > max_size) {
+        qsort(entries, count, sizeof(struct dir_entry), compare_dir_entries);
+        /* Another process may be evicting too; it doesn't matter which removes an entry */
+        for (i = 0; (i < count) && (total_size > max_size); ++i) {
+            unlink(entries[i].path);
+            total_size -= entries[i].size;
+        }
+    }
+    for (i = 0; i < count; ++i)
+        free(entries[i].path);
+    free(entries);
+}
+
+/**
+  Stores the contents of \a output, \a symbols and \a messages, the
+  warnings of the conversion (both of which may be 0), as the entry of
+  \a key in the cache directory \a dir, which is created if
+  it doesn't exist, then evicts entries to keep the directory within
+  \a max_size bytes. Returns 1 on success, otherwise 0.
+*/
+int disk_cache_store(const char *dir, const struct disk_cache_key *key,
+                     FILE *output, FILE *symbols, FILE *messages, long max_size)
+{
+    unsigned char digest[DIGEST_SIZE];
+    char *path;
+    char *temp_path;
+    unsigned char header[ENTRY_HEADER_SIZE];
+    long output_size, symbols_size = 0, messages_size = 0;
+    FILE *fp;
+    int fd;
+    int ok;
+
+    key_digest(key, digest);
+    path = entry_path(dir, digest);
+    mkdir(dir, 0777);
+    temp_path = (char *)malloc(strlen(path) + 8);
+    sprintf(temp_path, "%s.XXXXXX", path);
+    fd = mkstemp(temp_path);
+    if ((fd == -1) || !(fp = fdopen(fd, "wb"))) {
+        if (fd != -1)
+            close(fd);
+        free(temp_path);
+        free(path);
+        return 0;
+    }
+
+    fseek(output, 0, SEEK_END);
+    output_size = ftell(output);
+    rewind(output);
+    if (symbols) {
+        fseek(symbols, 0, SEEK_END);
+        symbols_size = ftell(symbols);
+        rewind(symbols);
+    }
+    if (messages) {
+        fseek(messages, 0, SEEK_END);
+        messages_size = ftell(messages);
+        rewind(messages);
+    }
+    memcpy(header, entry_magic, sizeof(entry_magic));
+    memcpy(&header[8], digest, DIGEST_SIZE);
+    write_uint(&header[8 + DIGEST_SIZE], output_size);
+    write_uint(&header[12 + DIGEST_SIZE], symbols_size);
+    write_uint(&header[16 + DIGEST_SIZE], messages_size);
+    ok = (fwrite(header, 1, ENTRY_HEADER_SIZE, fp) == ENTRY_HEADER_SIZE)
+        && copy_bytes(output, fp, output_size)
+        && (!symbols || copy_bytes(symbols, fp, symbols_size))
+        && (!messages || copy_bytes(messages, fp, messages_size));
+    if (fclose(fp))
+        ok = 0;
+    if (ok)
+        ok = !rename(temp_path, path);
+    if (!ok)
+        unlink(temp_path);
+    free(temp_path);
+    free(path);
+
+    evict(dir, max_size);
+    return ok;
+}
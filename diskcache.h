@@ -0,0 +1,40 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Builds the key of a cache entry from everything the output depends
+   on: a SHA-256 digest, computed as the data is added. */
+struct disk_cache_key {
+    unsigned int state[8];
+    unsigned char block[64];
+    unsigned long long length; /* bytes added */
+};
+
+void disk_cache_key_init(struct disk_cache_key *);
+void disk_cache_key_add(struct disk_cache_key *, const void *, size_t);
+void disk_cache_key_add_int(struct disk_cache_key *, int);
+void disk_cache_key_add_string(struct disk_cache_key *, const char *);
+
+int disk_cache_fetch(const char *, const struct disk_cache_key *, FILE *, FILE *, FILE *);
+int disk_cache_store(const char *, const struct disk_cache_key *, FILE *, FILE *, FILE *, long);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Checks the pattern encoder against the two-pass encoder that it
+  replaced, a frozen copy of which is kept here. The two-pass encoder
+  worked out the active rows byte of a chunk in a first pass and output
+  the rows in a second one, and the two passes didn't always agree on
+  the parameter of an effect. Every channel of every pattern of the
+  given modules is converted by both; the results must be identical,
+  except for patterns in which the first pass left out a row that the
+  second pass would have changed the effect parameter in. Built with
+  the library's own source, to reach its internal functions.
+*/
+
+#include <assert.h>
+
+#include "xm2nes.c"
+
+/**
+  The two-pass version of convert_xm_pattern_to_nes(), as it was.
+  Returns the number of rows whose effect parameter change was left out.
+*/
+static int convert_xm_pattern_to_nes_two_pass(const struct xm_pattern *pattern, int channel,
+                                              const struct xm2nes_options *options,
+                                              int first_row, const struct channel_state *initial,
+                                              struct arena *arena, struct encoded_pattern *out)
+{
+    int dropped = 0;
+    const struct instr_mapping *instr_map = options->instr_map;
+    unsigned char lastinstr = initial->instrument;
+    unsigned char lastefftype = initial->effect_type;
+    unsigned char lasteffparam = initial->effect_param;
+    const struct xm_pattern_slot *slots = xm_pattern_column(pattern, channel);
+    int row;
+    /* The row count, then a flags byte for each chunk and the rows */
+    int sz = 1 + (pattern->row_count - first_row + 7) / 8
+        + (pattern->row_count - first_row) * MAX_ENCODED_ROW_SIZE;
+    unsigned char *data = (unsigned char *)arena_alloc(arena, sz);
+    int pos = 0;
+    data[pos++] = pattern->row_count - first_row;
+    out->chunk_count = 0;
+    /* process channel in 8-row chunks */
+    for (row = first_row; row < pattern->row_count; row += 8) {
+        int i;
+        int count;
+        unsigned char copy[3];
+        unsigned char flags = 0;
+        copy[0] = lastinstr;
+        copy[1] = lastefftype;
+        copy[2] = lasteffparam;
+        count = min(8, pattern->row_count - row);
+        /* First pass: calculate active rows byte */
+        for (i = 0; i < count; ++i) {
+            const struct xm_pattern_slot *n = &slots[row+i];
+            if (n->note != 0) {
+                flags |= 1 << i;
+            }
+
+            if (n->effect_type == 0 && lastefftype != 0) {
+                /* Effect will be cleared */
+                flags |= 1 << i;
+            }
+
+            if ((n->instrument != 0) && (n->instrument != lastinstr)) {
+                lastinstr = n->instrument;
+                flags |= 1 << i;
+                /* setting instrument resets effect */
+                lastefftype = 0;
+                lasteffparam = 0;
+            }
+
+            if (n->volume != 0) {
+                if ((n->volume >= 0x10) && (n->volume < 0x50) /* set volume */) {
+                    if (channel == 4)
+                       diagnostic(options, "volume channel bytes are ignored for channel 4 (DMC)");
+                    else
+                        flags |= 1 << i;
+                }
+            }
+
+            if (n->effect_type != 0 && ((n->effect_type != lastefftype)
+                || ((n->effect_param != lasteffparam) && (n->effect_param != 0)))) {
+                if (n->effect_param != 0)
+                    lasteffparam = n->effect_param;
+                flags |= 1 << i;
+            }
+            lastefftype = n->effect_type;
+        }
+        out->chunk_offsets[out->chunk_count] = pos;
+        out->chunk_states[out->chunk_count].instrument = copy[0];
+        out->chunk_states[out->chunk_count].effect_type = copy[1];
+        out->chunk_states[out->chunk_count].effect_param = copy[2];
+        ++out->chunk_count;
+        data[pos++] = flags;
+
+        /* Second pass: the actual note+effect data for these 8 rows */
+        /* Note that the conditions for outputting data should exactly
+           match those in the first pass! */
+        lastinstr = copy[0];
+        lastefftype = copy[1];
+        lasteffparam = copy[2];
+        for (i = 0; i < count; ++i) {
+            const struct xm_pattern_slot *n = &slots[row+i];
+            if (!(flags & (1 << i))) {
+                /* The first pass has left out a change of the parameter
+                   of an effect that keeps it */
+                if ((channel != 4) && (n->effect_type == lastefftype)
+                    && (((n->effect_type >= 0x1) && (n->effect_type <= 0x7)) || (n->effect_type == 0xA))
+                    && (n->effect_param != 0) && (n->effect_param != lasteffparam)) {
+                    ++dropped;
+                }
+                lastefftype = n->effect_type;
+                continue;
+            }
+
+            switch (channel) {
+                case 0:
+                case 1:
+                case 2:
+                case 3:
+                if (n->volume != 0) {
+                    if ((n->volume >= 0x10) && (n->volume < 0x50)) {
+                        /* set new channel volume */
+                        data[pos++] = SET_VOLUME_COMMAND_BASE | ((n->volume - 0x10) >> 2);
+                    } else {
+                        diagnostic(options, "ignoring volume value %2x in channel %d, row %d",
+                            n->volume, channel, row+i);
+                    }
+                }
+
+                if (n->effect_type == 0 && lastefftype != 0) {
+                    /* Clear effect */
+                    data[pos++] = SET_EFFECT_COMMAND_BASE;
+                }
+
+                if (n->instrument && (n->instrument != lastinstr)) {
+                    if (instr_map[n->instrument - 1].target_instr < 0x10) {
+                        data[pos++] = SET_INSTRUMENT_COMMAND_BASE | instr_map[n->instrument - 1].target_instr;
+                    } else {
+                        data[pos++] = SET_INSTRUMENT_COMMAND;
+                        data[pos++] = instr_map[n->instrument - 1].target_instr;
+                    }
+                    lastinstr = n->instrument;
+                    /* setting instrument resets effect */
+                    lastefftype = 0;
+                    lasteffparam = 0;
+                }
+
+                if (n->effect_type != 0 && ((n->effect_type != lastefftype)
+                    || ((n->effect_param != lasteffparam) && (n->effect_param != 0)))) {
+                    switch (n->effect_type) {
+                        case 0x1:
+                        case 0x2:
+                        case 0x3:
+                        case 0x4:
+                        case 0x5: /* This is actually arpeggio -- see hack in xm.c */
+                        case 0x6:
+                        case 0x7:
+                        case 0xA: {
+                            unsigned char tp = n->effect_type;
+                            if (tp == 0xA)
+                                tp = 6; /* volume slide mapped to 6 */
+                            data[pos++] = SET_EFFECT_COMMAND_BASE | tp;
+                            if (n->effect_param != 0)
+                                lasteffparam = n->effect_param;
+                            data[pos++] = lasteffparam;
+                            break;
+                        }
+
+                        case 0xC:
+                        data[pos++] = SET_VOLUME_COMMAND_BASE | (n->effect_param >> 2);
+                        break;
+
+                        case 0xE:
+                        switch ((n->effect_param & 0xF0) >> 4) {
+                            case 0x8: /* pulse modulation */
+                                data[pos++] = SET_EFFECT_COMMAND_BASE | 9;
+                                data[pos++] = n->effect_param & 0x0F;
+                                break;
+                            case 0xC: /* note cut */
+                                data[pos++] = SET_EFFECT_COMMAND_BASE | 8;
+                                data[pos++] = n->effect_param & 0x0F;
+                                break;
+                            default:
+                                diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
+                                        n->effect_type, n->effect_param, channel, row+i);
+                                break;
+                        }
+                        break;
+
+                        case 0xF:
+                        if (n->effect_param < 0x10) {
+                            data[pos++] = SET_SPEED_COMMAND_BASE | n->effect_param;
+                        } else {
+                            data[pos++] = SET_SPEED_COMMAND;
+                            data[pos++] = n->effect_param;
+                        }
+                        break;
+
+                        default:
+                        diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
+                            n->effect_type, n->effect_param, channel, row+i);
+                        break;
+                    }
+                }
+                lastefftype = n->effect_type;
+
+                if (n->note != 0) {
+                    if (n->note == 0x61) {
+                    data[pos++] = RELEASE_COMMAND;
+                    data[pos++] = END_ROW_COMMAND;
+                    } else {
+                        /* A note before any instrument isn't transposed */
+                        int transpose = 0;
+                        if ((lastinstr >= 1) && (lastinstr <= 128))
+                            transpose = instr_map[lastinstr-1].transpose;
+                        data[pos++] = n->note + transpose;
+                        if (data[pos-1] >= 0x80)
+                            data[pos-1] = 0;
+                    }
+                } else
+                    data[pos++] = END_ROW_COMMAND;
+                break;
+
+                /* dpcm */
+                case 4:
+                if (n->effect_type != 0) {
+                    switch (n->effect_type) {
+                        case 0xF:
+                            if (n->effect_param < 0x10) {
+                                data[pos++] = SET_SPEED_COMMAND_BASE | n->effect_param;
+                            } else {
+                                data[pos++] = SET_SPEED_COMMAND;
+                                data[pos++] = n->effect_param;
+                            }
+                            break;
+                        default:
+                            diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
+                                    n->effect_type, n->effect_param, channel, row+i);
+                            ;
+                    }
+                }
+                if ((n->note != 0) && (n->instrument == 0)) {
+                    /* The sample is chosen by the instrument */
+                    diagnostic(options, "ignoring note without instrument in channel %d, row %d",
+                               channel, row+i);
+                    data[pos++] = END_ROW_COMMAND;
+                } else if (n->note != 0) {
+                    unsigned char dmc_sample_index = instr_map[n->instrument - 1].target_instr;
+                    if (instr_map[n->instrument - 1].transpose != 0) {
+                        /* Transpose is used to indicate that this is a "multi-sample" */
+                        /* Ideally there should be a separate attribute for that */
+                        dmc_sample_index += n->note + instr_map[n->instrument - 1].transpose;
+                    }
+                    data[pos++] = dmc_sample_index;
+                } else
+                    data[pos++] = END_ROW_COMMAND;
+                break;
+            }
+        }
+    }
+
+    assert(pos <= sz);
+    arena_shrink(arena, data, pos);
+    out->data = data;
+    out->size = pos;
+    return dropped;
+}
+
+/* The rows of a channel that the first pass of the two-pass encoder
+   gets wrong: the change of the portamento parameter in the last one
+   was left out. Its notes, instruments, volumes, effects and parameters. */
+static const struct xm_pattern_slot dropped_parameter_rows[8] = {
+    { 49, 1, 0, 0x1, 0x05 },
+    { 0, 0, 0, 0xC, 0x08 },
+    { 0, 0, 0, 0x1, 0x00 },
+    { 0, 0, 0, 0x1, 0x08 },
+    { 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0 }
+};
+
+static int same_encoding(const struct encoded_pattern *a, const struct encoded_pattern *b)
+{
+    return (a->size == b->size) && !memcmp(a->data, b->data, a->size)
+        && (a->chunk_count == b->chunk_count)
+        && !memcmp(a->chunk_offsets, b->chunk_offsets, a->chunk_count * sizeof(int))
+        && !memcmp(a->chunk_states, b->chunk_states, a->chunk_count * sizeof(struct channel_state));
+}
+
+/**
+  Converts \a channel of \a pattern with both encoders, starting with
+  each of the instruments in \a instruments (0xFF for unknown). Adds
+  the number of patterns that differ as expected to \a expected. Returns
+  the number of patterns that differ although they shouldn't, which are
+  printed with \a name.
+*/
+static int check_channel(const char *name, int pattern_index,
+                         const struct xm_pattern *pattern, int channel,
+                         const struct xm2nes_options *options, int *expected)
+{
+    static const unsigned char instruments[2] = { 0xFF, 1 };
+    int failures = 0;
+    int i;
+    for (i = 0; i < 2; ++i) {
+        struct channel_state initial;
+        struct encoded_pattern old_encoding;
+        struct encoded_pattern new_encoding;
+        int dropped;
+        initial.instrument = instruments[i];
+        initial.effect_type = 0;
+        initial.effect_param = 0;
+        dropped = convert_xm_pattern_to_nes_two_pass(pattern, channel, options, 0, &initial,
+                                                     &options->arena->song, &old_encoding);
+        if (convert_xm_pattern_to_nes(pattern, channel, options, 0, &initial,
+                                      &options->arena->song, &new_encoding)) {
+            printf("%s: pattern %d, channel %d: out of memory\n",
+                   name, pattern_index, channel);
+            ++failures;
+            break;
+        }
+        if (same_encoding(&old_encoding, &new_encoding))
+            continue;
+        if (dropped) {
+            ++*expected;
+        } else {
+            printf("%s: pattern %d, channel %d, initial instrument %d: encodings differ\n",
+                   name, pattern_index, channel, instruments[i]);
+            ++failures;
+        }
+    }
+    arena_reset(&options->arena->song);
+    return failures;
+}
+
+/**
+  Checks every channel of every pattern of the module \a filename.
+  Returns the number of failures, or 1 if the module can't be read.
+*/
+static int check_module(const char *filename, const struct xm2nes_options *options,
+                        int *pattern_count, int *expected)
+{
+    FILE *in;
+    struct xm xm;
+    int failures = 0;
+    int ret;
+    int i, chn;
+    in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "xm2nes-encodecheck: failed to open `%s' for reading\n", filename);
+        return 1;
+    }
+    ret = xm_read(in, XM_NO_MAPPING, &xm);
+    fclose(in);
+    if (ret) {
+        fprintf(stderr, "xm2nes-encodecheck: failed to read `%s': %s\n",
+                filename, xm2nes_error_message(ret));
+        return 1;
+    }
+    for (i = 0; i < xm.header.pattern_count; ++i) {
+        if (xm_decode_pattern(&xm, i)) {
+            fprintf(stderr, "xm2nes-encodecheck: failed to decode pattern %d of `%s'\n",
+                    i, filename);
+            ++failures;
+            continue;
+        }
+        if (!xm.patterns[i].row_count)
+            continue;
+        for (chn = 0; (chn < xm.header.channel_count) && (chn < 5); ++chn)
+            failures += check_channel(filename, i, &xm.patterns[i], chn, options, expected);
+        ++*pattern_count;
+    }
+    xm_destroy(&xm);
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    struct xm2nes_options options;
+    struct instr_mapping instr_map[128];
+    struct xm_pattern pattern;
+    struct xm_pattern_slot slots[8];
+    int pattern_count = 0;
+    int expected = 0;
+    int failures = 0;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    init_instruments_map(instr_map);
+    options.instr_map = instr_map;
+    options.arena = xm2nes_arena_create();
+    if (!options.arena) {
+        fprintf(stderr, "xm2nes-encodecheck: %s\n",
+                xm2nes_error_message(XM2NES_OUT_OF_MEMORY_ERROR));
+        return 1;
+    }
+
+    /* The checker itself must notice the pattern that the encoders differ on */
+    memcpy(slots, dropped_parameter_rows, sizeof(slots));
+    pattern.row_count = 8;
+    pattern.data = slots;
+    pattern.packed_data = 0;
+    pattern.packed_data_size = 0;
+    failures += check_channel("built-in pattern", 0, &pattern, 0, &options, &expected);
+    if (expected != 2) {
+        printf("built-in pattern: the encodings should differ\n");
+        ++failures;
+    }
+    expected = 0;
+
+    for (i = 1; i < argc; ++i)
+        failures += check_module(argv[i], &options, &pattern_count, &expected);
+    xm2nes_arena_destroy(options.arena);
+
+    printf("%d patterns checked, %d with a parameter change that the two-pass encoder left out, %d failures\n",
+           pattern_count, expected, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "xm2nes.h"
+
+/* Default mapping: each instrument maps to itself, without transpose. */
+void init_instruments_map(struct instr_mapping *map)
+{
+    unsigned char i;
+    for (i = 0; i < 128; ++i) {
+        map[i].target_instr = i;
+        map[i].transpose = 0;
+    }
+}
+
+#define IS_SPACE(c) ( ((c) == '\t') || ((c) == ' ') )
+
+static void eat_ws(char *s, int *i)
+{
+    while (IS_SPACE(s[*i])) (*i)++;
+}
+
+static int get_ident(char *s, int i)
+{
+    int len = 0;
+    while (isalpha((unsigned char)s[i+len]))
+        ++len;
+    return len;
+}
+
+static int get_value(char *s, int i)
+{
+    int len = 0;
+    if ((s[i+len] == '-') || isalnum((unsigned char)s[i+len])) {
+        ++len;
+        while (isalnum((unsigned char)s[i+len]))
+            ++len;
+    }
+    return len;
+}
+
+static void report(void (*diagnostic)(void *, const char *), void *context,
+                   const char *format, ...)
+{
+    char message[1024];
+    va_list args;
+    if (!diagnostic)
+        return;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    diagnostic(context, message);
+}
+
+/**
+  Parses the instruments map defined by the \a size bytes of \a text
+  into \a map, which should have been initialized with
+  init_instruments_map(). Errors are passed to \a diagnostic (if not 0)
+  with \a context, prefixed by \a path. Returns XM_NO_ERROR, or
+  XM2NES_INSTRUMENTS_MAP_ERROR if the map is invalid.
+*/
+int parse_instruments_map(const char *text, size_t size, const char *path,
+                          struct instr_mapping *map,
+                          void (*diagnostic)(void *, const char *), void *context)
+{
+    int ok;
+    int lineno = 0;
+    char line[1024];
+    int defined_set[128/(sizeof(int)*8)];
+    size_t text_pos = 0;
+    memset(defined_set, 0, sizeof(defined_set));
+    ok = 1;
+    while (ok && (text_pos < size)) {
+        int line_len = 0;
+        int source_instr = -1;
+        int target_instr = -1;
+        int transpose = 0;
+        int pos = 0;
+        /* Take the next line, or up to 1022 characters of it */
+        while ((text_pos < size) && (line_len < 1022)) {
+            line[line_len++] = text[text_pos++];
+            if (line[line_len-1] == '\n')
+                break;
+        }
+        line[line_len] = '\0';
+        ++lineno;
+        if (line[pos] == '#')
+            continue; /* Comment */
+        while (line[pos] && (line[pos] != '\n')) {
+            int len;
+            int attr = -1;
+            int val;
+            eat_ws(line, &pos);
+            len = get_ident(line, pos);
+            if (!len) {
+                report(diagnostic, context, "%s:%d.%d: attribute name expected", path, lineno, pos+1);
+                ok = 0;
+                break;
+            }
+            if ((len == 6) && !strncmp(&line[pos], "source", 6)) {
+                attr = 0;
+            } else if ((len == 6) && !strncmp(&line[pos], "target", 6)) {
+                attr = 1;
+            } else if ((len == 9) && !strncmp(&line[pos], "transpose", 9)) {
+                attr = 2;
+            } else {
+                report(diagnostic, context, "%s:%d.%d: unknown attribute", path, lineno, pos+1);
+                ok = 0;
+                break;
+            }
+            pos += len;
+            eat_ws(line, &pos);
+            if (!line[pos] || line[pos] != ':') {
+                report(diagnostic, context, "%s:%d.%d: : expected", path, lineno, pos+1);
+                ok = 0;
+                break;
+            }
+            ++pos;
+            eat_ws(line, &pos);
+            len = get_value(line, pos);
+            if (!len) {
+                report(diagnostic, context, "%s:%d.%d: value expected", path, lineno, pos+1);
+                ok = 0;
+                break;
+            }
+            val = strtol(&line[pos], 0, 0);
+            switch (attr) {
+                case 0: /* source */
+                    source_instr = val;
+                    break;
+                case 1: /* target */
+                    target_instr = val;
+                    break;
+                case 2: /* transpose */
+                    transpose = val;
+                    break;
+            }
+            pos += len;
+        }
+        if (ok) {
+            if (source_instr <= 0) {
+                report(diagnostic, context, "%s:%d: source attribute not specified", path, lineno);
+                ok = 0;
+                break;
+            } else if (source_instr > 128) {
+                report(diagnostic, context, "%s:%d: invalid source instrument", path, lineno);
+                ok = 0;
+                break;
+            }
+            if (target_instr >= 64) {
+                report(diagnostic, context, "%s:%d: invalid target instrument", path, lineno);
+                ok = 0;
+                break;
+            }
+            --source_instr; /* make it 0-based */
+            if (defined_set[source_instr / (sizeof(int)*8)]
+                & (1 << (source_instr & (sizeof(int)*8-1)))) {
+                report(diagnostic, context, "%s:%d: instrument already mapped", path, lineno);
+                ok = 0;
+                break;
+            }
+            if (target_instr >= 0)
+                map[source_instr].target_instr = target_instr;
+            if (transpose != 0)
+                map[source_instr].transpose = transpose;
+            defined_set[source_instr / (sizeof(int)*8)] |= 1 << (source_instr & (sizeof(int)*8-1));
+        }
+    }
+    return ok ? XM_NO_ERROR : XM2NES_INSTRUMENTS_MAP_ERROR;
+}
+
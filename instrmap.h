@@ -23,4 +23,11 @@ struct instr_mapping {
     int transpose;
 };
 
+#include <stddef.h>
+
+void init_instruments_map(struct instr_mapping *);
+int parse_instruments_map(const char *, size_t, const char *,
+                          struct instr_mapping *,
+                          void (*)(void *, const char *), void *);
+
 #endif
@@ -19,9 +19,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "xm2nes.h"
+#include "diskcache.h"
 
 static char program_version[] = "xm2nes 6.0.1";
 
@@ -33,15 +37,23 @@ static void usage()
         "              [--order-start=OFFSET] [--order-end=OFFSET]\n"
         "              [--label-prefix=PREFIX]\n"
         "              [--instruments-map=FILE] [--verbose]\n"
+        "              [--format=FORMAT] [--symbols=FILE]\n"
+        "              [--chunk-dictionary] [--order-loops[=DEPTH]]\n"
+        "              [--remap-instruments] [--track-state]\n"
+        "              [--adaptive-patterns]\n"
+        "              [--batch=FILE] [--jobs=N] [--watch]\n"
+        "              [--cache-dir=DIR] [--cache-size=SIZE]\n"
+        "              [--bank[=PREFIX]] [--stats[=FORMAT]]\n"
+        "              [--decode-cost[=FILE]] [--decode-cost-rows]\n"
         "              [--help] [--usage] [--version]\n"
-        "              FILE\n");
+        "              FILE...\n");
     exit(0);
 }
 
 /* Prints help message and exits. */
 static void help()
 {
-    printf("Usage: xm2nes [OPTION...] FILE\n"
+    printf("Usage: xm2nes [OPTION...] FILE...\n"
            "xm2nes converts Fasttracker ][ eXtended Module (XM) files to Kent's NES music format.\n\n"
            "Options:\n\n"
            "  --output=FILE                   Store output in FILE\n"
@@ -51,6 +63,23 @@ static void help()
            "  --instruments-map=FILE          Read instrument mapping information from FILE\n"
            "  --label-prefix=PREFIX           Use PREFIX as the prefix of 6502 assembly labels\n"
            "  --verbose                       Print progress information to standard output\n"  
+           "  --format=FORMAT                 Output assembly text (text) or binary data (binary)\n"
+           "  --symbols=FILE                  Store labels and pointers of binary output in FILE\n"
+           "  --chunk-dictionary              Store repeated 8-row chunks only once\n"
+           "  --order-loops[=DEPTH]           Store repeated order sequences as loops (2)\n"
+           "  --remap-instruments             Number instruments by how often they are set\n"
+           "  --track-state                   Carry the instrument across patterns\n"
+           "  --adaptive-patterns             Store each pattern in its smallest row format\n"
+           "  --batch=FILE                    Convert the files listed in FILE\n"
+           "  --jobs=N                        Convert up to N files in parallel, or\n"
+           "                                  the channels of one file\n"
+           "  --watch                         Convert FILE again whenever it changes\n"
+           "  --cache-dir=DIR                 Reuse earlier conversions stored in DIR\n"
+           "  --cache-size=SIZE               Keep at most SIZE bytes in the cache (64M)\n"
+           "  --bank[=PREFIX]                 Convert the files to one bank sharing patterns\n"
+           "  --stats[=FORMAT]                Print step times and channel sizes (text, json)\n"
+           "  --decode-cost[=FILE]            Estimate the player's decoding cost per frame\n"
+           "  --decode-cost-rows              Also print the decoding cost of every row\n"
            "  --help                          Give this help list\n"
            "  --usage                         Give a short usage message\n"
            "  --version                       Print program version\n");
@@ -64,192 +93,1023 @@ static void version()
     exit(0);
 }
 
-#define IS_SPACE(c) ( ((c) == '\t') || ((c) == ' ') )
+/**
+  Reads all of the file \a filename. Returns the contents, which must be
+  freed, and stores the size in \a size; on failure, returns 0 (an error
+  has been reported).
+*/
+static unsigned char *read_whole_file(const char *filename, size_t *size)
+{
+    FILE *in;
+    unsigned char *data = 0;
+    *size = 0;
+    in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "xm2nes: failed to open `%s' for reading\n", filename);
+        return 0;
+    }
+    for (;;) {
+        size_t capacity = *size ? *size * 2 : 65536;
+        data = (unsigned char *)realloc(data, capacity);
+        *size += fread(&data[*size], 1, capacity - *size, in);
+        if (*size < capacity)
+            break;
+    }
+    fclose(in);
+    return data;
+}
 
-static void eat_ws(char *s, int *i)
+/**
+  Prints a diagnostic from the converter to standard error and, if
+  \a context is not 0, to the FILE it points to as well.
+*/
+static void print_diagnostic(void *context, const char *message)
 {
-    while (IS_SPACE(s[*i])) (*i)++;
+    fprintf(stderr, "%s\n", message);
+    if (context)
+        fprintf((FILE *)context, "%s\n", message);
 }
 
-static int get_ident(char *s, int i)
+/**
+  Parses the decode cost file \a path into \a costs.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int parse_decode_costs_file(const char *path, struct decode_costs *costs)
+{
+    size_t size;
+    char *text = (char *)read_whole_file(path, &size);
+    int ret;
+    if (!text)
+        return 0;
+    ret = parse_decode_costs(text, size, path, costs, print_diagnostic, 0);
+    free(text);
+    return ret == XM_NO_ERROR;
+}
+
+/**
+  Parses the instruments map file \a path into \a map.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int parse_instruments_map_file(const char *path, struct instr_mapping *map)
 {
-    int len = 0;
-    while (isalpha((unsigned char)s[i+len]))
-        ++len;
-    return len;
+    size_t size;
+    char *text = (char *)read_whole_file(path, &size);
+    int ret;
+    if (!text)
+        return 0;
+    ret = parse_instruments_map(text, size, path, map, print_diagnostic, 0);
+    free(text);
+    return ret == XM_NO_ERROR;
 }
 
-static int get_value(char *s, int i)
+/* A file to convert, along with the options to convert it with. */
+struct job {
+    const char *input_filename;
+    const char *output_filename;
+    const char *instruments_map_filename;
+    const char *label_prefix;
+    const char *symbols_filename;
+    int binary;
+    const char *cache_dir;
+    long cache_size;
+    int stats; /* statistics to print: 0, STATS_TEXT or STATS_JSON */
+    int failed; /* the options are invalid (an error has been reported) */
+    struct xm2nes_options options;
+};
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* An instruments map file that has been parsed. */
+struct instr_map_entry {
+    const char *filename;
+    int ok; /* 0 if the file couldn't be parsed */
+    struct instr_mapping map[128];
+};
+
+/**
+  Parses the per-file option \a opt (without the leading "--")
+  into \a job. Returns 1 if the option was recognized, otherwise 0.
+*/
+static int parse_job_option(const char *opt, struct job *job)
 {
-    int len = 0;
-    if ((s[i+len] == '-') || isalnum((unsigned char)s[i+len])) {
-        ++len;
-        while (isalnum((unsigned char)s[i+len]))
-            ++len;
+    if (!strncmp("output=", opt, 7)) {
+        job->output_filename = &opt[7];
+    } else if (!strncmp("channels=", opt, 9)) {
+        const char *p = &opt[9];
+        job->options.channels = 0;
+        if (*p) {
+            job->options.channels |= 1 << (*p - '0');
+            while (*(++p)) {
+                if (*(p++) != ',')
+                    break;
+                if (*p)
+                    job->options.channels |= 1 << (*p - '0');
+            }
+        }
+        job->options.channels &= 0x1F;
+    } else if (!strncmp("instruments-map=", opt, 16)) {
+        job->instruments_map_filename = &opt[16];
+    } else if (!strncmp("label-prefix=", opt, 13)) {
+        job->label_prefix = &opt[13];
+    } else if (!strncmp("order-end=", opt, 10)) {
+        job->options.order_end_offset = strtol(&opt[10], 0, 0);
+    } else if (!strncmp("order-start=", opt, 12)) {
+        job->options.order_start_offset = strtol(&opt[12], 0, 0);
+    } else if (!strcmp("format=text", opt)) {
+        job->binary = 0;
+    } else if (!strcmp("format=binary", opt)) {
+        job->binary = 1;
+    } else if (!strncmp("symbols=", opt, 8)) {
+        job->symbols_filename = &opt[8];
+    } else if (!strcmp("chunk-dictionary", opt)) {
+        job->options.chunk_dictionary = 1;
+    } else if (!strcmp("order-loops", opt)) {
+        job->options.order_loops = 2;
+    } else if (!strncmp("order-loops=", opt, 12)) {
+        job->options.order_loops = strtol(&opt[12], 0, 0);
+    } else if (!strcmp("remap-instruments", opt)) {
+        job->options.remap_instruments = 1;
+    } else if (!strcmp("track-state", opt)) {
+        job->options.track_state = 1;
+    } else if (!strcmp("adaptive-patterns", opt)) {
+        job->options.adaptive_patterns = 1;
+    } else {
+        return 0;
     }
-    return len;
+    return 1;
 }
 
-static int parse_instruments_map_file(const char *path, struct instr_mapping *map)
+/**
+  Reads the batch file \a path. Each non-empty line that doesn't start
+  with '#' names a file to convert, optionally followed by per-file
+  options (--output, --channels, --instruments-map, --label-prefix,
+  --order-start, --order-end, --format, --symbols, --chunk-dictionary,
+  --order-loops, --remap-instruments, --track-state, --adaptive-patterns)
+  separated by whitespace. Options not
+  given on a line default to those in \a defaults.
+  The jobs are appended to \a jobs; the strings they refer to are
+  kept in \a text, which the caller must free.
+*/
+static int parse_batch_file(const char *path, const struct job *defaults,
+                            struct job **jobs, int *job_count, char **text)
 {
-    int ok;
+    FILE *fp;
+    long size;
+    char *p;
     int lineno = 0;
-    char line[1024];
-    int defined_set[128/(sizeof(int)*8)];
-    FILE *fp = fopen(path, "rt");
+    int ok = 1;
+    fp = fopen(path, "rt");
     if (!fp) {
         fprintf(stderr, "xm2nes: failed to open `%s' for reading\n", path);
         return 0;
     }
-    memset(defined_set, 0, sizeof(defined_set));
-    ok = 1;
-    while (ok && fgets(line, 1023, fp) != NULL) {
-        int source_instr = -1;
-        int target_instr = -1;
-        int transpose = 0;
-        int pos = 0;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    *text = (char *)malloc(size + 1);
+    size = fread(*text, 1, size, fp);
+    (*text)[size] = '\0';
+    fclose(fp);
+
+    p = *text;
+    while (ok && *p) {
+        char *line = p;
+        struct job job;
+        int has_options = 0;
+        p += strcspn(p, "\n");
+        if (*p)
+            *(p++) = '\0';
         ++lineno;
-        if (line[pos] == '#')
+        if (line[0] == '#')
             continue; /* Comment */
-        while (line[pos] && (line[pos] != '\n')) {
-            int len;
-            int attr = -1;
-            int val;
-            eat_ws(line, &pos);
-            len = get_ident(line, pos);
-            if (!len) {
-                fprintf(stderr, "%s:%d.%d: attribute name expected\n", path, lineno, pos+1);
-                ok = 0;
-                break;
-            }
-            if ((len == 6) && !strncmp(&line[pos], "source", 6)) {
-                attr = 0;
-            } else if ((len == 6) && !strncmp(&line[pos], "target", 6)) {
-                attr = 1;
-            } else if ((len == 9) && !strncmp(&line[pos], "transpose", 9)) {
-                attr = 2;
-            } else {
-                fprintf(stderr, "%s:%d.%d: unknown attribute\n", path, lineno, pos+1);
-                ok = 0;
-                break;
-            }
-            pos += len;
-            eat_ws(line, &pos);
-            if (!line[pos] || line[pos] != ':') {
-                fprintf(stderr, "%s:%d.%d: : expected\n", path, lineno, pos+1);
-                ok = 0;
+        job = *defaults;
+        job.input_filename = 0;
+        while (*line) {
+            char *tok;
+            line += strspn(line, " \t\r");
+            if (!*line)
                 break;
-            }
-            ++pos;
-            eat_ws(line, &pos);
-            len = get_value(line, pos);
-            if (!len) {
-                fprintf(stderr, "%s:%d.%d: value expected\n", path, lineno, pos+1);
-                ok = 0;
-                break;
-            }
-            val = strtol(&line[pos], 0, 0);
-            switch (attr) {
-                case 0: /* source */
-                    source_instr = val;
+            tok = line;
+            line += strcspn(line, " \t\r");
+            if (*line)
+                *(line++) = '\0';
+            if (!strncmp("--", tok, 2)) {
+                has_options = 1;
+                if (!parse_job_option(&tok[2], &job)) {
+                    fprintf(stderr, "%s:%d: unrecognized option `%s'\n", path, lineno, tok);
+                    ok = 0;
                     break;
-                case 1: /* target */
-                    target_instr = val;
-                    break;
-                case 2: /* transpose */
-                    transpose = val;
-                    break;
-            }
-            pos += len;
-        }
-        if (ok) {
-            if (source_instr <= 0) {
-                fprintf(stderr, "%s:%d: source attribute not specified\n", path, lineno);
-                ok = 0;
-                break;
-            } else if (source_instr > 128) {
-                fprintf(stderr, "%s:%d: invalid source instrument\n", path, lineno);
+                }
+            } else if (job.input_filename) {
+                fprintf(stderr, "%s:%d: more than one filename given\n", path, lineno);
                 ok = 0;
                 break;
+            } else {
+                job.input_filename = tok;
             }
-            if (target_instr >= 64) {
-                fprintf(stderr, "%s:%d: invalid target instrument\n", path, lineno);
-                ok = 0;
-                break;
+        }
+        if (ok && job.input_filename) {
+            *jobs = (struct job *)realloc(*jobs, (*job_count + 1) * sizeof(struct job));
+            (*jobs)[(*job_count)++] = job;
+        } else if (ok && has_options) {
+            fprintf(stderr, "%s:%d: no filename given\n", path, lineno);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+/**
+  Returns \a filename with its extension replaced by \a extension.
+  Used to name output files that weren't given explicitly.
+  The result must be freed.
+*/
+static char *replace_extension(const char *filename, const char *extension)
+{
+    const char *base;
+    const char *last_dot;
+    char *result;
+    int len;
+    base = strrchr(filename, '/');
+    if (base)
+        ++base;
+    else
+        base = filename;
+    last_dot = strrchr(base, '.');
+    if (!last_dot)
+        len = strlen(filename);
+    else
+        len = last_dot - filename;
+    result = (char *)malloc(len + strlen(extension) + 1);
+    memcpy(result, filename, len);
+    strcpy(&result[len], extension);
+    return result;
+}
+
+/**
+  Returns the label prefix to use: either \a label_prefix, or the
+  basename of \a input_filename without extension, followed by '_'.
+  The result must be freed.
+*/
+static char *make_label_prefix(const char *label_prefix, const char *input_filename)
+{
+    const char *begin;
+    char *prefix;
+    int len;
+    if (label_prefix) {
+        begin = label_prefix;
+        len = strlen(begin);
+    } else {
+        /* Use basename of input filename as prefix */
+        const char *last_dot;
+        begin = strrchr(input_filename, '/');
+        if (begin)
+            ++begin;
+        else
+            begin = input_filename;
+        last_dot = strrchr(begin, '.');
+        if (!last_dot)
+            len = strlen(begin);
+        else
+            len = last_dot - begin;
+    }
+    prefix = (char *)malloc(len + 2);
+    prefix[len] = '_';
+    prefix[len+1] = '\0';
+    strncpy(prefix, begin, len);
+    return prefix;
+}
+
+/* Prints \a s as a JSON string. */
+static void print_json_string(const char *s, FILE *out)
+{
+    fputc('"', out);
+    for ( ; *s; ++s) {
+        if ((*s == '"') || (*s == '\\'))
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%.4x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/**
+  Prints the statistics \a stats of converting \a name, which has
+  \a channel_count channels, in the format given by \a job. They go to
+  standard output, unless the output of the conversion does.
+*/
+static void print_stats(const struct job *job, const char *name, int channel_count,
+                        const struct xm2nes_stats *stats)
+{
+    FILE *out = job->output_filename ? stdout : stderr;
+    double total = 0;
+    int i;
+    if (channel_count > XM2NES_MAX_CHANNELS)
+        channel_count = XM2NES_MAX_CHANNELS;
+    for (i = 0; i < XM2NES_STEP_COUNT; ++i)
+        total += stats->step_time[i];
+    /* Keep the lines of a file together when converting in parallel */
+    flockfile(out);
+    if (job->stats == STATS_JSON) {
+        fprintf(out, "{\"file\":");
+        print_json_string(name, out);
+        fprintf(out, ",\"seconds\":{");
+        for (i = 0; i < XM2NES_STEP_COUNT; ++i)
+            fprintf(out, "\"%s\":%.6f,", xm2nes_step_name(i), stats->step_time[i]);
+        fprintf(out, "\"total\":%.6f},\"channels\":[", total);
+        for (i = 0; i < channel_count; ++i) {
+            const struct xm2nes_channel_stats *cs = &stats->channels[i];
+            fprintf(out, "%s{\"channel\":%d,\"unique_patterns\":%d,\"duplicate_patterns\":%d,"
+                    "\"shared_patterns\":%d,\"encoded_bytes\":%d,\"order_table_bytes\":%d}",
+                    i ? "," : "", i, cs->unique_patterns, cs->duplicate_patterns,
+                    cs->shared_patterns, cs->encoded_size, cs->order_table_size);
+        }
+        fprintf(out, "]}\n");
+    } else {
+        fprintf(out, "Statistics of `%s':\n", name);
+        for (i = 0; i < XM2NES_STEP_COUNT; ++i)
+            fprintf(out, "  %-8s %10.6f s\n", xm2nes_step_name(i), stats->step_time[i]);
+        fprintf(out, "  %-8s %10.6f s\n", "total", total);
+        fprintf(out, "  channel  unique  duplicates  shared  encoded bytes  order bytes\n");
+        for (i = 0; i < channel_count; ++i) {
+            const struct xm2nes_channel_stats *cs = &stats->channels[i];
+            fprintf(out, "  %7d  %6d  %10d  %6d  %13d  %11d\n", i,
+                    cs->unique_patterns, cs->duplicate_patterns, cs->shared_patterns,
+                    cs->encoded_size, cs->order_table_size);
+        }
+    }
+    funlockfile(out);
+}
+
+/**
+  Reads the XM file \a filename into \a xm, with the xm_read() \a flags.
+  Progress is printed to \a progress, if not 0.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int read_file(const char *filename, int flags, FILE *progress, struct xm *xm)
+{
+    FILE *in;
+    int ret;
+    in = fopen(filename, "rb");
+    if (!in) {
+        fprintf(stderr, "xm2nes: failed to open `%s' for reading\n", filename);
+        return 0;
+    }
+    if (progress)
+        fprintf(progress, "Reading `%s'...\n", filename);
+    ret = xm_read(in, flags, xm);
+    fclose(in);
+    if (ret) {
+        fprintf(stderr, "xm2nes: failed to read `%s': %s\n",
+                filename, xm2nes_error_message(ret));
+        xm_destroy(xm);
+        return 0;
+    }
+    if (progress)
+        fprintf(progress, "OK.\n");
+    return 1;
+}
+
+/**
+  Opens the output files of \a job. Returns 1 on success, 0 on failure
+  (an error has been reported).
+*/
+static int open_outputs(const struct job *job, FILE **out, FILE **symbols_out)
+{
+    *symbols_out = 0;
+    if (!job->output_filename)
+        *out = stdout;
+    else {
+        *out = fopen(job->output_filename, job->binary ? "wb" : "wt");
+        if (!*out) {
+            fprintf(stderr, "xm2nes: failed to open `%s' for writing\n", job->output_filename);
+            return 0;
+        }
+    }
+
+    if (job->binary) {
+        *symbols_out = fopen(job->symbols_filename, "wt");
+        if (!*symbols_out) {
+            fprintf(stderr, "xm2nes: failed to open `%s' for writing\n", job->symbols_filename);
+            if (job->output_filename)
+                fclose(*out);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void close_outputs(const struct job *job, FILE *out, FILE *symbols_out)
+{
+    if (job->output_filename)
+        fclose(out);
+    else
+        fflush(out);
+    if (symbols_out)
+        fclose(symbols_out);
+}
+
+/**
+  Converts \a xm, read from the file described by \a job, writing the
+  output to \a out and \a symbols_out. \a cache and \a arena are
+  passed on in the conversion options. Progress and size reports are
+  printed to \a progress, if not 0. Warnings are copied to \a messages,
+  if not 0.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int convert(const struct job *job, struct xm *xm,
+                   struct xm2nes_cache *cache, struct xm2nes_arena *arena,
+                   FILE *progress, FILE *messages, FILE *out, FILE *symbols_out)
+{
+    struct xm2nes_stats stats;
+    int ret;
+
+    if (progress)
+        xm_print_header(&xm->header, progress);
+
+    if (progress)
+        fprintf(progress, "Converting...\n");
+
+    {
+        struct xm2nes_options options = job->options;
+        char *prefix = make_label_prefix(job->label_prefix, job->input_filename);
+        options.label_prefix = prefix;
+        options.cache = cache;
+        options.arena = arena;
+        options.diagnostic = print_diagnostic;
+        options.diagnostic_context = messages;
+        if (progress)
+            options.report = progress;
+        if (job->stats) {
+            memset(&stats, 0, sizeof(stats));
+            options.stats = &stats;
+        }
+        /* Like the statistics, kept together when converting in parallel */
+        options.decode_report = job->output_filename ? stdout : stderr;
+        if (options.decode_costs)
+            flockfile(options.decode_report);
+
+        if (job->binary)
+            ret = convert_xm_to_nes_binary(xm, &options, out, symbols_out);
+        else
+            ret = convert_xm_to_nes(xm, &options, out);
+
+        if (options.decode_costs)
+            funlockfile(options.decode_report);
+
+        free(prefix);
+    }
+
+    if (ret) {
+        fprintf(stderr, "xm2nes: failed to convert `%s': %s\n",
+                job->input_filename, xm2nes_error_message(ret));
+        return 0;
+    }
+
+    if (job->stats)
+        print_stats(job, job->input_filename, xm->header.channel_count, &stats);
+
+    if (progress)
+        fprintf(progress, "Done.\n");
+    return 1;
+}
+
+/**
+  Converts \a xm, read from the file described by \a job, and writes
+  the output files. If \a banner is non-zero, a comment naming the
+  input is printed to standard output first. \a cache and \a arena are
+  passed on in the conversion options.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int write_file(const struct job *job, struct xm *xm,
+                      struct xm2nes_cache *cache, struct xm2nes_arena *arena,
+                      FILE *progress, int banner)
+{
+    FILE *out;
+    FILE *symbols_out;
+    int ok;
+    if (!open_outputs(job, &out, &symbols_out))
+        return 0;
+    if (banner)
+        fprintf(stdout, "; Generated from %s by %s\n", job->input_filename, program_version);
+    ok = convert(job, xm, cache, arena, progress, /*messages=*/0, out, symbols_out);
+    close_outputs(job, out, symbols_out);
+    return ok;
+}
+
+/* Copies the contents of \a in, from the beginning, to \a out. */
+static int copy_file_contents(FILE *in, FILE *out)
+{
+    char buf[8192];
+    size_t count;
+    rewind(in);
+    while ((count = fread(buf, 1, sizeof(buf), in)) != 0) {
+        if (fwrite(buf, 1, count, out) != count)
+            return 0;
+    }
+    return !ferror(in);
+}
+
+/* Changing this invalidates existing cache entries */
+#define CACHE_FORMAT_VERSION 3
+
+/**
+  Computes the cache key of converting \a job, whose input file
+  contains the \a size bytes of \a data.
+*/
+static void make_cache_key(const struct job *job, const unsigned char *data,
+                           size_t size, struct disk_cache_key *key)
+{
+    char *prefix = make_label_prefix(job->label_prefix, job->input_filename);
+    int i;
+    disk_cache_key_init(key);
+    disk_cache_key_add_string(key, program_version);
+    disk_cache_key_add_int(key, CACHE_FORMAT_VERSION);
+    disk_cache_key_add_int(key, size);
+    disk_cache_key_add(key, data, size);
+    for (i = 0; i < 128; ++i) {
+        disk_cache_key_add_int(key, job->options.instr_map[i].target_instr);
+        disk_cache_key_add_int(key, job->options.instr_map[i].transpose);
+    }
+    disk_cache_key_add_int(key, job->options.channels);
+    disk_cache_key_add_string(key, prefix);
+    disk_cache_key_add_int(key, job->options.order_start_offset);
+    disk_cache_key_add_int(key, job->options.order_end_offset);
+    disk_cache_key_add_int(key, job->options.chunk_dictionary);
+    disk_cache_key_add_int(key, job->options.order_loops);
+    disk_cache_key_add_int(key, job->options.remap_instruments);
+    disk_cache_key_add_int(key, job->options.track_state);
+    disk_cache_key_add_int(key, job->options.adaptive_patterns);
+    disk_cache_key_add_int(key, job->binary);
+    free(prefix);
+}
+
+/**
+  Like convert_file(), but takes the output from the cache directory
+  of \a job if the same conversion has been done before, and otherwise
+  stores it there. If \a job asks for statistics or a decode cost
+  estimate, the file is always converted, since the cache only holds
+  the output and the warnings.
+*/
+static int convert_file_cached(const struct job *job, struct xm2nes_arena *arena,
+                               FILE *progress, int banner)
+{
+    unsigned char *data;
+    size_t size;
+    struct disk_cache_key key;
+    FILE *out;
+    FILE *symbols_out;
+    struct xm xm;
+    int ok;
+    int ret;
+
+    if (progress)
+        fprintf(progress, "Reading `%s'...\n", job->input_filename);
+    data = read_whole_file(job->input_filename, &size);
+    if (!data)
+        return 0;
+    make_cache_key(job, data, size, &key);
+
+    /* Patterns are only decoded on a cache miss */
+    ret = xm_read_memory(data, size, XM_LAZY_PATTERNS, &xm);
+    if (ret) {
+        fprintf(stderr, "xm2nes: failed to read `%s': %s\n",
+                job->input_filename, xm2nes_error_message(ret));
+        xm_destroy(&xm);
+        free(data);
+        return 0;
+    }
+    if (progress)
+        fprintf(progress, "OK.\n");
+
+    if (!open_outputs(job, &out, &symbols_out)) {
+        xm_destroy(&xm);
+        free(data);
+        return 0;
+    }
+    if (banner)
+        fprintf(stdout, "; Generated from %s by %s\n", job->input_filename, program_version);
+    ret = 0;
+    if (!job->stats && !job->options.decode_costs)
+        ret = disk_cache_fetch(job->cache_dir, &key, out, symbols_out, stderr);
+    if (ret) {
+        /* If writing failed, don't add a conversion to what was written */
+        if (ret == -1)
+            fprintf(stderr, "xm2nes: failed to write output of `%s'\n", job->input_filename);
+        else if (progress)
+            fprintf(progress, "Found `%s' in the cache.\n", job->input_filename);
+        close_outputs(job, out, symbols_out);
+        xm_destroy(&xm);
+        free(data);
+        return ret == 1;
+    }
+
+    {
+        /* Convert to temporary files, then store them and copy them to the output */
+        FILE *temp_out = tmpfile();
+        FILE *temp_symbols_out = job->binary ? tmpfile() : 0;
+        FILE *temp_messages = tmpfile();
+        if (!temp_out || (job->binary && !temp_symbols_out) || !temp_messages) {
+            fprintf(stderr, "xm2nes: failed to create temporary file\n");
+            ok = 0;
+        } else {
+            ok = convert(job, &xm, /*cache=*/0, arena, progress, temp_messages,
+                         temp_out, temp_symbols_out);
+            if (ok) {
+                fflush(temp_out);
+                if (temp_symbols_out)
+                    fflush(temp_symbols_out);
+                fflush(temp_messages);
+                if (!disk_cache_store(job->cache_dir, &key, temp_out, temp_symbols_out,
+                                      temp_messages, job->cache_size)) {
+                    fprintf(stderr, "xm2nes: warning: failed to store `%s' in cache directory `%s'\n",
+                            job->input_filename, job->cache_dir);
+                }
+                ok = copy_file_contents(temp_out, out)
+                    && (!temp_symbols_out || copy_file_contents(temp_symbols_out, symbols_out));
+                if (!ok)
+                    fprintf(stderr, "xm2nes: failed to write output of `%s'\n", job->input_filename);
             }
-            --source_instr; /* make it 0-based */
-            if (defined_set[source_instr / (sizeof(int)*8)]
-                & (1 << (source_instr & (sizeof(int)*8-1)))) {
-                fprintf(stderr, "%s:%d: instrument already mapped\n", path, lineno);
-                ok = 0;
-                break;
+        }
+        if (temp_out)
+            fclose(temp_out);
+        if (temp_symbols_out)
+            fclose(temp_symbols_out);
+        if (temp_messages)
+            fclose(temp_messages);
+    }
+    close_outputs(job, out, symbols_out);
+    xm_destroy(&xm);
+    free(data);
+    return ok;
+}
+
+/**
+  Converts the file described by \a job. If \a banner is non-zero,
+  a comment naming the input is printed to standard output first.
+  The conversion uses the memory of \a arena, if not 0, and prints
+  its progress to \a progress, if not 0.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int convert_file(const struct job *job, struct xm2nes_arena *arena,
+                        FILE *progress, int banner)
+{
+    struct xm xm;
+    int ok;
+    if (job->cache_dir)
+        return convert_file_cached(job, arena, progress, banner);
+    if (!read_file(job->input_filename, XM_LAZY_PATTERNS, progress, &xm))
+        return 0;
+    ok = write_file(job, &xm, /*cache=*/0, arena, progress, banner);
+    xm_destroy(&xm);
+    return ok;
+}
+
+/**
+  Converts the files described by \a jobs to one bank, written to the
+  output files of \a bank; see convert_xm_bank_to_nes(). The bank's
+  labels start with \a bank_prefix (default "bank").
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int convert_bank_files(const struct job *jobs, int job_count,
+                              const struct job *bank, const char *bank_prefix,
+                              int verbose)
+{
+    struct xm *xms;
+    struct xm2nes_options *options;
+    struct xm2nes_stats stats;
+    char **prefixes;
+    char *prefix;
+    FILE *out;
+    FILE *symbols_out;
+    int channel_count = 0;
+    int read_count;
+    int ret;
+    int i;
+
+    memset(&stats, 0, sizeof(stats));
+    xms = (struct xm *)malloc(job_count * sizeof(struct xm));
+    options = (struct xm2nes_options *)malloc(job_count * sizeof(struct xm2nes_options));
+    prefixes = (char **)malloc(job_count * sizeof(char *));
+    for (read_count = 0; read_count < job_count; ++read_count) {
+        const struct job *job = &jobs[read_count];
+        if (!read_file(job->input_filename, XM_LAZY_PATTERNS, verbose ? stdout : 0, &xms[read_count]))
+            break;
+        prefixes[read_count] = make_label_prefix(job->label_prefix, job->input_filename);
+        options[read_count] = job->options;
+        options[read_count].label_prefix = prefixes[read_count];
+        options[read_count].diagnostic = print_diagnostic;
+        options[read_count].decode_report = bank->output_filename ? stdout : stderr;
+        /* The statistics are of the whole bank */
+        if (bank->stats)
+            options[read_count].stats = &stats;
+        if (xms[read_count].header.channel_count > channel_count)
+            channel_count = xms[read_count].header.channel_count;
+    }
+    prefix = make_label_prefix(bank_prefix ? bank_prefix : "bank", 0);
+
+    ret = -1;
+    if ((read_count == job_count) && open_outputs(bank, &out, &symbols_out)) {
+        /* The bank report is printed unless it would mix with the output */
+        if (verbose || bank->output_filename)
+            options[0].report = stdout;
+        if (verbose)
+            fprintf(stdout, "Converting...\n");
+        if (bank->binary)
+            ret = convert_xm_bank_to_nes_binary(xms, options, job_count, prefix, out, symbols_out);
+        else
+            ret = convert_xm_bank_to_nes(xms, options, job_count, prefix, out);
+        close_outputs(bank, out, symbols_out);
+        if (ret) {
+            fprintf(stderr, "xm2nes: failed to convert bank: %s\n",
+                    xm2nes_error_message(ret));
+        } else {
+            if (bank->stats)
+                print_stats(bank, bank->output_filename ? bank->output_filename : "bank",
+                            channel_count, &stats);
+            if (verbose)
+                fprintf(stdout, "Done.\n");
+        }
+    }
+
+    for (i = 0; i < read_count; ++i) {
+        xm_destroy(&xms[i]);
+        free(prefixes[i]);
+    }
+    free(prefix);
+    free(prefixes);
+    free(options);
+    free(xms);
+    return ret == XM_NO_ERROR;
+}
+
+#define WATCH_INTERVAL_MS 250
+
+/* Returns non-zero if the file described by \a st has been modified
+   since \a last_st was taken. */
+static int file_changed(const struct stat *st, const struct stat *last_st)
+{
+#if defined(__APPLE__)
+    if (st->st_mtimespec.tv_nsec != last_st->st_mtimespec.tv_nsec)
+        return 1;
+#elif defined(__linux__)
+    if (st->st_mtim.tv_nsec != last_st->st_mtim.tv_nsec)
+        return 1;
+#endif
+    return (st->st_mtime != last_st->st_mtime)
+        || (st->st_size != last_st->st_size)
+        || (st->st_ino != last_st->st_ino);
+}
+
+/**
+  Converts the file described by \a job, and converts it again each
+  time it changes, until the program is interrupted. The module and
+  the converted patterns are kept between conversions, so only the
+  patterns that have changed are decoded and converted again.
+*/
+static void watch_file(const struct job *job, int verbose, int banner)
+{
+    struct xm xm;
+    int have_xm = 0;
+    int have_stat = 0;
+    struct stat last_st;
+    /* Without them (if there is no memory for them), each conversion
+       starts from scratch */
+    struct xm2nes_cache *cache = xm2nes_cache_create();
+    struct xm2nes_arena *arena = xm2nes_arena_create();
+    for (;;) {
+        struct stat st;
+        if (!stat(job->input_filename, &st)
+            && (!have_stat || file_changed(&st, &last_st))) {
+            struct xm new_xm;
+            struct timeval start, end;
+            last_st = st;
+            have_stat = 1;
+            gettimeofday(&start, 0);
+            /* Don't map the file; it may change while we hold on to it */
+            if (read_file(job->input_filename, XM_LAZY_PATTERNS | XM_NO_MAPPING,
+                          verbose ? stdout : 0, &new_xm)) {
+                if (have_xm) {
+                    xm_reuse_decoded_patterns(&new_xm, &xm);
+                    xm_destroy(&xm);
+                }
+                xm = new_xm;
+                have_xm = 1;
+                if (write_file(job, &xm, cache, arena, verbose ? stdout : 0, banner)) {
+                    xm2nes_cache_prune(cache);
+                    gettimeofday(&end, 0);
+                    fprintf(stderr, "xm2nes: converted `%s' (%ld ms)\n", job->input_filename,
+                            (long)(end.tv_sec - start.tv_sec) * 1000
+                            + (end.tv_usec - start.tv_usec) / 1000);
+                }
             }
-            if (target_instr >= 0)
-                map[source_instr].target_instr = target_instr;
-            if (transpose != 0)
-                map[source_instr].transpose = transpose;
-            defined_set[source_instr / (sizeof(int)*8)] |= 1 << (source_instr & (sizeof(int)*8-1));
+            fflush(stdout);
         }
+        usleep(WATCH_INTERVAL_MS * 1000);
     }
-    fclose(fp);
+}
+
+/* State shared by the batch worker threads. */
+struct batch {
+    const struct job *jobs;
+    int job_count;
+    int next_job;
+    int failed_count;
+    int verbose;
+    pthread_mutex_t lock;
+};
+
+/**
+  Converts the file described by \a job, one of the \a batch. The
+  progress of each file is printed in one piece, so that files that
+  are converted in parallel don't mix their output.
+  Returns 1 on success, 0 on failure (an error has been reported).
+*/
+static int convert_batch_file(const struct batch *batch, const struct job *job,
+                              struct xm2nes_arena *arena)
+{
+    FILE *progress;
+    int ok;
+    if (!batch->verbose)
+        return convert_file(job, arena, /*progress=*/0, /*banner=*/0);
+    progress = tmpfile();
+    if (!progress) {
+        /* Hold on to standard output for the whole conversion instead */
+        flockfile(stdout);
+        ok = convert_file(job, arena, stdout, /*banner=*/0);
+        funlockfile(stdout);
+        return ok;
+    }
+    ok = convert_file(job, arena, progress, /*banner=*/0);
+    fflush(progress);
+    flockfile(stdout);
+    copy_file_contents(progress, stdout);
+    funlockfile(stdout);
+    fclose(progress);
     return ok;
 }
 
+/* Converts jobs from the batch until there are none left. */
+static void *batch_worker(void *arg)
+{
+    struct batch *batch = (struct batch *)arg;
+    /* Reused from file to file, so that later files allocate little;
+       if it can't be allocated, each file gets its own */
+    struct xm2nes_arena *arena = xm2nes_arena_create();
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next_job++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->job_count)
+            break;
+        if (batch->jobs[i].failed || !convert_batch_file(batch, &batch->jobs[i], arena)) {
+            pthread_mutex_lock(&batch->lock);
+            ++batch->failed_count;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+    xm2nes_arena_destroy(arena);
+    return 0;
+}
+
+/**
+  Converts the given \a jobs using \a thread_count threads.
+  A failing file doesn't stop the batch. Returns the number of files
+  that failed to convert, including those with invalid options.
+*/
+static int run_batch(const struct job *jobs, int job_count,
+                     int thread_count, int verbose)
+{
+    struct batch batch;
+    pthread_t *threads;
+    int i;
+    batch.jobs = jobs;
+    batch.job_count = job_count;
+    batch.next_job = 0;
+    batch.failed_count = 0;
+    batch.verbose = verbose;
+    pthread_mutex_init(&batch.lock, 0);
+    if (thread_count > job_count)
+        thread_count = job_count;
+    threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    for (i = 0; i < thread_count; ++i) {
+        if (pthread_create(&threads[i], 0, batch_worker, &batch) != 0)
+            break;
+    }
+    if (i == 0) {
+        /* Couldn't start any threads; do the work ourselves */
+        batch_worker(&batch);
+    }
+    thread_count = i;
+    for (i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], 0);
+    free(threads);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.failed_count;
+}
+
+#define DEFAULT_CACHE_SIZE (64L << 20)
+
 /**
   Program entrypoint.
 */
 int main(int argc, char *argv[])
 {
     int verbose = 0;
-    const char *input_filename = 0;
-    const char *output_filename = 0;
-    const char *instruments_map_filename = 0;
-    const char *label_prefix = 0;
-    struct xm2nes_options options;
-    struct instr_mapping instr_map[128];
-    {
-        unsigned char i;
-        for (i = 0; i < 128; ++i) {
-            instr_map[i].target_instr = i;
-            instr_map[i].transpose = 0;
-        }
-    }
-    options.instr_map = instr_map;
-    options.channels = 0x1F;
-    options.label_prefix = 0;
-    options.order_start_offset = 0;
-    options.order_end_offset = -1;
+    int watch = 0;
+    int bank = 0;
+    const char *bank_prefix = 0;
+    int thread_count = 0;
+    const char *batch_filename = 0;
+    char *batch_text = 0;
+    struct job defaults;
+    struct job *jobs = 0;
+    int job_count = 0;
+    struct instr_map_entry *instr_maps;
+    struct decode_costs decode_costs;
+    const char *decode_costs_filename = 0;
+    int instr_map_count;
+    int failed_count;
+    char **filenames;
+    int result = 0;
+    int i;
+    defaults.input_filename = 0;
+    defaults.output_filename = 0;
+    defaults.instruments_map_filename = 0;
+    defaults.label_prefix = 0;
+    defaults.symbols_filename = 0;
+    defaults.binary = 0;
+    defaults.cache_dir = 0;
+    defaults.cache_size = DEFAULT_CACHE_SIZE;
+    defaults.stats = 0;
+    defaults.failed = 0;
+    defaults.options.instr_map = 0;
+    defaults.options.channels = 0x1F;
+    defaults.options.label_prefix = 0;
+    defaults.options.order_start_offset = 0;
+    defaults.options.order_end_offset = -1;
+    defaults.options.chunk_dictionary = 0;
+    defaults.options.order_loops = 0;
+    defaults.options.remap_instruments = 0;
+    defaults.options.track_state = 0;
+    defaults.options.adaptive_patterns = 0;
+    defaults.options.jobs = 1;
+    defaults.options.report = 0;
+    defaults.options.cache = 0;
+    defaults.options.arena = 0;
+    defaults.options.diagnostic = 0;
+    defaults.options.diagnostic_context = 0;
+    defaults.options.stats = 0;
+    defaults.options.decode_costs = 0;
+    defaults.options.decode_report = 0;
+    defaults.options.decode_report_rows = 0;
+    init_decode_costs(&decode_costs);
     /* Process arguments. */
     {
         char *p;
         while ((p = *(++argv))) {
             if (!strncmp("--", p, 2)) {
                 const char *opt = &p[2];
-                if (!strncmp("output=", opt, 7)) {
-                    output_filename = &opt[7];
-                } else if (!strncmp("channels=", opt, 9)) {
-                    const char *p = &opt[9];
-                    options.channels = 0;
-                    if (*p) {
-                        options.channels |= 1 << (*p - '0');
-                        while (*(++p)) {
-                            if (*(p++) != ',')
-                                break;
-                            if (*p)
-                                options.channels |= 1 << (*p - '0');
-			}
-		    }
-                    options.channels &= 0x1F;
-                } else if (!strncmp("instruments-map=", opt, 16)) {
-                    instruments_map_filename = &opt[16];
-                } else if (!strncmp("label-prefix=", opt, 13)) {
-                    label_prefix = &opt[13];
-                } else if (!strncmp("order-end=", opt, 10)) {
-                    options.order_end_offset = strtol(&opt[10], 0, 0);
-                } else if (!strncmp("order-start=", opt, 12)) {
-                    options.order_start_offset = strtol(&opt[12], 0, 0);
+                if (parse_job_option(opt, &defaults)) {
+                    ;
+                } else if (!strncmp("batch=", opt, 6)) {
+                    batch_filename = &opt[6];
+                } else if (!strncmp("jobs=", opt, 5)) {
+                    thread_count = strtol(&opt[5], 0, 0);
                 } else if (!strcmp("verbose", opt)) {
                     verbose = 1;
+                } else if (!strncmp("cache-dir=", opt, 10)) {
+                    defaults.cache_dir = &opt[10];
+                } else if (!strncmp("cache-size=", opt, 11)) {
+                    char *end;
+                    defaults.cache_size = strtol(&opt[11], &end, 0);
+                    if ((*end == 'k') || (*end == 'K'))
+                        defaults.cache_size <<= 10;
+                    else if ((*end == 'm') || (*end == 'M'))
+                        defaults.cache_size <<= 20;
+                } else if (!strcmp("bank", opt)) {
+                    bank = 1;
+                } else if (!strncmp("bank=", opt, 5)) {
+                    bank = 1;
+                    bank_prefix = &opt[5];
+                } else if (!strcmp("stats", opt) || !strcmp("stats=text", opt)) {
+                    defaults.stats = STATS_TEXT;
+                } else if (!strcmp("stats=json", opt)) {
+                    defaults.stats = STATS_JSON;
+                } else if (!strcmp("decode-cost", opt)) {
+                    defaults.options.decode_costs = &decode_costs;
+                } else if (!strncmp("decode-cost=", opt, 12)) {
+                    defaults.options.decode_costs = &decode_costs;
+                    decode_costs_filename = &opt[12];
+                } else if (!strcmp("decode-cost-rows", opt)) {
+                    defaults.options.decode_costs = &decode_costs;
+                    defaults.options.decode_report_rows = 1;
+                } else if (!strcmp("watch", opt)) {
+                    watch = 1;
                 } else if (!strcmp("help", opt)) {
                     help();
                 } else if (!strcmp("usage", opt)) {
@@ -262,99 +1122,155 @@ int main(int argc, char *argv[])
                     return(-1);
                 }
             } else {
-                input_filename = p;
+                jobs = (struct job *)realloc(jobs, (job_count + 1) * sizeof(struct job));
+                jobs[job_count++].input_filename = p;
             }
         }
     }
 
-    if (!input_filename) {
+    if (decode_costs_filename && !parse_decode_costs_file(decode_costs_filename, &decode_costs))
+        return(-1);
+
+    /* Options given on the command line apply to all the files. */
+    for (i = 0; i < job_count; ++i) {
+        const char *input_filename = jobs[i].input_filename;
+        jobs[i] = defaults;
+        jobs[i].input_filename = input_filename;
+    }
+
+    if (batch_filename) {
+        if (!parse_batch_file(batch_filename, &defaults, &jobs, &job_count, &batch_text))
+            return(-1);
+    }
+
+    if (!job_count) {
         fprintf(stderr, "xm2nes: no filename given\n"
                         "Try `xm2nes --help' or `xm2nes --usage' for more information.\n");
         return(-1);
     }
 
-    if (!options.channels) {
-        fprintf(stderr, "xm2nes: --channels argument needs to include at least one channel\n");
+    if ((job_count > 1) && !bank && (defaults.output_filename || defaults.symbols_filename)) {
+        fprintf(stderr, "xm2nes: --output and --symbols can't be used when converting several files\n");
         return(-1);
     }
 
-    if (instruments_map_filename) {
-        if (!parse_instruments_map_file(instruments_map_filename, instr_map))
-            return(-1);
+    if (watch && ((job_count > 1) || batch_filename || bank)) {
+        fprintf(stderr, "xm2nes: --watch can only be used when converting one file\n");
+        return(-1);
     }
 
-    {
-        struct xm xm;
-        FILE *out;
-        if (!output_filename)
-            out = stdout;
-        else {
-            out = fopen(output_filename, "wt");
-            if (!out) {
-                fprintf(stderr, "xm2nes: failed to open `%s' for writing\n", output_filename);
-                return(-1);
+    /* Parse each instruments map file once, and share it between the files using it.
+       A file with invalid options is marked as failed; a batch converts the others. */
+    instr_maps = (struct instr_map_entry *)malloc((job_count + 1) * sizeof(struct instr_map_entry));
+    instr_maps[0].filename = 0;
+    instr_maps[0].ok = 1;
+    init_instruments_map(instr_maps[0].map);
+    instr_map_count = 1;
+    failed_count = 0;
+    for (i = 0; i < job_count; ++i) {
+        struct job *job = &jobs[i];
+        int j;
+        if (!job->options.channels) {
+            fprintf(stderr, "xm2nes: %s: --channels argument needs to include at least one channel\n",
+                    job->input_filename);
+            job->failed = 1;
+            ++failed_count;
+            continue;
+        }
+        if (job->options.adaptive_patterns && job->options.chunk_dictionary) {
+            fprintf(stderr, "xm2nes: %s: --adaptive-patterns can't be used with --chunk-dictionary\n",
+                    job->input_filename);
+            job->failed = 1;
+            ++failed_count;
+            continue;
+        }
+        for (j = 0; j < instr_map_count; ++j) {
+            const char *filename = instr_maps[j].filename;
+            if ((filename == job->instruments_map_filename)
+                || (filename && job->instruments_map_filename
+                    && !strcmp(filename, job->instruments_map_filename))) {
+                break;
             }
         }
+        if (j == instr_map_count) {
+            instr_maps[j].filename = job->instruments_map_filename;
+            init_instruments_map(instr_maps[j].map);
+            instr_maps[j].ok = parse_instruments_map_file(job->instruments_map_filename,
+                                                          instr_maps[j].map);
+            ++instr_map_count;
+        }
+        if (!instr_maps[j].ok) {
+            job->failed = 1;
+            ++failed_count;
+            continue;
+        }
+        job->options.instr_map = instr_maps[j].map;
+    }
+    if (failed_count && (bank || watch || (job_count == 1)))
+        return(-1);
 
-        {
-            FILE *in;
-            in = fopen(input_filename, "rb");
-            if (!in) {
-                fprintf(stderr, "xm2nes: failed to open `%s' for reading\n", input_filename);
+    /* Name the output files that weren't given explicitly. */
+    filenames = (char **)malloc(2 * job_count * sizeof(char *));
+    for (i = 0; i < 2 * job_count; ++i)
+        filenames[i] = 0;
+    if (bank && defaults.binary && !defaults.symbols_filename) {
+        if (!defaults.output_filename) {
+            fprintf(stderr, "xm2nes: --format=binary needs --output or --symbols\n");
+            return(-1);
+        }
+        filenames[0] = replace_extension(defaults.output_filename, ".sym");
+        defaults.symbols_filename = filenames[0];
+    }
+    for (i = 0; !bank && (i < job_count); ++i) {
+        struct job *job = &jobs[i];
+        if (!job->output_filename && (job_count > 1)) {
+            filenames[2*i] = replace_extension(job->input_filename, job->binary ? ".bin" : ".asm");
+            job->output_filename = filenames[2*i];
+        }
+        if (job->binary && !job->symbols_filename) {
+            if (!job->output_filename) {
+                fprintf(stderr, "xm2nes: --format=binary needs --output or --symbols\n");
                 return(-1);
             }
-            if (verbose)
-                fprintf(stdout, "Reading `%s'...\n", input_filename);
-            xm_read(in, &xm);
-            if (verbose)
-                fprintf(stdout, "OK.\n");
+            filenames[2*i+1] = replace_extension(job->output_filename, ".sym");
+            job->symbols_filename = filenames[2*i+1];
         }
+    }
 
-        if (verbose)
-            xm_print_header(&xm.header, stdout);
-
-        if (verbose)
-            fprintf(stdout, "Converting...\n");
-
+    if (bank || watch || (job_count == 1)) {
+        /* Files are converted one at a time; convert their channels in parallel */
+        for (i = 0; i < job_count; ++i)
+            jobs[i].options.jobs = (thread_count > 0) ? thread_count : 1;
+    }
+    if (bank) {
+        if (!convert_bank_files(jobs, job_count, &defaults, bank_prefix, verbose))
+            result = -1;
+    } else if (watch) {
+        watch_file(&jobs[0], verbose, /*banner=*/!jobs[0].binary);
+    } else if (job_count == 1) {
+        if (!convert_file(&jobs[0], /*arena=*/0, verbose ? stdout : 0, /*banner=*/!jobs[0].binary))
+            result = -1;
+    } else {
+        if (thread_count <= 0)
+            thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+        if (thread_count <= 0)
+            thread_count = 1;
         {
-            const char *begin;
-            char *prefix;
-            int len;
-            if (label_prefix) {
-                begin = label_prefix;
-                len = strlen(begin);
-            } else {
-                /* Use basename of input filename as prefix */
-                char *last_dot;
-                begin = strrchr(input_filename, '/');
-                if (begin)
-                    ++begin;
-                else
-                    begin = input_filename;
-                last_dot = strrchr(begin, '.');
-                if (!last_dot)
-                    len = strlen(begin);
-                else
-                    len = last_dot - begin;
+            failed_count = run_batch(jobs, job_count, thread_count, verbose);
+            if (failed_count) {
+                fprintf(stderr, "xm2nes: %d of %d files failed to convert\n",
+                        failed_count, job_count);
+                result = -1;
             }
-            prefix = (char *)malloc(len + 2);
-            prefix[len] = '_';
-            prefix[len+1] = '\0';
-            strncpy(prefix, begin, len);
-            options.label_prefix = prefix;
-
-            fprintf(stdout, "; Generated from %s by %s\n", input_filename, program_version);
-            convert_xm_to_nes(&xm, &options, out);
-
-            free(prefix);
         }
-        if (output_filename)
-            fclose(out);
+    }
 
-        if (verbose)
-            fprintf(stdout, "Done.\n");
+    for (i = 0; i < 2 * job_count; ++i)
+        free(filenames[i]);
+    free(filenames);
 
-        xm_destroy(&xm);
-    }
-    return 0;
+    free(instr_maps);
+    free(jobs);
+    free(batch_text);
+    return result;
 }
@@ -0,0 +1,169 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Kernels that check whether a block of memory, such as the slots of a
+  pattern channel, is all zero. On x86 there are SSE2 and AVX2 versions
+  that look at 64 or 128 bytes at a time; the best one the CPU supports
+  is chosen once, the first time it is needed. Other CPUs, and
+  compilers without the target attribute, get the scalar version, which
+  looks at a word at a time. (Comparing blocks is left to memcmp(),
+  which C libraries already vectorize this way.)
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include "memscan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MEMSCAN_X86
+#include <immintrin.h>
+#endif
+
+static int is_zero_scalar(const void *p, size_t size)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    size_t i = 0;
+    unsigned long acc = 0;
+    for ( ; i + sizeof(unsigned long) <= size; i += sizeof(unsigned long)) {
+        unsigned long w;
+        memcpy(&w, &b[i], sizeof(w)); /* b need not be aligned */
+        acc |= w;
+        if (acc)
+            return 0;
+    }
+    for ( ; i < size; ++i)
+        acc |= b[i];
+    return !acc;
+}
+
+#ifdef MEMSCAN_X86
+
+__attribute__((target("sse2")))
+static int is_zero_sse2(const void *p, size_t size)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    /* Four vectors at a time, so that the test is not on every load */
+    for ( ; i + 64 <= size; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)&b[i]),
+                         _mm_loadu_si128((const __m128i *)&b[i + 16])),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)&b[i + 32]),
+                         _mm_loadu_si128((const __m128i *)&b[i + 48])));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+            return 0;
+    }
+    for ( ; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&b[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+            return 0;
+    }
+    return is_zero_scalar(&b[i], size - i);
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2(const void *p, size_t size)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    size_t i = 0;
+    for ( ; i + 128 <= size; i += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)&b[i]),
+                            _mm256_loadu_si256((const __m256i *)&b[i + 32])),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)&b[i + 64]),
+                            _mm256_loadu_si256((const __m256i *)&b[i + 96])));
+        if (!_mm256_testz_si256(v, v))
+            return 0;
+    }
+    for ( ; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&b[i]);
+        if (!_mm256_testz_si256(v, v))
+            return 0;
+    }
+    /* The compiler may not clear the upper halves before a tail call,
+       and SSE code runs slowly until they are */
+    _mm256_zeroupper();
+    return is_zero_scalar(&b[i], size - i);
+}
+
+#endif
+
+/**
+  Returns the best version of the kernels that the CPU supports.
+*/
+int memscan_best_kernel(void)
+{
+#ifdef MEMSCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return MEMSCAN_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return MEMSCAN_SSE2;
+#endif
+    return MEMSCAN_SCALAR;
+}
+
+const char *memscan_kernel_name(int kernel)
+{
+    switch (kernel) {
+    case MEMSCAN_SSE2: return "sse2";
+    case MEMSCAN_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+typedef int (*is_zero_function)(const void *, size_t);
+
+/**
+  Returns the zero check of \a kernel.
+*/
+static is_zero_function is_zero_kernel(int kernel)
+{
+#ifdef MEMSCAN_X86
+    if (kernel == MEMSCAN_AVX2)
+        return is_zero_avx2;
+    if (kernel == MEMSCAN_SSE2)
+        return is_zero_sse2;
+#endif
+    (void)kernel;
+    return is_zero_scalar;
+}
+
+/**
+  Checks if the \a size bytes at \a p are all zero, using the given
+  \a kernel, which the CPU must support.
+*/
+int memscan_is_zero_with(int kernel, const void *p, size_t size)
+{
+    return is_zero_kernel(kernel)(p, size);
+}
+
+/* The zero check of the best kernel, set by choose_is_zero() */
+static pthread_once_t is_zero_once = PTHREAD_ONCE_INIT;
+static is_zero_function is_zero_best;
+
+static void choose_is_zero(void)
+{
+    is_zero_best = is_zero_kernel(memscan_best_kernel());
+}
+
+int memscan_is_zero(const void *p, size_t size)
+{
+    pthread_once(&is_zero_once, choose_is_zero);
+    return is_zero_best(p, size);
+}
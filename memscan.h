@@ -0,0 +1,33 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMSCAN_H
+#define MEMSCAN_H
+
+#include <stddef.h>
+
+/* The versions of the memory scanning kernels */
+#define MEMSCAN_SCALAR 0
+#define MEMSCAN_SSE2 1
+#define MEMSCAN_AVX2 2
+
+int memscan_best_kernel(void);
+const char *memscan_kernel_name(int);
+int memscan_is_zero(const void *, size_t);
+int memscan_is_zero_with(int, const void *, size_t);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+    This file is part of xm2nes.
+
+    xm2nes is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    xm2nes is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with xm2nes.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Checks that xm_read_memory() rejects malformed modules with the right
+  error code: patterns with no rows or more than XM_MAX_ROWS, instrument
+  numbers above 128, order table entries past the last pattern, more
+  than XM_MAX_CHANNELS channels, packed data left over after the last
+  row, and files cut short anywhere. The
+  modules are built in memory, with one pattern and, unless a check
+  says otherwise, one channel.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "xm.h"
+#include "xm2nes.h"
+
+#define MODULE_SIZE (0x3C + 0x114 + 9)
+#define MAX_MODULE_SIZE (MODULE_SIZE + XM_MAX_ROWS + 2)
+
+static void write_ushort(unsigned char *p, unsigned short value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+/**
+  Stores in \a data a module whose pattern has \a row_count rows and
+  whose only order table entry is \a order. If \a instrument is not 0,
+  the first row sets it; otherwise the pattern has no packed data.
+  Returns the size of the module.
+*/
+static int make_module(unsigned char *data, int row_count, int order, int instrument)
+{
+    unsigned char *p = data;
+    int i;
+    memset(data, 0, MAX_MODULE_SIZE);
+    memcpy(p, "Extended module: ", 17);
+    p[37] = 0x1A;
+    write_ushort(&p[58], 0x0104); /* version */
+    write_ushort(&p[60], 0x0114); /* header size */
+    write_ushort(&p[64], 1); /* song length */
+    write_ushort(&p[68], 1); /* channels */
+    write_ushort(&p[70], 1); /* patterns */
+    write_ushort(&p[74], 1); /* flags */
+    write_ushort(&p[76], 6); /* tempo */
+    write_ushort(&p[78], 125); /* BPM */
+    p[80] = order;
+    p += 0x3C + 0x114;
+    p[0] = 9; /* pattern header length */
+    write_ushort(&p[5], row_count);
+    if (!instrument)
+        return MODULE_SIZE;
+    write_ushort(&p[7], row_count + 1);
+    p += 9;
+    p[0] = 0x82; /* packed slot with an instrument */
+    p[1] = instrument;
+    for (i = 1; i < row_count; ++i)
+        p[i + 1] = 0x80; /* empty packed slot */
+    return MODULE_SIZE + row_count + 1;
+}
+
+/**
+  Reads the \a size bytes of \a data, and checks that the result is
+  \a expected. Returns the number of failures (0 or 1).
+*/
+static int check_read(const char *what, const unsigned char *data, size_t size,
+                      int expected)
+{
+    struct xm xm;
+    int ret = xm_read_memory(data, size, 0, &xm);
+    xm_destroy(&xm);
+    if (ret != expected) {
+        printf("%s: expected `%s', got `%s'\n", what,
+               xm2nes_error_message(expected), xm2nes_error_message(ret));
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const int valid_rows[] = { 1, 64, XM_MAX_ROWS };
+    static const int invalid_rows[] = { 0, XM_MAX_ROWS + 1, 264, 1024, 65535 };
+    unsigned char data[MAX_MODULE_SIZE];
+    int size;
+    char what[64];
+    int failures = 0;
+    int checks = 0;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(valid_rows) / sizeof(valid_rows[0])); ++i) {
+        sprintf(what, "%d rows", valid_rows[i]);
+        make_module(data, valid_rows[i], 0, 0);
+        failures += check_read(what, data, MODULE_SIZE, XM_NO_ERROR);
+        ++checks;
+    }
+    for (i = 0; i < (int)(sizeof(invalid_rows) / sizeof(invalid_rows[0])); ++i) {
+        sprintf(what, "%d rows", invalid_rows[i]);
+        make_module(data, invalid_rows[i], 0, 0);
+        failures += check_read(what, data, MODULE_SIZE, XM_FORMAT_ERROR);
+        ++checks;
+    }
+
+    size = make_module(data, 64, 0, 128);
+    failures += check_read("instrument 128", data, size, XM_NO_ERROR);
+    size = make_module(data, 64, 0, 129);
+    failures += check_read("instrument 129", data, size, XM_FORMAT_ERROR);
+    checks += 2;
+
+    make_module(data, 64, 1, 0);
+    failures += check_read("order entry 1 of 1 pattern", data, MODULE_SIZE, XM_ORDER_ERROR);
+    ++checks;
+
+    /* The pattern has no packed data, so the channel count only changes the header */
+    make_module(data, 64, 0, 0);
+    write_ushort(&data[68], XM_MAX_CHANNELS);
+    failures += check_read("32 channels", data, MODULE_SIZE, XM_NO_ERROR);
+    write_ushort(&data[68], XM_MAX_CHANNELS + 1);
+    failures += check_read("33 channels", data, MODULE_SIZE, XM_FORMAT_ERROR);
+    checks += 2;
+
+    /* The pattern's packed data has one more empty slot than it has rows */
+    size = make_module(data, 64, 0, 1);
+    write_ushort(&data[0x3C + 0x114 + 7], 64 + 2);
+    data[size] = 0x80;
+    failures += check_read("a packed slot after the last row", data, size + 1, XM_FORMAT_ERROR);
+    ++checks;
+
+    size = make_module(data, 64, 0, 1);
+    for (i = 0; i < size; ++i) {
+        sprintf(what, "cut at %d bytes", i);
+        failures += check_read(what, data, i, XM_PREMATURE_END_OF_FILE_ERROR);
+        ++checks;
+    }
+
+    printf("%d modules read, %d failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
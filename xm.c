@@ -16,107 +16,147 @@
 */
 
 #include "xm.h"
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define read_byte(fp) (unsigned char)fgetc(fp)
+#if defined(__unix__) || defined(__APPLE__)
+#define XM_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Position in the XM data being read. */
+struct xm_reader {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+};
+
+#define bytes_left(r) ((r)->size - (r)->pos)
+/* Only use when it's known that there's at least one byte left */
+#define read_byte(r) ((r)->data[(r)->pos++])
 
 /* Reads a short (little-endian) */
-static unsigned short read_ushort(FILE *fp)
+static unsigned short read_ushort(struct xm_reader *r)
 {
     unsigned short result;
-    result = read_byte(fp);        /* Low byte */
-    result |= read_byte(fp) << 8;  /* High byte */
+    result = read_byte(r);        /* Low byte */
+    result |= read_byte(r) << 8;  /* High byte */
     return result;
 }
 /* Reads an int (little-endian) */
-static unsigned int read_uint(FILE *fp)
+static unsigned int read_uint(struct xm_reader *r)
 {
     unsigned int result;
-    result = read_byte(fp);        /* Low byte */
-    result |= read_byte(fp) << 8;
-    result |= read_byte(fp) << 16;
-    result |= read_byte(fp) << 24;  /* High byte */
+    result = read_byte(r);        /* Low byte */
+    result |= read_byte(r) << 8;
+    result |= read_byte(r) << 16;
+    result |= (unsigned int)read_byte(r) << 24;  /* High byte */
     return result;
 }
 
-static int xm_read_header(FILE *fp, struct xm_header *out)
+static void read_bytes(struct xm_reader *r, void *out, size_t count)
 {
-    fread(&out->id_text, 1, 17, fp);
-    if (!strncmp(out->id_text, "Extended module: ", 17))
+    memcpy(out, &r->data[r->pos], count);
+    r->pos += count;
+}
+
+static int xm_read_header(struct xm_reader *r, struct xm_header *out)
+{
+    if (bytes_left(r) < 0x150)
+        return XM_PREMATURE_END_OF_FILE_ERROR;
+    read_bytes(r, &out->id_text, 17);
+    if (strncmp(out->id_text, "Extended module: ", 17))
+        return XM_FORMAT_ERROR;
+    read_bytes(r, &out->module_name, 20);
+    out->pad1a = read_byte(r);
+    if (out->pad1a != 0x1A)
         return XM_FORMAT_ERROR;
-    fread(&out->module_name, 1, 20, fp);
-    out->pad1a = read_byte(fp);
-    assert(out->pad1a == 0x1A);
-    fread(&out->tracker_name, 1, 20, fp);
-    out->version = read_ushort(fp);
+    read_bytes(r, &out->tracker_name, 20);
+    out->version = read_ushort(r);
     if (out->version < 0x0104)
         return XM_VERSION_ERROR;
-    out->header_size = read_uint(fp);
+    out->header_size = read_uint(r);
     if (out->header_size != 0x0114)
         return XM_HEADER_SIZE_ERROR;
-    out->song_length = read_ushort(fp);
-    out->restart_position = read_ushort(fp);
-    out->channel_count = read_ushort(fp);
-    out->pattern_count = read_ushort(fp);
-    out->instrument_count = read_ushort(fp);
-    out->flags = read_ushort(fp);
-    out->default_tempo = read_ushort(fp);
-    out->default_bpm = read_ushort(fp);
-    fread(&out->pattern_order_table, 1, 256, fp);
-    assert(ftell(fp) == 0x150);
-    assert(ftell(fp)-0x3C == out->header_size);
+    out->song_length = read_ushort(r);
+    out->restart_position = read_ushort(r);
+    out->channel_count = read_ushort(r);
+    out->pattern_count = read_ushort(r);
+    out->instrument_count = read_ushort(r);
+    out->flags = read_ushort(r);
+    out->default_tempo = read_ushort(r);
+    out->default_bpm = read_ushort(r);
+    read_bytes(r, &out->pattern_order_table, 256);
+    if (out->song_length > 256)
+        return XM_FORMAT_ERROR;
+    if (out->channel_count > XM_MAX_CHANNELS)
+        return XM_FORMAT_ERROR;
+    {
+        int i;
+        for (i = 0; i < out->song_length; ++i) {
+            if (out->pattern_order_table[i] >= out->pattern_count)
+                return XM_ORDER_ERROR;
+        }
+    }
     return XM_NO_ERROR;
 }
 
-static int xm_read_pattern(FILE *fp, int channel_count, struct xm_pattern *out)
+/**
+  Unpacks the \a size bytes of packed pattern data \a p into the slots
+  of \a out, which has \a channel_count channels. Returns
+  XM_FORMAT_ERROR if bytes are left over after the last row.
+*/
+static int xm_unpack_pattern(const unsigned char *p, size_t size,
+                             int channel_count, struct xm_pattern *out)
 {
-    unsigned int header_length;
-    unsigned char packing_type;
-    unsigned short row_count;
-    unsigned short packed_data_size;
-    long pos_before;
-    header_length = read_uint(fp);
-    assert(header_length == 9);
-    packing_type = read_byte(fp);
-    assert(packing_type == 0);
-    row_count = read_ushort(fp);
-    packed_data_size = read_ushort(fp);
-    pos_before = ftell(fp);
-    out->row_count = row_count;
-    out->data = (struct xm_pattern_slot*)malloc(channel_count * row_count * sizeof(struct xm_pattern_slot));
+    const unsigned char *end = p + size;
+    int row_count = out->row_count;
+    out->data = (struct xm_pattern_slot*)malloc(channel_count * row_count * sizeof(struct xm_pattern_slot) + 1);
+    if (!out->data)
+        return XM_OUT_OF_MEMORY_ERROR;
     memset(out->data, 0, channel_count * row_count * sizeof(struct xm_pattern_slot));
-    if (packed_data_size != 0) {
+    if (size != 0) {
         /* unpack pattern data */
         int row, column;
-        struct xm_pattern_slot *slot;
-        slot = out->data;
         for (row = 0; row < row_count; ++row) {
 	    for (column = 0; column < channel_count; ++column) {
+                struct xm_pattern_slot *slot = &xm_pattern_column(out, column)[row];
 	        unsigned char pattern_byte;
                 unsigned char note = 0, instrument = 0, volume = 0, effect_type = 0, effect_param = 0;
-	        pattern_byte = read_byte(fp);
+                if (p == end)
+                    return XM_PREMATURE_END_OF_FILE_ERROR;
+	        pattern_byte = *p++;
                 if (pattern_byte & 0x80) {
                     /* compressed */
+                    int count = ((pattern_byte & 0x01) + ((pattern_byte >> 1) & 0x01)
+                                 + ((pattern_byte >> 2) & 0x01) + ((pattern_byte >> 3) & 0x01)
+                                 + ((pattern_byte >> 4) & 0x01));
+                    if (end - p < count)
+                        return XM_PREMATURE_END_OF_FILE_ERROR;
                     if (pattern_byte & 0x01)
-		        note = read_byte(fp);
+		        note = *p++;
 		    if (pattern_byte & 0x02)
-		        instrument = read_byte(fp);
+		        instrument = *p++;
 		    if (pattern_byte & 0x04)
-		        volume = read_byte(fp);
+		        volume = *p++;
 		    if (pattern_byte & 0x08)
-		        effect_type = read_byte(fp);
+		        effect_type = *p++;
 		    if (pattern_byte & 0x10)
-		        effect_param = read_byte(fp);
+		        effect_param = *p++;
 	        } else {
 		    /* uncompressed */
+                    if (end - p < 4)
+                        return XM_PREMATURE_END_OF_FILE_ERROR;
 		    note = pattern_byte;
-		    instrument = read_byte(fp);
-		    volume = read_byte(fp);
-		    effect_type = read_byte(fp);
-		    effect_param = read_byte(fp);
+		    instrument = *p++;
+		    volume = *p++;
+		    effect_type = *p++;
+		    effect_param = *p++;
 	        }
+	        /* The instruments map, like XM, has 128 instruments */
+	        if (instrument > 128)
+	            return XM_FORMAT_ERROR;
 	        slot->note = note;
 	        slot->instrument = instrument;
 	        slot->volume = volume;
@@ -124,34 +164,202 @@ static int xm_read_pattern(FILE *fp, int channel_count, struct xm_pattern *out)
 	        if ((effect_type == 0) && (effect_param != 0)) effect_type = 5; /* arpeggio */
 	        slot->effect_type = effect_type;
 	        slot->effect_param = effect_param;
-                ++slot;
 	    }
         }
-        assert(ftell(fp) == pos_before + packed_data_size);
+        /* The rows must take up all of the packed data */
+        if (p != end)
+            return XM_FORMAT_ERROR;
     }
     return XM_NO_ERROR;
 }
 
-int xm_read(FILE *fp, struct xm *xm)
+/**
+  Reads the header of the next pattern, and either unpacks the pattern
+  data or, if \a lazy is non-zero, only records where the packed data
+  is so that it can be unpacked by xm_decode_pattern().
+*/
+static int xm_read_pattern(struct xm_reader *r, int channel_count, int lazy,
+                           struct xm_pattern *out)
 {
+    unsigned int header_length;
+    unsigned char packing_type;
+    unsigned short row_count;
+    unsigned short packed_data_size;
+    if (bytes_left(r) < 9)
+        return XM_PREMATURE_END_OF_FILE_ERROR;
+    header_length = read_uint(r);
+    packing_type = read_byte(r);
+    row_count = read_ushort(r);
+    packed_data_size = read_ushort(r);
+    if ((header_length < 9) || (packing_type != 0))
+        return XM_FORMAT_ERROR;
+    if ((row_count == 0) || (row_count > XM_MAX_ROWS))
+        return XM_FORMAT_ERROR;
+    if (bytes_left(r) < header_length - 9)
+        return XM_PREMATURE_END_OF_FILE_ERROR;
+    r->pos += header_length - 9;
+    if (bytes_left(r) < packed_data_size)
+        return XM_PREMATURE_END_OF_FILE_ERROR;
+    out->row_count = row_count;
+    out->packed_data = &r->data[r->pos];
+    out->packed_data_size = packed_data_size;
+    r->pos += packed_data_size;
+    if (lazy)
+        return XM_NO_ERROR;
+    return xm_unpack_pattern(out->packed_data, packed_data_size, channel_count, out);
+}
+
+/**
+  Reads the XM defined by the \a size bytes of \a data into \a xm.
+  If \a flags contains XM_LAZY_PATTERNS, patterns are only located, not
+  decoded; \a data must then stay valid until the patterns have been
+  decoded with xm_decode_pattern(), or until xm_destroy() is called.
+*/
+int xm_read_memory(const unsigned char *data, size_t size, int flags, struct xm *xm)
+{
+    int ret;
+    struct xm_reader r;
+    r.data = data;
+    r.size = size;
+    r.pos = 0;
+    xm->patterns = 0;
+    xm->mapped_data = 0;
+    xm->mapped_size = 0;
+    xm->allocated_data = 0;
     /* read header */
-    int ret = xm_read_header(fp, &xm->header);
+    ret = xm_read_header(&r, &xm->header);
     if (ret)
         return ret;
+    r.pos = 0x3C + xm->header.header_size;
     /* read patterns */
-    xm->patterns = (struct xm_pattern*)malloc(xm->header.pattern_count * sizeof(struct xm_pattern));
+    xm->patterns = (struct xm_pattern*)malloc(xm->header.pattern_count * sizeof(struct xm_pattern) + 1);
+    if (!xm->patterns)
+        return XM_OUT_OF_MEMORY_ERROR;
     memset(xm->patterns, 0, xm->header.pattern_count * sizeof(struct xm_pattern));
     {
         int i;
         for (i = 0; i < xm->header.pattern_count; ++i) {
-            ret = xm_read_pattern(fp, xm->header.channel_count, &xm->patterns[i]);
+            ret = xm_read_pattern(&r, xm->header.channel_count,
+                                  flags & XM_LAZY_PATTERNS, &xm->patterns[i]);
             if (ret)
                 return ret;
+            if (!(flags & XM_LAZY_PATTERNS))
+                xm->patterns[i].packed_data = 0;
         }
     }
     return XM_NO_ERROR;
 }
 
+/**
+  Reads the XM from the current position of \a fp into \a xm.
+  Where possible the file is mapped into memory rather than read,
+  unless \a flags contains XM_NO_MAPPING; use that flag if the file may
+  change while \a xm is in use.
+  If \a flags contains XM_LAZY_PATTERNS, patterns are decoded on
+  demand by xm_decode_pattern(); the file contents are kept until
+  xm_destroy() is called.
+*/
+int xm_read(FILE *fp, int flags, struct xm *xm)
+{
+    int ret;
+    unsigned char *data = 0;
+    size_t size = 0;
+#ifdef XM_HAVE_MMAP
+    {
+        struct stat st;
+        long offset = ftell(fp);
+        if (!(flags & XM_NO_MAPPING)
+            && (offset >= 0) && !fstat(fileno(fp), &st) && S_ISREG(st.st_mode)
+            && (st.st_size > offset)) {
+            void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if (addr != MAP_FAILED) {
+                ret = xm_read_memory((const unsigned char *)addr + offset,
+                                     st.st_size - offset, flags, xm);
+                if (flags & XM_LAZY_PATTERNS) {
+                    xm->mapped_data = addr;
+                    xm->mapped_size = st.st_size;
+                } else {
+                    munmap(addr, st.st_size);
+                }
+                return ret;
+            }
+        }
+    }
+#endif
+    /* Fall back to reading the rest of the stream into memory */
+    for (;;) {
+        size_t capacity = size ? size * 2 : 65536;
+        size_t count;
+        unsigned char *new_data = (unsigned char *)realloc(data, capacity);
+        if (!new_data) {
+            free(data);
+            /* So that xm_destroy() can be called */
+            memset(xm, 0, sizeof(*xm));
+            return XM_OUT_OF_MEMORY_ERROR;
+        }
+        data = new_data;
+        count = fread(&data[size], 1, capacity - size, fp);
+        size += count;
+        if (size < capacity)
+            break;
+    }
+    ret = xm_read_memory(data, size, flags, xm);
+    if (flags & XM_LAZY_PATTERNS)
+        xm->allocated_data = data;
+    else
+        free(data);
+    return ret;
+}
+
+/**
+  Decodes the pattern with index \a pindex of \a xm, if it hasn't
+  been decoded already.
+*/
+int xm_decode_pattern(struct xm *xm, int pindex)
+{
+    struct xm_pattern *pat = &xm->patterns[pindex];
+    int ret;
+    if (pat->data)
+        return XM_NO_ERROR;
+    ret = xm_unpack_pattern(pat->packed_data, pat->packed_data_size,
+                            xm->header.channel_count, pat);
+    if (ret) {
+        free(pat->data);
+        pat->data = 0;
+    }
+    return ret;
+}
+
+/**
+  Gives the patterns of \a xm that haven't been decoded yet the decoded
+  data of the patterns of \a old that have identical packed data, so
+  that they needn't be decoded again. Both must have been read with
+  XM_LAZY_PATTERNS. The data is moved; \a old must only be destroyed
+  afterwards.
+*/
+void xm_reuse_decoded_patterns(struct xm *xm, struct xm *old)
+{
+    int i, j;
+    if (xm->header.channel_count != old->header.channel_count)
+        return;
+    for (i = 0; i < xm->header.pattern_count; ++i) {
+        struct xm_pattern *pat = &xm->patterns[i];
+        if (pat->data || !pat->packed_data)
+            continue;
+        for (j = 0; j < old->header.pattern_count; ++j) {
+            struct xm_pattern *old_pat = &old->patterns[(i + j) % old->header.pattern_count];
+            if (old_pat->data && old_pat->packed_data
+                && (old_pat->row_count == pat->row_count)
+                && (old_pat->packed_data_size == pat->packed_data_size)
+                && !memcmp(old_pat->packed_data, pat->packed_data, pat->packed_data_size)) {
+                pat->data = old_pat->data;
+                old_pat->data = 0;
+                break;
+            }
+        }
+    }
+}
+
 void xm_print_header(const struct xm_header *head, FILE *fp)
 {
     {
@@ -173,12 +381,14 @@ void xm_print_header(const struct xm_header *head, FILE *fp)
     fprintf(fp, "Default BPM: %d\n", head->default_bpm);
 }
 
-void xm_print_pattern(const struct xm *xm, int pindex, FILE *fp)
+void xm_print_pattern(struct xm *xm, int pindex, FILE *fp)
 {
     int row;
     const struct xm_pattern *pat = &xm->patterns[pindex];
+    if (xm_decode_pattern(xm, pindex))
+        return;
     for (row = 0; row < pat->row_count; ++row) {
-        const struct xm_pattern_slot *slot = &pat->data[row * xm->header.channel_count];
+        const struct xm_pattern_slot *slot = &xm_pattern_column(pat, 0)[row];
         fprintf(fp, "%.2x: %.2x %.2x %.2x %.2x %.2x\n",
                 row, slot->note, slot->instrument, slot->volume,
                 slot->effect_type, slot->effect_param);
@@ -188,6 +398,13 @@ void xm_print_pattern(const struct xm *xm, int pindex, FILE *fp)
 void xm_destroy(struct xm *xm)
 {
     int i;
+#ifdef XM_HAVE_MMAP
+    if (xm->mapped_data)
+        munmap(xm->mapped_data, xm->mapped_size);
+#endif
+    free(xm->allocated_data);
+    if (!xm->patterns)
+        return;
     for (i = 0; i < xm->header.pattern_count; ++i)
         free(xm->patterns[i].data);
     free(xm->patterns);
@@ -46,14 +46,32 @@ struct xm_pattern_slot {
     unsigned char effect_param;
 };
 
+/* The slots are stored channel by channel (column-major), so that the
+   rows of a channel are contiguous; see xm_pattern_column(). */
 struct xm_pattern {
     int row_count;
-    struct xm_pattern_slot *data;
+    struct xm_pattern_slot *data; /* 0 until the pattern has been decoded */
+    const unsigned char *packed_data;
+    int packed_data_size;
 };
 
+/* The most rows a pattern may have; xm_read() rejects longer patterns */
+#define XM_MAX_ROWS 256
+
+/* The most channels a module may have, as in FastTracker 2 */
+#define XM_MAX_CHANNELS 32
+
+/* The row_count slots of the given channel of a pattern */
+#define xm_pattern_column(pattern, channel) \
+    (&(pattern)->data[(channel) * (pattern)->row_count])
+
 struct xm {
     struct xm_header header;
     struct xm_pattern *patterns;
+    /* File contents kept for patterns that are decoded on demand */
+    void *mapped_data;
+    size_t mapped_size;
+    unsigned char *allocated_data;
 };
 
 #define XM_NO_ERROR 0
@@ -61,10 +79,19 @@ struct xm {
 #define XM_VERSION_ERROR 2
 #define XM_HEADER_SIZE_ERROR 3
 #define XM_PREMATURE_END_OF_FILE_ERROR 4
+#define XM_ORDER_ERROR 5 /* the order table names a pattern that doesn't exist */
+#define XM_OUT_OF_MEMORY_ERROR 20 /* XM2NES_OUT_OF_MEMORY_ERROR is defined as this */
+
+/* Flags for xm_read() and xm_read_memory() */
+#define XM_LAZY_PATTERNS 1
+#define XM_NO_MAPPING 2 /* read the file even where it could be mapped */
 
-int xm_read(FILE *, struct xm *);
+int xm_read(FILE *, int, struct xm *);
+int xm_read_memory(const unsigned char *, size_t, int, struct xm *);
+int xm_decode_pattern(struct xm *, int);
+void xm_reuse_decoded_patterns(struct xm *, struct xm *);
 void xm_print_header(const struct xm_header *, FILE *);
-void xm_print_pattern(const struct xm *, int, FILE *);
+void xm_print_pattern(struct xm *, int, FILE *);
 void xm_destroy(struct xm *);
 
 #endif
@@ -18,9 +18,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "xm2nes.h"
+#include "arena.h"
+#include "memscan.h"
 
 #define SET_INSTRUMENT_COMMAND_BASE 0xB0
 #define SET_SPEED_COMMAND_BASE 0xC0
@@ -30,65 +34,507 @@
 #define RELEASE_COMMAND 0xF1
 #define SET_SPEED_COMMAND 0xF2
 #define END_ROW_COMMAND 0xF3
+#define SKIP_ROWS_COMMAND 0xF4
+
+/* With adaptive_patterns, each pattern starts with its format */
+#define FLAGS_PATTERN_FORMAT 0  /* 8-row chunks, each with an active rows byte */
+#define DENSE_PATTERN_FORMAT 1  /* every row, END_ROW_COMMAND if it is inactive */
+#define SPARSE_PATTERN_FORMAT 2 /* the active rows, SKIP_ROWS_COMMAND for the others */
+#define PATTERN_FORMAT_COUNT 3
+
+static int min(int a, int b) { return a < b ? a : b; }
+
+/**
+  Passes a warning about the conversion to the diagnostic callback of
+  \a options, if any.
+*/
+static void diagnostic(const struct xm2nes_options *options, const char *format, ...)
+{
+    char message[1024];
+    va_list args;
+    if (!options->diagnostic)
+        return;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    options->diagnostic(options->diagnostic_context, message);
+}
+
+/* The memory of conversions. The channels of a song may be converted
+   in parallel, so each has its own arena. Output has its own, so that
+   temporary memory can be released while output is being written. */
+struct xm2nes_arena {
+    struct arena song;
+    struct arena output;
+    struct arena *channels;
+    int channel_count;
+};
+
+/* Returns the most bytes that the arenas of \a arena have held. */
+static size_t arena_peak(const struct xm2nes_arena *arena)
+{
+    size_t peak = arena->song.peak + arena->output.peak;
+    int i;
+    for (i = 0; i < arena->channel_count; ++i)
+        peak += arena->channels[i].peak;
+    return peak;
+}
+
+/**
+  Returns the time at which a step of the conversion starts, if
+  \a options asks for statistics.
+*/
+static double start_step(const struct xm2nes_options *options)
+{
+    struct timeval tv;
+    if (!options->stats)
+        return 0;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/**
+  Records the memory the conversion has used by the end of the given
+  \a step, if \a options asks for statistics.
+*/
+static void record_step_memory(const struct xm2nes_options *options, int step)
+{
+    size_t peak;
+    if (!options->stats)
+        return;
+    peak = arena_peak(options->arena);
+    if (peak > options->stats->step_memory[step])
+        options->stats->step_memory[step] = peak;
+}
+
+/**
+  Adds the time since \a start to the time of the given \a step, and
+  records the memory used by its end, if \a options asks for
+  statistics.
+*/
+static void end_step(const struct xm2nes_options *options, int step, double start)
+{
+    if (options->stats)
+        options->stats->step_time[step] += start_step(options) - start;
+    record_step_memory(options, step);
+}
+
+/**
+  Returns the statistics of \a channel, or 0 if \a options doesn't
+  ask for statistics.
+*/
+static struct xm2nes_channel_stats *channel_stats(const struct xm2nes_options *options,
+                                                  int channel)
+{
+    if (!options->stats || (channel >= XM2NES_MAX_CHANNELS))
+        return 0;
+    return &options->stats->channels[channel];
+}
+
+/* A label defined in binary output. */
+struct output_symbol {
+    char *name;
+    int offset;
+};
+
+/* A .dw in binary output, to be patched with the address of a label. */
+struct output_relocation {
+    char *name;
+    int offset;
+};
+
+/* A file or a memory buffer that output is written to. */
+struct output_sink {
+    FILE *fp;
+    struct xm2nes_buffer *buffer;
+    int error; /* set if the buffer couldn't grow */
+};
+
+/* Where the converted song goes: either 6502 assembly text, or a
+   binary blob plus a symbol file describing its labels and pointers.
+   Assembly text is formatted into a buffer that is written out in
+   large blocks. */
+struct output {
+    struct output_sink out;
+    struct output_sink symbols_out;
+    int binary;
+    char *text;
+    int text_size;
+    unsigned char *data;
+    int size;
+    int capacity;
+    struct output_symbol *symbols;
+    int symbol_count;
+    int symbol_capacity;
+    struct output_relocation *relocations;
+    int relocation_count;
+    int relocation_capacity;
+    struct arena *arena; /* where the buffers are allocated */
+    int error; /* set if the buffers couldn't grow; output stops */
+};
+
+#define OUTPUT_TEXT_BUFFER_SIZE 65536
+
+/* Two uppercase hex digits for each byte value */
+static const char hex_table[] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/**
+  Writes \a size bytes of \a data to \a sink. A buffer supplied by the
+  caller receives as much as fits; its size keeps counting, so that the
+  caller can tell how big it must be. If a buffer allocated here can't
+  grow, the sink's error is set and nothing more is stored.
+*/
+static void sink_write(struct output_sink *sink, const void *data, size_t size)
+{
+    struct xm2nes_buffer *b = sink->buffer;
+    size_t capacity;
+    unsigned char *new_data;
+    if (sink->error || !size)
+        return;
+    if (!b) {
+        fwrite(data, 1, size, sink->fp);
+        return;
+    }
+    if (b->size + size > b->capacity) {
+        if (!b->allocated) {
+            if (b->size < b->capacity)
+                memcpy(&b->data[b->size], data, b->capacity - b->size);
+            b->size += size;
+            return;
+        }
+        capacity = b->capacity;
+        while (b->size + size > capacity)
+            capacity = capacity ? capacity * 2 : 4096;
+        new_data = (unsigned char *)realloc(b->data, capacity);
+        if (!new_data) {
+            sink->error = XM2NES_OUT_OF_MEMORY_ERROR;
+            return;
+        }
+        b->data = new_data;
+        b->capacity = capacity;
+    }
+    memcpy(&b->data[b->size], data, size);
+    b->size += size;
+}
+
+/* Prepares the buffer of \a sink, if any, to receive output. */
+static void sink_init(struct output_sink *sink)
+{
+    struct xm2nes_buffer *b = sink->buffer;
+    if (!b)
+        return;
+    b->allocated = !b->data;
+    if (b->allocated)
+        b->capacity = 0;
+    b->size = 0;
+}
+
+/**
+  Returns XM2NES_BUFFER_TOO_SMALL_ERROR if output didn't fit in \a sink,
+  or XM2NES_OUT_OF_MEMORY_ERROR if its buffer couldn't grow.
+*/
+static int sink_check(const struct output_sink *sink)
+{
+    if (sink->error)
+        return sink->error;
+    if (sink->buffer && (sink->buffer->size > sink->buffer->capacity))
+        return XM2NES_BUFFER_TOO_SMALL_ERROR;
+    return XM_NO_ERROR;
+}
+
+static void output_init(struct output *o, struct output_sink out,
+                        struct output_sink symbols_out, int binary,
+                        struct arena *arena)
+{
+    memset(o, 0, sizeof(*o));
+    o->out = out;
+    o->symbols_out = symbols_out;
+    o->binary = binary;
+    o->arena = arena;
+    sink_init(&o->out);
+    sink_init(&o->symbols_out);
+    if (!binary) {
+        o->text = (char *)arena_alloc(arena, OUTPUT_TEXT_BUFFER_SIZE);
+        if (!o->text)
+            o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+}
+
+static void output_flush_text(struct output *o)
+{
+    sink_write(&o->out, o->text, o->text_size);
+    o->text_size = 0;
+}
+
+/**
+  Returns where the next \a count characters of text can be stored.
+  The caller adds the number of characters stored to text_size.
+  Returns 0, and sets the error of \a o, if they can't fit.
+*/
+static char *output_reserve_text(struct output *o, int count)
+{
+    if (count > OUTPUT_TEXT_BUFFER_SIZE) {
+        o->error = XM2NES_INTERNAL_ERROR;
+        return 0;
+    }
+    if (o->text_size + count > OUTPUT_TEXT_BUFFER_SIZE)
+        output_flush_text(o);
+    return &o->text[o->text_size];
+}
+
+static void output_text(struct output *o, const char *s, int length)
+{
+    char *p;
+    if (o->error)
+        return;
+    p = output_reserve_text(o, length);
+    if (!p)
+        return;
+    memcpy(p, s, length);
+    o->text_size += length;
+}
+
+static void output_append(struct output *o, const unsigned char *buf, int size)
+{
+    if (o->size + size > o->capacity) {
+        int capacity = o->capacity;
+        unsigned char *data;
+        while (o->size + size > capacity)
+            capacity = capacity ? capacity * 2 : 4096;
+        data = (unsigned char *)arena_grow(o->arena, o->data, o->capacity, capacity);
+        if (!data) {
+            o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+            return;
+        }
+        o->data = data;
+        o->capacity = capacity;
+    }
+    memcpy(&o->data[o->size], buf, size);
+    o->size += size;
+}
+
+/**
+  Defines the label \a name at the current position.
+*/
+static void output_label(struct output *o, const char *name)
+{
+    if (o->error)
+        return;
+    if (!o->binary) {
+        output_text(o, name, strlen(name));
+        output_text(o, ":\n", 2);
+        return;
+    }
+    if (o->symbol_count == o->symbol_capacity) {
+        int capacity = o->symbol_capacity ? o->symbol_capacity * 2 : 64;
+        struct output_symbol *symbols = (struct output_symbol *)arena_grow(
+            o->arena, o->symbols, o->symbol_count * sizeof(struct output_symbol),
+            capacity * sizeof(struct output_symbol));
+        if (!symbols) {
+            o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+            return;
+        }
+        o->symbols = symbols;
+        o->symbol_capacity = capacity;
+    }
+    o->symbols[o->symbol_count].name = arena_strdup(o->arena, name);
+    if (!o->symbols[o->symbol_count].name) {
+        o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    o->symbols[o->symbol_count].offset = o->size;
+    ++o->symbol_count;
+}
 
 /**
-  Prints \a size bytes of data defined by \a buf to \a out.
+  Outputs \a size bytes of data defined by \a buf, \a cols
+  bytes per line.
 */
-static void print_chunk(FILE *out, const char *label,
-                        const unsigned char *buf, int size, int cols)
+static void output_chunk(struct output *o, const unsigned char *buf,
+                         int size, int cols)
 {
-    int i, j, m;
     int pos = 0;
-    if (label)
-        fprintf(out, "%s:\n", label);
-    for (i = 0; i < size / cols; ++i) {
-        fprintf(out, ".db ");
-        for (j = 0; j < cols-1; ++j)
-            fprintf(out, "$%.2X,", buf[pos++]);
-        fprintf(out, "$%.2X\n", buf[pos++]);
+    if (o->error)
+        return;
+    if (o->binary) {
+        output_append(o, buf, size);
+        return;
+    }
+    while (pos < size) {
+        /* ".db " followed by "$XX," for each byte; the last ',' becomes '\n' */
+        int count = min(cols, size - pos);
+        char *p = output_reserve_text(o, 4 + count * 4);
+        char *start = p;
+        if (!p)
+            return;
+        *p++ = '.'; *p++ = 'd'; *p++ = 'b'; *p++ = ' ';
+        for ( ; count > 0; --count) {
+            const char *hex = &hex_table[buf[pos++] * 2];
+            *p++ = '$'; *p++ = hex[0]; *p++ = hex[1]; *p++ = ',';
+        }
+        p[-1] = '\n';
+        o->text_size += p - start;
+    }
+}
+
+/**
+  Outputs the \a count byte values given as variable arguments. In
+  assembly output they are formatted with \a format.
+*/
+static void output_bytes(struct output *o, const char *format, int count, ...)
+{
+    va_list args;
+    if (o->error)
+        return;
+    va_start(args, count);
+    if (!o->binary) {
+        /* Only used for a few short lines, so no need to avoid vsprintf */
+        char *p = output_reserve_text(o, 64);
+        if (p)
+            o->text_size += vsprintf(p, format, args);
+    } else {
+        int i;
+        for (i = 0; i < count; ++i) {
+            unsigned char b = va_arg(args, int);
+            output_append(o, &b, 1);
+        }
+    }
+    va_end(args);
+}
+
+/**
+  Outputs a pointer (.dw) to the label \a name.
+*/
+static void output_pointer(struct output *o, const char *name)
+{
+    static const unsigned char placeholder[2] = { 0, 0 };
+    if (o->error)
+        return;
+    if (!o->binary) {
+        output_text(o, ".dw ", 4);
+        output_text(o, name, strlen(name));
+        output_text(o, "\n", 1);
+        return;
+    }
+    if (o->relocation_count == o->relocation_capacity) {
+        int capacity = o->relocation_capacity ? o->relocation_capacity * 2 : 64;
+        struct output_relocation *relocations = (struct output_relocation *)arena_grow(
+            o->arena, o->relocations, o->relocation_count * sizeof(struct output_relocation),
+            capacity * sizeof(struct output_relocation));
+        if (!relocations) {
+            o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+            return;
+        }
+        o->relocations = relocations;
+        o->relocation_capacity = capacity;
+    }
+    o->relocations[o->relocation_count].name = arena_strdup(o->arena, name);
+    if (!o->relocations[o->relocation_count].name) {
+        o->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    o->relocations[o->relocation_count].offset = o->size;
+    ++o->relocation_count;
+    output_append(o, placeholder, 2);
+}
+
+/**
+  Completes the output. For binary output, pointers to labels in the
+  blob are filled in with the label's offset, the blob is written and
+  the symbol file lists the labels and the pointers to patch:
+
+  symbol NAME $OFFSET
+  reloc $OFFSET NAME
+
+  A pointer to a label that isn't in the blob (e.g. the instrument
+  table) is left as 0.
+  Returns XM_NO_ERROR, XM2NES_BUFFER_TOO_SMALL_ERROR if the output
+  didn't fit in a buffer supplied by the caller, or
+  XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int output_finish(struct output *o)
+{
+    int i;
+    int ret;
+    char line[300];
+    if (o->error)
+        return o->error;
+    if (!o->binary) {
+        output_flush_text(o);
+        return sink_check(&o->out);
     }
-    m = size % cols;
-    if (m > 0) {
-        fprintf(out, ".db ");
-        for (j = 0; j < m-1; ++j)
-            fprintf(out, "$%.2X,", buf[pos++]);
-        fprintf(out, "$%.2X\n", buf[pos++]);
+    for (i = 0; i < o->symbol_count; ++i) {
+        sprintf(line, "symbol %.255s $%.4X\n",
+                o->symbols[i].name, o->symbols[i].offset);
+        sink_write(&o->symbols_out, line, strlen(line));
+    }
+    for (i = 0; i < o->relocation_count; ++i) {
+        const struct output_relocation *r = &o->relocations[i];
+        int j;
+        for (j = 0; j < o->symbol_count; ++j) {
+            if (!strcmp(o->symbols[j].name, r->name)) {
+                o->data[r->offset] = o->symbols[j].offset & 0xFF;
+                o->data[r->offset+1] = o->symbols[j].offset >> 8;
+                break;
+            }
+        }
+        sprintf(line, "reloc $%.4X %.255s\n", r->offset, r->name);
+        sink_write(&o->symbols_out, line, strlen(line));
     }
+    sink_write(&o->out, o->data, o->size);
+    ret = sink_check(&o->out);
+    if (ret)
+        return ret;
+    return sink_check(&o->symbols_out);
 }
 
 /**
   Finds the patterns that are actually used, according to the
-  pattern order table.
+  pattern order table. The set is allocated from \a arena.
+  Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
  */
-static void find_used_patterns(int song_length, const unsigned char *order_table,
-                               int **used_set)
+static int find_used_patterns(int song_length, const unsigned char *order_table,
+                              struct arena *arena, int **used_set)
 {
     int i;
     int bits_in_int = sizeof(int) * 8;
-    int set_size_in_bytes = ((song_length + bits_in_int-1) / bits_in_int) * sizeof(int);
-    *used_set = (int *)malloc(set_size_in_bytes);
+    /* The set is indexed by pattern number, which is a byte */
+    int set_size_in_bytes = ((256 + bits_in_int-1) / bits_in_int) * sizeof(int);
+    *used_set = (int *)arena_alloc(arena, set_size_in_bytes);
+    if (!*used_set)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
     memset(*used_set, 0, set_size_in_bytes);
     for (i = 0; i < song_length; ++i) {
         int j = order_table[i];
-        (*used_set)[j / bits_in_int] |= 1 << (j & (bits_in_int-1));
+        (*used_set)[j / bits_in_int] |= 1u << (j & (bits_in_int-1));
     }
+    return XM_NO_ERROR;
 }
 
 /**
   Checks if the given \a pattern is empty.
 */
 static int is_pattern_empty_for_channel(const struct xm_pattern *pattern,
-					int channel_count, int channel)
+					int channel)
 {
-    int row;
-    const struct xm_pattern_slot *slot = &pattern->data[channel];
-    for (row = 0; row < pattern->row_count; ++row, slot += channel_count) {
-        if ((slot->note != 0) || (slot->instrument != 0) || (slot->volume != 0)
-            || (slot->effect_type != 0) || (slot->effect_param != 0)) {
-            return 0;
-        }
-    }
-    return 1;
+    return memscan_is_zero(xm_pattern_column(pattern, channel),
+                           pattern->row_count * sizeof(struct xm_pattern_slot));
 }
 
 /**
@@ -98,87 +544,117 @@ static int is_pattern_empty_for_channel(const struct xm_pattern *pattern,
 static int are_patterns_equal_for_channel(
     const struct xm_pattern *p1,
     const struct xm_pattern *p2,
-    int channel_count, int channel)
+    int channel)
 {
-    int row;
-    const struct xm_pattern_slot *s1;
-    const struct xm_pattern_slot *s2;
     if (p1->row_count != p2->row_count)
         return 0;
-    s1 = &p1->data[channel];
-    s2 = &p2->data[channel];
-    for (row = 0; row < p1->row_count; ++row,
-        s1 += channel_count, s2 += channel_count) {
-        if ((s1->note != s2->note)
-            || (s1->instrument != s2->instrument)
-            || (s1->volume != s2->volume)
-            || (s1->effect_type != s2->effect_type)
-            || (s1->effect_param != s2->effect_param)) {
-            return 0;
-	}
-    }
-    return 1;
+    return !memcmp(xm_pattern_column(p1, channel), xm_pattern_column(p2, channel),
+                   p1->row_count * sizeof(struct xm_pattern_slot));
+}
+
+/* Computes the FNV-1a hash of the \a size bytes at \a data. */
+static unsigned int hash_bytes(const void *data, size_t size)
+{
+    unsigned int hash = 2166136261u;
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    for ( ; p != end; ++p)
+        hash = (hash ^ *p) * 16777619u;
+    return hash;
+}
+
+/**
+  Computes a hash of the data of the given \a pattern for the given
+  \a channel. Patterns that are equal according to
+  are_patterns_equal_for_channel() have equal hashes.
+*/
+static unsigned int hash_pattern_for_channel(const struct xm_pattern *pattern,
+                                             int channel)
+{
+    return hash_bytes(xm_pattern_column(pattern, channel),
+                      pattern->row_count * sizeof(struct xm_pattern_slot));
 }
 
+#define PATTERN_HASH_BUCKETS 512
+
 /**
   Finds unique patterns in the given \a xm for the given
   \a channel. Stores the indexes of the unique patterns
   in \a unique_pattern_indexes and the count in
-  \a unique_pattern_count.
+  \a unique_pattern_count. For every used pattern, stores the
+  index of its unique pattern in \a unique_pattern_map (unused
+  patterns are set to -1), so that the order table can be
+  calculated without comparing patterns again. Uses \a arena for
+  temporary memory. Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
 */
-static void find_unique_patterns_for_channel(
+static int find_unique_patterns_for_channel(
     const struct xm *xm, int channel,
     int *used_patterns_set,
     unsigned char *unique_pattern_indexes,
-    int *unique_pattern_count)
+    int *unique_pattern_count,
+    int *unique_pattern_map,
+    struct arena *arena)
 {
     int i;
     int bits_in_int = sizeof(int) * 8;
+    int buckets[PATTERN_HASH_BUCKETS];
+    int *next;
+    unsigned int *hashes;
+    struct arena_mark mark;
+    arena_mark(arena, &mark);
+    next = (int *)arena_alloc(arena, xm->header.pattern_count * sizeof(int));
+    hashes = (unsigned int *)arena_alloc(arena, xm->header.pattern_count * sizeof(unsigned int));
+    if (!next || !hashes) {
+        arena_release(arena, &mark);
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    for (i = 0; i < PATTERN_HASH_BUCKETS; ++i)
+        buckets[i] = -1;
     *unique_pattern_count = 0;
     for (i = 0; i < xm->header.pattern_count; ++i) {
         const struct xm_pattern *pattern;
+        unsigned int hash;
         int j;
-        if (!(used_patterns_set[i / bits_in_int] & (1 << (i & (bits_in_int-1)))))
+        unique_pattern_map[i] = -1;
+        if (!(used_patterns_set[i / bits_in_int] & (1u << (i & (bits_in_int-1)))))
             continue; /* Whole pattern is unused */
         pattern = &xm->patterns[i];
-        for (j = 0; j < *unique_pattern_count; ++j) {
-            int k = unique_pattern_indexes[j];
-            const struct xm_pattern *other = &xm->patterns[k];
-            if (are_patterns_equal_for_channel(pattern, other, xm->header.channel_count, channel)) {
+        hash = hash_pattern_for_channel(pattern, channel);
+        /* Only patterns with the same hash need to be compared */
+        for (j = buckets[hash % PATTERN_HASH_BUCKETS]; j != -1; j = next[j]) {
+            const struct xm_pattern *other = &xm->patterns[unique_pattern_indexes[j]];
+            if ((hashes[j] == hash)
+                && are_patterns_equal_for_channel(pattern, other, channel)) {
                 break;
             }
         }
-        if (j == *unique_pattern_count)
-            unique_pattern_indexes[(*unique_pattern_count)++] = i;
+        if (j == -1) {
+            j = (*unique_pattern_count)++;
+            unique_pattern_indexes[j] = i;
+            hashes[j] = hash;
+            next[j] = buckets[hash % PATTERN_HASH_BUCKETS];
+            buckets[hash % PATTERN_HASH_BUCKETS] = j;
+        }
+        unique_pattern_map[i] = j;
     }
+    arena_release(arena, &mark);
+    return XM_NO_ERROR;
 }
 
 /**
-  Calculates the order table of the given \a xm for the given
-  \a channel, based on \a unique_pattern_indexes and
-  \a unique_pattern_count. Stores the result in \a order_table.
+  Calculates the order table of a channel that plays the \a n pattern
+  table entries of \a seq. Stores the result in \a order_table.
 */
 static void calculate_order_table_for_channel(
-    const struct xm *xm, int channel,
-    int order_start_offset, int order_end_offset,
-    unsigned char *unique_pattern_indexes,
-    int unique_pattern_count, int pattern_offset,
+    const int *seq, int n,
     unsigned char *order_table, int *order_table_size)
 {
     int i;
     int prev = -1;
     int count = 0;
     int pos = 0;
-    for (i = order_start_offset; i <= order_end_offset; ++i) {
-        int j;
-        int k = xm->header.pattern_order_table[i];
-        const struct xm_pattern *pattern = &xm->patterns[k];
-        for (j = 0; j < unique_pattern_count; ++j) {
-            const struct xm_pattern *other = &xm->patterns[unique_pattern_indexes[j]];
-            if (are_patterns_equal_for_channel(pattern, other, xm->header.channel_count, channel))
-                break;
-        }
-        assert(j != unique_pattern_count);
+    for (i = 0; i < n; ++i) {
+        int j = seq[i];
         if (count == 0) {
             prev = j;
             ++count;
@@ -188,16 +664,16 @@ static void calculate_order_table_for_channel(
             } else {
                 if (count <= 4) {
                     if (count > 3)
-                        order_table[pos++] = prev + pattern_offset;
+                        order_table[pos++] = prev;
                     if (count > 2)
-                        order_table[pos++] = prev + pattern_offset;
+                        order_table[pos++] = prev;
                     if (count > 1)
-                        order_table[pos++] = prev + pattern_offset;
-                    order_table[pos++] = prev + pattern_offset;
+                        order_table[pos++] = prev;
+                    order_table[pos++] = prev;
                 } else {
                     order_table[pos++] = 0xFB;
                     order_table[pos++] = count;
-                    order_table[pos++] = prev + pattern_offset;
+                    order_table[pos++] = prev;
                     order_table[pos++] = 0xFC;
                 }
                 prev = j;
@@ -208,101 +684,305 @@ static void calculate_order_table_for_channel(
     if (count != 0) {
         if (count <= 4) {
             if (count > 3)
-                order_table[pos++] = prev + pattern_offset;
+                order_table[pos++] = prev;
             if (count > 2)
-                order_table[pos++] = prev + pattern_offset;
+                order_table[pos++] = prev;
             if (count > 1)
-                order_table[pos++] = prev + pattern_offset;
-            order_table[pos++] = prev + pattern_offset;
+                order_table[pos++] = prev;
+            order_table[pos++] = prev;
         } else {
             order_table[pos++] = 0xFB;
             order_table[pos++] = count;
-            order_table[pos++] = prev + pattern_offset;
+            order_table[pos++] = prev;
             order_table[pos++] = 0xFC;
         }
     }
     *order_table_size = pos;
 }
 
-static int min(int a, int b) { return a < b ? a : b; }
+#define MAX_ORDER_LOOP_DEPTH 4
 
 /**
-  Converts the \a channel of the given \a pattern to NES format.
+  Stores the orders [i, j) of \a seq in \a order_table, as chosen by
+  calculate_looped_order_table_for_channel(), with loops nested at
+  most \a depth deep. Returns the number of bytes stored.
 */
-static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int channel_count,
-				      int channel, const struct instr_mapping *instr_map,
-                                      unsigned char **out, int *out_size)
+static int emit_looped_orders(const int *seq, const short *choice, int n,
+                              int depth, int i, int j,
+                              unsigned char *order_table)
 {
-    unsigned char lastinstr = 0xFF;
-    unsigned char lastefftype = 0x00;
-    unsigned char lasteffparam = 0x00;
-    const struct xm_pattern_slot *slots = &pattern->data[channel];
-    int row;
-    int sz = 1024;
-    unsigned char *data = (unsigned char *)malloc(sz);
+    int c = choice[(depth*n + i)*(n+1) + j];
     int pos = 0;
-    data[pos++] = pattern->row_count;
-    /* process channel in 8-row chunks */
-    for (row = 0; row < pattern->row_count; row += 8) {
-        int i;
-        int count;
-        unsigned char copy[3];
-        unsigned char flags = 0;
-        copy[0] = lastinstr;
-        copy[1] = lastefftype;
-        copy[2] = lasteffparam;
-        count = min(8, pattern->row_count - row);
-        /* First pass: calculate active rows byte */
-        for (i = 0; i < count; ++i) {
-            const struct xm_pattern_slot *n = &slots[(row+i)*channel_count];
-            if (n->note != 0) {
-                flags |= 1 << i;
-            }
+    if (c == 0) {
+        for ( ; i < j; ++i)
+            order_table[pos++] = seq[i];
+    } else if (c > 0) {
+        pos = emit_looped_orders(seq, choice, n, depth, i, c, order_table);
+        pos += emit_looped_orders(seq, choice, n, depth, c, j, &order_table[pos]);
+    } else {
+        order_table[pos++] = 0xFB;
+        order_table[pos++] = (j - i) / -c;
+        pos += emit_looped_orders(seq, choice, n, depth-1, i, i - c, &order_table[pos]);
+        order_table[pos++] = 0xFC;
+    }
+    return pos;
+}
 
-            if (n->effect_type == 0 && lastefftype != 0) {
-                /* Effect will be cleared */
-                flags |= 1 << i;
-            }
+/**
+  Like calculate_order_table_for_channel(), but also stores repeated
+  sequences of several patterns as loops (0xFB count ... 0xFC), nested
+  at most \a max_depth deep, choosing the smallest encoding. Uses
+  \a arena for temporary memory. Returns XM_NO_ERROR, or
+  XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int calculate_looped_order_table_for_channel(
+    const int *seq, int n, int max_depth,
+    unsigned char *order_table, int *order_table_size,
+    struct arena *arena)
+{
+    unsigned short *lcp; /* length of the common prefix of seq[a..] and seq[b..] */
+    short *cost;   /* size of orders [i, j) with loops nested at most d deep */
+    short *choice; /* 0 = no loops, > 0 = split point, < 0 = loop of -choice orders */
+    int len, i, j, d;
+    struct arena_mark mark;
 
-            if ((n->instrument != 0) && (n->instrument != lastinstr)) {
-                lastinstr = n->instrument;
-                flags |= 1 << i;
-                /* setting instrument resets effect */
-                lastefftype = 0;
-                lasteffparam = 0;
-            }
+    if (max_depth > MAX_ORDER_LOOP_DEPTH)
+        max_depth = MAX_ORDER_LOOP_DEPTH;
+    arena_mark(arena, &mark);
+    lcp = (unsigned short *)arena_alloc(arena, (n+1) * (n+1) * sizeof(unsigned short));
+    cost = (short *)arena_alloc(arena, (max_depth+1) * n * (n+1) * sizeof(short));
+    choice = (short *)arena_alloc(arena, (max_depth+1) * n * (n+1) * sizeof(short));
+    if (!lcp || !cost || !choice) {
+        arena_release(arena, &mark);
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    for (i = n; i >= 0; --i) {
+        for (j = n; j > i; --j) {
+            if ((j == n) || (seq[i] != seq[j]))
+                lcp[i*(n+1) + j] = 0;
+            else
+                lcp[i*(n+1) + j] = lcp[(i+1)*(n+1) + j+1] + 1;
+        }
+    }
 
-            if (n->volume != 0) {
-                if ((n->volume >= 0x10) && (n->volume < 0x50) /* set volume */) {
-                    if (channel == 4)
-                       fprintf(stderr, "volume channel bytes are ignored for channel 4 (DMC)\n");
-                    else
-                        flags |= 1 << i;
+    for (len = 1; len <= n; ++len) {
+        for (i = 0; i + len <= n; ++i) {
+            j = i + len;
+            for (d = 0; d <= max_depth; ++d) {
+                int at = (d*n + i)*(n+1) + j;
+                int best = len;
+                int how = 0;
+                int k;
+                if (d > 0) {
+                    /* Split in two */
+                    for (k = i + 1; k < j; ++k) {
+                        int c = cost[(d*n + i)*(n+1) + k] + cost[(d*n + k)*(n+1) + j];
+                        if (c < best) {
+                            best = c;
+                            how = k;
+                        }
+                    }
+                    /* Repeat a body of k orders */
+                    for (k = 1; k <= len / 2; ++k) {
+                        int c;
+                        if ((len % k) || (len / k > 255)
+                            || (lcp[i*(n+1) + i + k] < len - k)) {
+                            continue;
+                        }
+                        c = 3 + cost[((d-1)*n + i)*(n+1) + i + k];
+                        if (c < best) {
+                            best = c;
+                            how = -k;
+                        }
+                    }
                 }
+                cost[at] = best;
+                choice[at] = how;
             }
+        }
+    }
+
+    *order_table_size = emit_looped_orders(seq, choice, n, max_depth, 0, n, order_table);
 
-            if (n->effect_type != 0 && ((n->effect_type != lastefftype)
-                || ((n->effect_param != lasteffparam) && (n->effect_param != 0)))) {
-                if (n->effect_param != 0)
-                    lasteffparam = n->effect_param;
-                flags |= 1 << i;
+    arena_release(arena, &mark);
+    return XM_NO_ERROR;
+}
+
+#define NOT_REACHED -1
+
+/**
+  Works out the instrument that \a channel of \a xm is known to have
+  when each of its unique patterns starts, by following the orders from
+  \a order_start_offset to \a order_end_offset: a pattern starts with
+  the instrument that the pattern before it in the order table ends
+  with, and the instrument is known only if it's the same wherever the
+  pattern is used. The song starts, and so also restarts, with an
+  unknown instrument. \a unique_pattern_map maps each XM pattern to its
+  unique pattern. Stores the instrument of each unique pattern, or 0xFF
+  if unknown, in \a initial_instruments. Uses \a arena for temporary
+  memory. Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int track_channel_state(const struct xm *xm, int channel,
+                               int order_start_offset, int order_end_offset,
+                               const unsigned char *unique_pattern_indexes,
+                               int unique_pattern_count,
+                               const int *unique_pattern_map,
+                               unsigned char *initial_instruments,
+                               struct arena *arena)
+{
+    struct arena_mark mark;
+    int *initial;
+    int *last;
+    int changed;
+    int i;
+    arena_mark(arena, &mark);
+    initial = (int *)arena_alloc(arena, unique_pattern_count * sizeof(int) + 1);
+    last = (int *)arena_alloc(arena, unique_pattern_count * sizeof(int) + 1);
+    if (!initial || !last) {
+        arena_release(arena, &mark);
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    for (i = 0; i < unique_pattern_count; ++i) {
+        const struct xm_pattern *pattern = &xm->patterns[unique_pattern_indexes[i]];
+        const struct xm_pattern_slot *slots = xm_pattern_column(pattern, channel);
+        int row;
+        /* The instrument that the pattern ends with, if it sets one */
+        last[i] = NOT_REACHED;
+        for (row = 0; row < pattern->row_count; ++row) {
+            if (slots[row].instrument)
+                last[i] = slots[row].instrument;
+        }
+        initial[i] = NOT_REACHED;
+    }
+    /* The instrument of a pattern can only change from NOT_REACHED to
+       known to unknown, so this ends after a few passes. */
+    do {
+        int instrument = 0xFF;
+        changed = 0;
+        for (i = order_start_offset; i <= order_end_offset; ++i) {
+            int j = unique_pattern_map[xm->header.pattern_order_table[i]];
+            if (initial[j] == NOT_REACHED) {
+                initial[j] = instrument;
+                changed = 1;
+            } else if ((initial[j] != instrument) && (initial[j] != 0xFF)) {
+                initial[j] = 0xFF;
+                changed = 1;
             }
-            lastefftype = n->effect_type;
+            instrument = (last[j] != NOT_REACHED) ? last[j] : initial[j];
         }
-        data[pos++] = flags;
+    } while (changed);
+    for (i = 0; i < unique_pattern_count; ++i)
+        initial_instruments[i] = (initial[i] != NOT_REACHED) ? initial[i] : 0xFF;
+    arena_release(arena, &mark);
+    return XM_NO_ERROR;
+}
+
+/* What the encoder assumes about a channel of the player: the (XM)
+   instrument, 0xFF if unknown, and the effect. */
+struct channel_state {
+    unsigned char instrument;
+    unsigned char effect_type;
+    unsigned char effect_param;
+};
+
+/* The most 8-row chunks a pattern can have */
+#define MAX_PATTERN_CHUNKS (XM_MAX_ROWS / 8)
+
+/* A channel of a pattern, converted to NES format. */
+struct encoded_pattern {
+    unsigned char *data;
+    int size;
+    int chunk_offsets[MAX_PATTERN_CHUNKS]; /* where each 8-row chunk starts in data */
+    struct channel_state chunk_states[MAX_PATTERN_CHUNKS]; /* the state where each chunk starts */
+    int chunk_count;
+};
+
+/* The player addresses the data of a pattern with a byte */
+#define MAX_ENCODED_PATTERN_SIZE 256
+
+/* The most bytes a row can take: volume, effect clear, long instrument,
+   effect and parameter, then release and end of row */
+#define MAX_ENCODED_ROW_SIZE 8
+
+/**
+  Converts the \a channel of the given \a pattern, from \a first_row
+  on, to NES format. \a initial is the state the channel is known to
+  have at \a first_row. The data is allocated from \a arena.
+  Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int channel,
+                                     const struct xm2nes_options *options,
+                                     int first_row, const struct channel_state *initial,
+                                     struct arena *arena, struct encoded_pattern *out)
+{
+    const struct instr_mapping *instr_map = options->instr_map;
+    unsigned char lastinstr = initial->instrument;
+    unsigned char lastefftype = initial->effect_type;
+    unsigned char lasteffparam = initial->effect_param;
+    /* The parameter of the last effect set, of any kind; repeating an
+       effect with it changes nothing */
+    unsigned char lastparam;
+    const struct xm_pattern_slot *slots = xm_pattern_column(pattern, channel);
+    int row;
+    /* The row count, then a flags byte for each chunk and the rows */
+    int sz = 1 + (pattern->row_count - first_row + 7) / 8
+        + (pattern->row_count - first_row) * MAX_ENCODED_ROW_SIZE;
+    unsigned char *data;
+    int pos = 0;
+    /* xm_read() limits the rows */
+    if ((pattern->row_count - first_row + 7) / 8 > MAX_PATTERN_CHUNKS)
+        return XM2NES_INTERNAL_ERROR;
+    data = (unsigned char *)arena_alloc(arena, sz);
+    if (!data)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    data[pos++] = pattern->row_count - first_row;
+    out->chunk_count = 0;
+    /* process channel in 8-row chunks */
+    for (row = first_row; row < pattern->row_count; row += 8) {
+        int i;
+        int count = min(8, pattern->row_count - row);
+        int flags_pos = pos;
+        unsigned char flags = 0;
+        unsigned char dmc_efftype = lastefftype;
+        out->chunk_offsets[out->chunk_count] = pos;
+        out->chunk_states[out->chunk_count].instrument = lastinstr;
+        out->chunk_states[out->chunk_count].effect_type = lastefftype;
+        out->chunk_states[out->chunk_count].effect_param = lasteffparam;
+        ++out->chunk_count;
+        /* Reserve the active rows byte; it is filled in once the rows are done */
+        data[pos++] = 0;
+        lastparam = lasteffparam;
 
-        /* Second pass: the actual note+effect data for these 8 rows */
-        /* Note that the conditions for outputting data should exactly
-           match those in the first pass! */
-        lastinstr = copy[0];
-        lastefftype = copy[1];
-        lasteffparam = copy[2];
         for (i = 0; i < count; ++i) {
-            const struct xm_pattern_slot *n = &slots[(row+i)*channel_count];
-            if (!(flags & (1 << i))) {
+            const struct xm_pattern_slot *n = &slots[row+i];
+            /* The row is active if it has a note or changes the state of the channel;
+               the checks follow the order in which the commands are output below */
+            int instrument_changes = (n->instrument != 0) && (n->instrument != lastinstr);
+            unsigned char efftype = instrument_changes ? 0 : lastefftype;
+            unsigned char effparam = instrument_changes ? 0 : lasteffparam;
+            unsigned char param = instrument_changes ? 0 : lastparam;
+            /* Effects 1-7 and A are output with their parameter, which
+               the channel keeps */
+            int keeps_param = (channel != 4)
+                && (((n->effect_type >= 0x1) && (n->effect_type <= 0x7)) || (n->effect_type == 0xA));
+            int effect_changes = (n->effect_type != 0) && ((n->effect_type != efftype)
+                || ((n->effect_param != 0) && ((n->effect_param != param)
+                    || (keeps_param && (n->effect_param != effparam)))));
+            int active = (n->note != 0)
+                || ((n->effect_type == 0) && (lastefftype != 0))
+                || instrument_changes
+                || ((channel != 4) && (n->volume >= 0x10) && (n->volume < 0x50))
+                || effect_changes;
+
+            if ((channel == 4) && (n->volume >= 0x10) && (n->volume < 0x50))
+                diagnostic(options, "volume channel bytes are ignored for channel 4 (DMC)");
+
+            if (!active) {
                 lastefftype = n->effect_type;
+                dmc_efftype = n->effect_type;
                 continue;
             }
+            flags |= 1 << i;
 
             switch (channel) {
                 case 0:
@@ -314,7 +994,7 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                         /* set new channel volume */
                         data[pos++] = SET_VOLUME_COMMAND_BASE | ((n->volume - 0x10) >> 2);
                     } else {
-                        fprintf(stderr, "ignoring volume value %2x in channel %d, row %d\n",
+                        diagnostic(options, "ignoring volume value %2x in channel %d, row %d",
                             n->volume, channel, row+i);
                     }
                 }
@@ -373,7 +1053,7 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                                 data[pos++] = n->effect_param & 0x0F;
                                 break;
                             default:
-                                fprintf(stderr, "ignoring effect %x%.2x in channel %d, row %d\n",
+                                diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
                                         n->effect_type, n->effect_param, channel, row+i);
                                 break;
                         }
@@ -389,7 +1069,7 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                         break;
 
                         default:
-                        fprintf(stderr, "ignoring effect %x%.2x in channel %d, row %d\n",
+                        diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
                             n->effect_type, n->effect_param, channel, row+i);
                         break;
                     }
@@ -401,7 +1081,11 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                     data[pos++] = RELEASE_COMMAND;
                     data[pos++] = END_ROW_COMMAND;
                     } else {
-                        data[pos++] = n->note + instr_map[lastinstr-1].transpose;
+                        /* A note before any instrument isn't transposed */
+                        int transpose = 0;
+                        if ((lastinstr >= 1) && (lastinstr <= 128))
+                            transpose = instr_map[lastinstr-1].transpose;
+                        data[pos++] = n->note + transpose;
                         if (data[pos-1] >= 0x80)
                             data[pos-1] = 0;
                     }
@@ -422,12 +1106,17 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                             }
                             break;
                         default:
-                            fprintf(stderr, "ignoring effect %x%.2x in channel %d, row %d\n",
+                            diagnostic(options, "ignoring effect %x%.2x in channel %d, row %d",
                                     n->effect_type, n->effect_param, channel, row+i);
                             ;
                     }
                 }
-                if (n->note != 0) {
+                if ((n->note != 0) && (n->instrument == 0)) {
+                    /* The sample is chosen by the instrument */
+                    diagnostic(options, "ignoring note without instrument in channel %d, row %d",
+                               channel, row+i);
+                    data[pos++] = END_ROW_COMMAND;
+                } else if (n->note != 0) {
                     unsigned char dmc_sample_index = instr_map[n->instrument - 1].target_instr;
                     if (instr_map[n->instrument - 1].transpose != 0) {
                         /* Transpose is used to indicate that this is a "multi-sample" */
@@ -437,83 +1126,1360 @@ static void convert_xm_pattern_to_nes(const struct xm_pattern *pattern, int chan
                     data[pos++] = dmc_sample_index;
                 } else
                     data[pos++] = END_ROW_COMMAND;
+                /* Nothing above changes the state of the player, but within
+                   the chunk it decides which of the following rows are active */
+                if (instrument_changes)
+                    lastinstr = n->instrument;
+                lastefftype = n->effect_type;
                 break;
             }
+            if (instrument_changes)
+                lastparam = 0;
+            if (effect_changes && (n->effect_param != 0))
+                lastparam = n->effect_param;
+        }
+        data[flags_pos] = flags;
+        if (channel == 4) {
+            /* Only the effect of the last inactive row carries over to the next chunk */
+            lastinstr = out->chunk_states[out->chunk_count-1].instrument;
+            lastefftype = dmc_efftype;
         }
     }
 
-    *out = data;
-    *out_size = pos;
+    if (pos > sz)
+        return XM2NES_INTERNAL_ERROR;
+    arena_shrink(arena, data, pos);
+    out->data = data;
+    out->size = pos;
+    return XM_NO_ERROR;
 }
 
-static void print_pattern_table(int channel_count, int unused_channels,
-                                int *unique_pattern_count,
-                                const char *label_prefix, FILE *out)
+/* A pattern channel that has been converted, kept in a cache. */
+struct cache_entry {
+    int channel;
+    unsigned char initial_instrument;
+    int row_count;
+    struct xm_pattern_slot *slots; /* copy of the channel's rows */
+    unsigned int hash;
+    struct encoded_pattern encoded;
+    char *messages; /* the warnings of the conversion, each ended by '\0' */
+    int messages_size;
+    int used; /* whether used since the last xm2nes_cache_prune() */
+    struct cache_entry *next;
+};
+
+#define CACHE_BUCKETS 1024
+
+/* Converted pattern channels, keyed by their contents. */
+struct xm2nes_cache {
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    pthread_mutex_t lock; /* the channels of a song may be converted in parallel */
+    /* The map the entries were converted with, if has_instr_map */
+    struct instr_mapping instr_map[128];
+    int has_instr_map;
+};
+
+static void free_cache_entry(struct cache_entry *e)
 {
-    int chn;
-    fprintf(out, "%spattern_table:\n", label_prefix);
-    for (chn = 0; chn < channel_count; ++chn) {
-	int i;
-        if (unused_channels & (1 << chn))
-            continue;
-	for (i = 0; i < unique_pattern_count[chn]; ++i)
-	    fprintf(out, ".dw %schn%d_ptn%d\n", label_prefix, chn, i);
-    }
+    free(e->slots);
+    free(e->encoded.data);
+    free(e->messages);
+    free(e);
 }
 
-static void print_song_struct(int channel_count, int unused_channels,
-                              int default_tempo, int *order_data_size,
-                              unsigned char *order_data, int song_length,
-                              const char *label_prefix, FILE *out)
+/**
+  Creates a cache of converted patterns, to be passed to successive
+  conversions in xm2nes_options::cache. Patterns whose contents haven't
+  changed since an earlier conversion are then not converted again.
+  The conversions must not run at the same time. Returns 0 if there is
+  no memory left.
+*/
+struct xm2nes_cache *xm2nes_cache_create(void)
 {
-    int chn;
-    int order_offset = 0;
-    fprintf(out, "%ssong:\n", label_prefix);
-    for (chn = 0; chn < channel_count; ++chn) {
-        if (chn >= 5)
-            break;
-        if (unused_channels & (1 << chn)) {
-            fprintf(out, ".db $FF\n");
-        } else {
-            fprintf(out, ".db %d,%d\n", order_offset, default_tempo);
-            order_offset += order_data_size[chn] + 2;
-        }
-    }
-    fprintf(out, ".dw %sinstrument_table\n", label_prefix);
-    fprintf(out, ".dw %spattern_table\n", label_prefix);
-    order_offset = 0;
-    for (chn = 0; chn < channel_count; ++chn) {
-        if (chn >= 5)
-            break;
-        if (unused_channels & (1 << chn))
-            continue;
-        print_chunk(out, 0, &order_data[chn * song_length],
-                    order_data_size[chn], 16);
-        fprintf(out, ".db $FE,%d\n", order_offset); /* loop back to the beginning */
-        order_offset += order_data_size[chn] + 2;
-    }
+    struct xm2nes_cache *cache = (struct xm2nes_cache *)malloc(sizeof(struct xm2nes_cache));
+    if (!cache)
+        return 0;
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, 0);
+    return cache;
 }
 
 /**
-  Converts the given \a xm to NES format; writes the 6502 assembly
-  language representation of the song to \a out.
+  Removes the patterns from the \a cache that haven't been used since
+  the previous call. \a cache may be 0.
 */
-void convert_xm_to_nes(const struct xm *xm,
-                       const struct xm2nes_options *options,
-                       FILE *out)
+void xm2nes_cache_prune(struct xm2nes_cache *cache)
 {
-    int chn;
+    int i;
+    if (!cache)
+        return;
+    for (i = 0; i < CACHE_BUCKETS; ++i) {
+        struct cache_entry **pe = &cache->buckets[i];
+        while (*pe) {
+            struct cache_entry *e = *pe;
+            if (e->used) {
+                e->used = 0;
+                pe = &e->next;
+            } else {
+                *pe = e->next;
+                free_cache_entry(e);
+            }
+        }
+    }
+}
+
+void xm2nes_cache_destroy(struct xm2nes_cache *cache)
+{
+    int i;
+    if (!cache)
+        return;
+    for (i = 0; i < CACHE_BUCKETS; ++i) {
+        struct cache_entry *e = cache->buckets[i];
+        while (e) {
+            struct cache_entry *next = e->next;
+            free_cache_entry(e);
+            e = next;
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+  Empties the \a cache if its entries were converted with another
+  instruments map than \a instr_map, which sets the instrument numbers,
+  the transposes and the DMC samples of the converted patterns.
+*/
+static void cache_use_instruments_map(struct xm2nes_cache *cache,
+                                      const struct instr_mapping *instr_map)
+{
+    int i;
+    if (cache->has_instr_map) {
+        for (i = 0; i < 128; ++i) {
+            if ((cache->instr_map[i].target_instr != instr_map[i].target_instr)
+                || (cache->instr_map[i].transpose != instr_map[i].transpose)) {
+                break;
+            }
+        }
+        if (i == 128)
+            return;
+    }
+    for (i = 0; i < CACHE_BUCKETS; ++i) {
+        struct cache_entry *e = cache->buckets[i];
+        while (e) {
+            struct cache_entry *next = e->next;
+            free_cache_entry(e);
+            e = next;
+        }
+        cache->buckets[i] = 0;
+    }
+    memcpy(cache->instr_map, instr_map, sizeof(cache->instr_map));
+    cache->has_instr_map = 1;
+}
+
+/* The warnings of a conversion whose result is added to the cache. */
+struct cache_messages {
+    const struct xm2nes_options *options; /* where the warnings are passed on */
+    char *messages;
+    int size;
+    int error; /* set if there was no memory left to keep a warning */
+};
+
+/* Diagnostic callback that passes the warning on and keeps a copy. */
+static void keep_cache_diagnostic(void *context, const char *message)
+{
+    struct cache_messages *m = (struct cache_messages *)context;
+    int length = strlen(message) + 1;
+    char *messages;
+    diagnostic(m->options, "%s", message);
+    messages = (char *)realloc(m->messages, m->size + length);
+    if (!messages) {
+        m->error = 1;
+        return;
+    }
+    memcpy(&messages[m->size], message, length);
+    m->messages = messages;
+    m->size += length;
+}
+
+/**
+  Copies \a p to \a out, with the data allocated from \a arena, or
+  with malloc() if \a arena is 0. Returns XM_NO_ERROR, or
+  XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int copy_encoded_pattern(const struct encoded_pattern *p, struct arena *arena,
+                                struct encoded_pattern *out)
+{
+    *out = *p;
+    out->data = (unsigned char *)(arena ? arena_alloc(arena, p->size) : malloc(p->size));
+    if (!out->data)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    memcpy(out->data, p->data, p->size);
+    return XM_NO_ERROR;
+}
+
+/**
+  Like convert_xm_pattern_to_nes(), but takes the result from the
+  \a cache if the channel has been converted before, and otherwise
+  adds it. Sets \a cache_hit to 1 if the result was taken from the
+  cache, otherwise to 0. The warnings of the conversion are kept with
+  the result, and given again when it is taken from the cache. If there
+  isn't enough memory to add the result, it is still returned, but not
+  added.
+  Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int convert_xm_pattern_to_nes_cached(struct xm2nes_cache *cache,
+                                            const struct xm_pattern *pattern,
+                                            int channel, const struct xm2nes_options *options,
+                                            unsigned char initial_instrument,
+                                            struct arena *arena, struct encoded_pattern *out,
+                                            int *cache_hit)
+{
+    unsigned int hash = hash_pattern_for_channel(pattern, channel);
+    const struct xm_pattern_slot *slots = xm_pattern_column(pattern, channel);
+    int slots_size = pattern->row_count * sizeof(struct xm_pattern_slot);
+    struct xm2nes_options keep_options;
+    struct cache_messages messages;
+    struct channel_state initial;
+    struct cache_entry *e;
+    int ret;
+    int i;
+    *cache_hit = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (e = cache->buckets[hash % CACHE_BUCKETS]; e != 0; e = e->next) {
+        if ((e->hash == hash) && (e->channel == channel)
+            && (e->initial_instrument == initial_instrument)
+            && (e->row_count == pattern->row_count)
+            && !memcmp(e->slots, slots, slots_size)) {
+            e->used = 1;
+            ret = copy_encoded_pattern(&e->encoded, arena, out);
+            pthread_mutex_unlock(&cache->lock);
+            /* Entries are only removed between conversions */
+            for (i = 0; i < e->messages_size; i += strlen(&e->messages[i]) + 1)
+                diagnostic(options, "%s", &e->messages[i]);
+            *cache_hit = 1;
+            return ret;
+        }
+    }
+    /* Entries are per channel, so no other thread converts this one */
+    pthread_mutex_unlock(&cache->lock);
+    initial.instrument = initial_instrument;
+    initial.effect_type = 0;
+    initial.effect_param = 0;
+    messages.options = options;
+    messages.messages = 0;
+    messages.size = 0;
+    messages.error = 0;
+    keep_options = *options;
+    keep_options.diagnostic = keep_cache_diagnostic;
+    keep_options.diagnostic_context = &messages;
+    ret = convert_xm_pattern_to_nes(pattern, channel, &keep_options, 0, &initial, arena, out);
+    if (ret || messages.error) {
+        free(messages.messages);
+        return ret;
+    }
+    /* The cache outlives the conversion, so its entries aren't in the arena */
+    e = (struct cache_entry *)malloc(sizeof(struct cache_entry));
+    if (!e) {
+        free(messages.messages);
+        return XM_NO_ERROR;
+    }
+    e->messages = messages.messages;
+    e->messages_size = messages.size;
+    e->channel = channel;
+    e->initial_instrument = initial_instrument;
+    e->row_count = pattern->row_count;
+    e->slots = (struct xm_pattern_slot *)malloc(slots_size + 1);
+    if (!e->slots || copy_encoded_pattern(out, 0, &e->encoded)) {
+        free(e->slots);
+        free(e->messages);
+        free(e);
+        return XM_NO_ERROR;
+    }
+    memcpy(e->slots, slots, slots_size);
+    e->hash = hash;
+    e->used = 1;
+    pthread_mutex_lock(&cache->lock);
+    e->next = cache->buckets[hash % CACHE_BUCKETS];
+    cache->buckets[hash % CACHE_BUCKETS] = e;
+    pthread_mutex_unlock(&cache->lock);
+    return XM_NO_ERROR;
+}
+
+/**
+  Splits \a p, the converted \a channel of \a pattern, at 8-row chunks
+  into pieces of less than MAX_ENCODED_PATTERN_SIZE bytes, to be played
+  one after the other. The rest of the pattern after each piece is
+  converted again, starting with the instrument and effect parameter
+  that the channel has there, and, like any pattern, without an effect.
+  Stores the pieces in \a pieces, which take over the data of \a p and
+  need room for MAX_PATTERN_CHUNKS pieces (each has at least one chunk),
+  and their count in \a count. The rests are allocated from \a arena.
+  With adaptive_patterns, a byte is left for the format of each piece,
+  and with chunk_dictionary, one for each chunk, which may be stored
+  inline. Returns XM_NO_ERROR, or the error of converting a rest.
+*/
+static int split_encoded_pattern(const struct xm_pattern *pattern, int channel,
+                                 const struct xm2nes_options *options,
+                                 const struct encoded_pattern *p,
+                                 struct arena *arena,
+                                 struct encoded_pattern *pieces, int *count)
+{
+    struct xm2nes_options quiet_options = *options;
+    struct encoded_pattern rest = *p;
+    int max_size = MAX_ENCODED_PATTERN_SIZE - (options->adaptive_patterns ? 1 : 0);
+    int chunk_extra = options->chunk_dictionary ? 1 : 0;
+    int first_row = 0;
+    int ret;
+    *count = 0;
+    /* The diagnostics have been given for the whole pattern */
+    quiet_options.diagnostic = 0;
+    while (rest.size + chunk_extra * rest.chunk_count >= max_size) {
+        struct encoded_pattern *piece = &pieces[(*count)++];
+        struct channel_state state;
+        int n = rest.chunk_count - 1;
+        /* Take as many chunks as fit; a chunk is much smaller than a pattern */
+        while (rest.chunk_offsets[n] + chunk_extra * n >= max_size)
+            --n;
+        if (n <= 0)
+            return XM2NES_INTERNAL_ERROR;
+        *piece = rest;
+        piece->size = rest.chunk_offsets[n];
+        piece->chunk_count = n;
+        piece->data[0] = n * 8;
+        state = rest.chunk_states[n];
+        state.effect_type = 0;
+        first_row += n * 8;
+        ret = convert_xm_pattern_to_nes(pattern, channel, &quiet_options, first_row, &state,
+                                        arena, &rest);
+        if (ret)
+            return ret;
+    }
+    pieces[(*count)++] = rest;
+    return XM_NO_ERROR;
+}
+
+/* Returns the size of the row of \a channel that starts at \a data. */
+static int encoded_row_size(const unsigned char *data, int channel)
+{
+    int pos = 0;
+    for (;;) {
+        unsigned char b = data[pos++];
+        if (channel == 4) {
+            /* The DMC channel only has speed commands and samples */
+            if (b == SET_SPEED_COMMAND)
+                ++pos;
+            else if ((b & 0xF0) != SET_SPEED_COMMAND_BASE)
+                return pos;
+        } else if ((b < SET_INSTRUMENT_COMMAND_BASE) || (b == END_ROW_COMMAND)) {
+            return pos;
+        } else if (((b > SET_EFFECT_COMMAND_BASE) && (b < SET_INSTRUMENT_COMMAND))
+                   || (b == SET_INSTRUMENT_COMMAND) || (b == SET_SPEED_COMMAND)) {
+            ++pos; /* parameter */
+        }
+    }
+}
+
+/**
+  Stores \a p, the converted \a channel of a pattern, in the smallest of
+  the pattern formats, which is the first byte of the new data. Inactive
+  rows take no data but the active rows byte of their chunk in the flags
+  format, an END_ROW_COMMAND each in the dense format, and a
+  SKIP_ROWS_COMMAND and the number of rows (0 for 256) for each run in
+  the sparse format. The data is allocated from \a arena. Stores the
+  format in \a format. Returns XM_NO_ERROR, XM2NES_OUT_OF_MEMORY_ERROR,
+  or XM2NES_INTERNAL_ERROR if \a p is not a valid pattern.
+*/
+static int choose_pattern_format(struct encoded_pattern *p, int channel,
+                                 struct arena *arena, int *format)
+{
+    int row_count = p->data[0] ? p->data[0] : 256;
+    int sizes[PATTERN_FORMAT_COUNT];
+    int rows_size = 0;
+    int inactive_count = 0;
+    int run_count = 0;
+    unsigned char *data;
+    int active = 1;
+    int flags = 0;
+    int pos = 1;
+    int out;
+    int row, i;
+    for (row = 0; row < row_count; ++row) {
+        if ((row % 8) == 0)
+            flags = p->data[pos++];
+        if (flags & (1 << (row % 8))) {
+            int size = encoded_row_size(&p->data[pos], channel);
+            rows_size += size;
+            pos += size;
+            active = 1;
+        } else {
+            if (active)
+                ++run_count;
+            ++inactive_count;
+            active = 0;
+        }
+    }
+    if (pos != p->size)
+        return XM2NES_INTERNAL_ERROR;
+    sizes[FLAGS_PATTERN_FORMAT] = p->size;
+    sizes[DENSE_PATTERN_FORMAT] = 1 + rows_size + inactive_count;
+    sizes[SPARSE_PATTERN_FORMAT] = 1 + rows_size + 2 * run_count;
+    *format = FLAGS_PATTERN_FORMAT;
+    for (i = 0; i < PATTERN_FORMAT_COUNT; ++i) {
+        if (sizes[i] < sizes[*format])
+            *format = i;
+    }
+
+    data = (unsigned char *)arena_alloc(arena, 1 + sizes[*format]);
+    if (!data)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    data[0] = *format;
+    if (*format == FLAGS_PATTERN_FORMAT) {
+        memcpy(&data[1], p->data, p->size);
+    } else {
+        int run = 0;
+        data[1] = p->data[0];
+        out = 2;
+        pos = 1;
+        for (row = 0; row < row_count; ++row) {
+            if ((row % 8) == 0)
+                flags = p->data[pos++];
+            if (flags & (1 << (row % 8))) {
+                int size = encoded_row_size(&p->data[pos], channel);
+                if (run) {
+                    data[out++] = SKIP_ROWS_COMMAND;
+                    data[out++] = run & 0xFF;
+                    run = 0;
+                }
+                memcpy(&data[out], &p->data[pos], size);
+                out += size;
+                pos += size;
+            } else if (*format == DENSE_PATTERN_FORMAT) {
+                data[out++] = END_ROW_COMMAND;
+            } else {
+                ++run;
+            }
+        }
+        if (run) {
+            data[out++] = SKIP_ROWS_COMMAND;
+            data[out++] = run & 0xFF;
+        }
+        if (out != 1 + sizes[*format])
+            return XM2NES_INTERNAL_ERROR;
+    }
+    p->data = data;
+    p->size = 1 + sizes[*format];
+    /* Only the chunk dictionary uses the chunks, and only in the flags format */
+    p->chunk_count = 0;
+    return XM_NO_ERROR;
+}
+
+/* A distinct encoded pattern, stored once and shared by all the
+   channels and patterns that encode to the same bytes. */
+struct pool_entry {
+    const struct encoded_pattern *pattern;
+    const char *label_prefix;
+    int channel; /* the label is named after the first use */
+    int index;
+    unsigned int hash;
+    int next; /* next entry in the same hash bucket */
+};
+
+/* The patterns of the pattern table. */
+struct pattern_pool {
+    struct pool_entry *entries;
+    int count;
+    int capacity;
+    int *buckets;
+    int bucket_count;
+    struct arena *arena; /* where the entries and buckets are allocated */
+};
+
+static void pattern_pool_init(struct pattern_pool *pool, struct arena *arena)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->arena = arena;
+}
+
+/* Doubles the buckets of \a pool. Returns 0 if there is no memory left. */
+static int pattern_pool_rehash(struct pattern_pool *pool)
+{
+    int bucket_count = pool->bucket_count ? pool->bucket_count * 2 : 256;
+    int *buckets = (int *)arena_alloc(pool->arena, bucket_count * sizeof(int));
+    int i;
+    if (!buckets)
+        return 0;
+    pool->bucket_count = bucket_count;
+    pool->buckets = buckets;
+    for (i = 0; i < pool->bucket_count; ++i)
+        pool->buckets[i] = -1;
+    for (i = 0; i < pool->count; ++i) {
+        struct pool_entry *e = &pool->entries[i];
+        e->next = pool->buckets[e->hash & (pool->bucket_count-1)];
+        pool->buckets[e->hash & (pool->bucket_count-1)] = i;
+    }
+    return 1;
+}
+
+/**
+  Adds the \a pattern, which is pattern \a index of \a channel, to the
+  \a pool, unless an identical pattern is already in it.
+  Returns the index of the pattern in the pool, or -1 if there is no
+  memory left.
+*/
+static int pattern_pool_add(struct pattern_pool *pool,
+                            const struct encoded_pattern *pattern,
+                            const char *label_prefix, int channel, int index)
+{
+    unsigned int hash = hash_bytes(pattern->data, pattern->size);
+    struct pool_entry *e;
+    int i;
+    if (pool->bucket_count) {
+        for (i = pool->buckets[hash & (pool->bucket_count-1)]; i != -1; i = pool->entries[i].next) {
+            e = &pool->entries[i];
+            if ((e->hash == hash) && (e->pattern->size == pattern->size)
+                && !memcmp(e->pattern->data, pattern->data, pattern->size)) {
+                return i;
+            }
+        }
+    }
+    if (pool->count == pool->capacity) {
+        int capacity = pool->capacity ? pool->capacity * 2 : 256;
+        struct pool_entry *entries = (struct pool_entry *)arena_grow(
+            pool->arena, pool->entries, pool->count * sizeof(struct pool_entry),
+            capacity * sizeof(struct pool_entry));
+        if (!entries)
+            return -1;
+        pool->entries = entries;
+        pool->capacity = capacity;
+    }
+    e = &pool->entries[pool->count];
+    e->pattern = pattern;
+    e->label_prefix = label_prefix;
+    e->channel = channel;
+    e->index = index;
+    e->hash = hash;
+    ++pool->count;
+    if (pool->count * 2 > pool->bucket_count) {
+        if (!pattern_pool_rehash(pool)) {
+            --pool->count;
+            return -1;
+        }
+    } else {
+        e->next = pool->buckets[hash & (pool->bucket_count-1)];
+        pool->buckets[hash & (pool->bucket_count-1)] = pool->count - 1;
+    }
+    return pool->count - 1;
+}
+
+static void pool_entry_label(const struct pool_entry *e, char *label)
+{
+    sprintf(label, "%schn%d_ptn%d", e->label_prefix, e->channel, e->index);
+}
+
+/**
+  Prints the patterns of the \a pool.
+*/
+static void print_patterns(const struct pattern_pool *pool, struct output *out)
+{
+    int i;
+    char label[256];
+    for (i = 0; i < pool->count; ++i) {
+        const struct pool_entry *e = &pool->entries[i];
+        pool_entry_label(e, label);
+        output_label(out, label);
+        output_chunk(out, e->pattern->data, e->pattern->size, 16);
+    }
+}
+
+/* A distinct 8-row chunk, when building the chunk dictionary. */
+struct chunk_entry {
+    const unsigned char *data;
+    int size;
+    unsigned int hash;
+    int ref_count;
+    int next;  /* next entry in the same hash bucket */
+    int index; /* index in the dictionary, or -1 if stored inline */
+};
+
+#define INLINE_CHUNK 0xFF
+#define MAX_DICTIONARY_CHUNKS 255
+
+static int chunk_entry_size(const struct encoded_pattern *p, int chunk)
+{
+    if (chunk + 1 < p->chunk_count)
+        return p->chunk_offsets[chunk + 1] - p->chunk_offsets[chunk];
+    return p->size - p->chunk_offsets[chunk];
+}
+
+/* Returns how many bytes storing the chunk in the dictionary saves */
+static int chunk_entry_saving(const struct chunk_entry *e)
+{
+    /* Inline, each reference costs INLINE_CHUNK + the data. In the
+       dictionary, the data and its pointer are stored once, and each
+       reference is an index byte. */
+    return e->size * (e->ref_count - 1) - 2;
+}
+
+static int compare_chunk_entries(const void *a, const void *b)
+{
+    const struct chunk_entry *e1 = *(const struct chunk_entry * const *)a;
+    const struct chunk_entry *e2 = *(const struct chunk_entry * const *)b;
+    int d = chunk_entry_saving(e2) - chunk_entry_saving(e1);
+    if (d != 0)
+        return d;
+    return (e1 < e2) ? -1 : (e1 > e2); /* keep first-seen order */
+}
+
+/**
+  Prints the patterns of the \a pool using a chunk dictionary: 8-row
+  chunks that occur more than once are stored once, under the label
+  PREFIXchunkN, and pointed to by PREFIXchunk_table. Each pattern is
+  the row count followed by one byte per chunk: the chunk's index in
+  the table, or INLINE_CHUNK followed by the chunk data. Temporary
+  memory comes from the pool's arena; if there is none left, the error
+  of \a out is set.
+  Returns the number of bytes used.
+*/
+static int print_patterns_with_chunk_dictionary(const struct pattern_pool *pool,
+                                                const char *label_prefix,
+                                                struct output *out)
+{
+    int entry_count = 0;
+    int total_chunk_count = 0;
+    int bucket_count = 1;
+    int *buckets;
+    int *chunk_entries; /* entry of each chunk of each pattern */
+    struct chunk_entry *entries;
+    struct chunk_entry **sorted;
+    char label[256];
+    int i;
+    int dictionary_size = 0;
+    int total_size = 0;
+    struct arena_mark mark;
+
+    for (i = 0; i < pool->count; ++i)
+        total_chunk_count += pool->entries[i].pattern->chunk_count;
+    while (bucket_count < total_chunk_count * 2)
+        bucket_count <<= 1;
+    arena_mark(pool->arena, &mark);
+    buckets = (int *)arena_alloc(pool->arena, bucket_count * sizeof(int));
+    entries = (struct chunk_entry *)arena_alloc(pool->arena, (total_chunk_count + 1) * sizeof(struct chunk_entry));
+    chunk_entries = (int *)arena_alloc(pool->arena, (pool->count * MAX_PATTERN_CHUNKS + 1) * sizeof(int));
+    if (!buckets || !entries || !chunk_entries) {
+        out->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        arena_release(pool->arena, &mark);
+        return 0;
+    }
+    for (i = 0; i < bucket_count; ++i)
+        buckets[i] = -1;
+
+    /* Find the distinct chunks, and how often each is used */
+    for (i = 0; i < pool->count; ++i) {
+        const struct encoded_pattern *p = pool->entries[i].pattern;
+        int c;
+        for (c = 0; c < p->chunk_count; ++c) {
+            const unsigned char *data = &p->data[p->chunk_offsets[c]];
+            int size = chunk_entry_size(p, c);
+            unsigned int hash = hash_bytes(data, size);
+            int j;
+            for (j = buckets[hash & (bucket_count-1)]; j != -1; j = entries[j].next) {
+                if ((entries[j].hash == hash) && (entries[j].size == size)
+                    && !memcmp(entries[j].data, data, size)) {
+                    break;
+                }
+            }
+            if (j == -1) {
+                j = entry_count++;
+                entries[j].data = data;
+                entries[j].size = size;
+                entries[j].hash = hash;
+                entries[j].ref_count = 0;
+                entries[j].index = -1;
+                entries[j].next = buckets[hash & (bucket_count-1)];
+                buckets[hash & (bucket_count-1)] = j;
+            }
+            ++entries[j].ref_count;
+            chunk_entries[i*MAX_PATTERN_CHUNKS + c] = j;
+        }
+    }
+
+    /* Put the chunks that save the most bytes in the dictionary */
+    sorted = (struct chunk_entry **)arena_alloc(pool->arena, (entry_count + 1) * sizeof(struct chunk_entry *));
+    if (!sorted) {
+        out->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        arena_release(pool->arena, &mark);
+        return 0;
+    }
+    for (i = 0; i < entry_count; ++i)
+        sorted[i] = &entries[i];
+    qsort(sorted, entry_count, sizeof(struct chunk_entry *), compare_chunk_entries);
+    for (i = 0; (i < entry_count) && (i < MAX_DICTIONARY_CHUNKS); ++i) {
+        if (chunk_entry_saving(sorted[i]) <= 0)
+            break;
+        sorted[i]->index = 0; /* assigned below */
+    }
+    /* Number the dictionary chunks in the order they are first used */
+    {
+        int index = 0;
+        for (i = 0; i < entry_count; ++i) {
+            if (entries[i].index == -1)
+                continue;
+            entries[i].index = index++;
+            sprintf(label, "%schunk%d", label_prefix, entries[i].index);
+            output_label(out, label);
+            output_chunk(out, entries[i].data, entries[i].size, 16);
+            dictionary_size += entries[i].size + 2;
+        }
+    }
+
+    for (i = 0; i < pool->count; ++i) {
+        const struct encoded_pattern *p = pool->entries[i].pattern;
+        /* At most one index byte per chunk is added to the data */
+        unsigned char *data = (unsigned char *)arena_alloc(pool->arena, p->size + p->chunk_count);
+        int pos = 0;
+        int c;
+        if (!data) {
+            out->error = XM2NES_OUT_OF_MEMORY_ERROR;
+            arena_release(pool->arena, &mark);
+            return 0;
+        }
+        data[pos++] = p->data[0]; /* row count */
+        for (c = 0; c < p->chunk_count; ++c) {
+            const struct chunk_entry *e = &entries[chunk_entries[i*MAX_PATTERN_CHUNKS + c]];
+            if (e->index != -1) {
+                data[pos++] = e->index;
+            } else {
+                data[pos++] = INLINE_CHUNK;
+                memcpy(&data[pos], e->data, e->size);
+                pos += e->size;
+            }
+        }
+        pool_entry_label(&pool->entries[i], label);
+        output_label(out, label);
+        output_chunk(out, data, pos, 16);
+        total_size += pos;
+    }
+
+    sprintf(label, "%schunk_table", label_prefix);
+    output_label(out, label);
+    for (i = 0; i < entry_count; ++i) {
+        if (entries[i].index == -1)
+            continue;
+        sprintf(label, "%schunk%d", label_prefix, entries[i].index);
+        output_pointer(out, label);
+    }
+
+    arena_release(pool->arena, &mark);
+    return total_size + dictionary_size;
+}
+
+static void print_pattern_table(const struct pattern_pool *pool,
+                                const char *label_prefix, struct output *out)
+{
+    int i;
+    char label[256];
+    sprintf(label, "%spattern_table", label_prefix);
+    output_label(out, label);
+    for (i = 0; i < pool->count; ++i) {
+        pool_entry_label(&pool->entries[i], label);
+        output_pointer(out, label);
+    }
+}
+
+/**
+  Prints the song struct and order tables of a song whose labels start
+  with \a label_prefix. The pattern table (and chunk table) it points
+  to is labelled with \a table_prefix.
+*/
+static void print_song_struct(int channel_count, int unused_channels,
+                              int default_tempo, int *order_data_size,
+                              unsigned char *order_data, int order_stride,
+                              int chunk_dictionary, const char *label_prefix,
+                              const char *table_prefix, struct output *out)
+{
+    int chn;
+    int order_offset = 0;
+    char label[256];
+    sprintf(label, "%ssong", label_prefix);
+    output_label(out, label);
+    for (chn = 0; chn < channel_count; ++chn) {
+        if (chn >= 5)
+            break;
+        if (unused_channels & (1u << chn)) {
+            output_bytes(out, ".db $%.2X\n", 1, 0xFF);
+        } else {
+            output_bytes(out, ".db %d,%d\n", 2, order_offset, default_tempo);
+            order_offset += order_data_size[chn] + 2;
+        }
+    }
+    sprintf(label, "%sinstrument_table", label_prefix);
+    output_pointer(out, label);
+    sprintf(label, "%spattern_table", table_prefix);
+    output_pointer(out, label);
+    if (chunk_dictionary) {
+        sprintf(label, "%schunk_table", table_prefix);
+        output_pointer(out, label);
+    }
+    order_offset = 0;
+    for (chn = 0; chn < channel_count; ++chn) {
+        if (chn >= 5)
+            break;
+        if (unused_channels & (1u << chn))
+            continue;
+        output_chunk(out, &order_data[chn * order_stride],
+                     order_data_size[chn], 16);
+        output_bytes(out, ".db $%.2X,%d\n", 2, 0xFE, order_offset); /* loop back to the beginning */
+        order_offset += order_data_size[chn] + 2;
+    }
+}
+
+/**
+  Creates the memory for conversions, to be passed to successive
+  conversions in xm2nes_options::arena. Each conversion frees what it
+  allocated when it ends, but the memory is kept, so that converting
+  a series of similar modules allocates almost nothing after the first.
+  The conversions must not run at the same time. Returns 0 if there is
+  no memory left.
+*/
+struct xm2nes_arena *xm2nes_arena_create(void)
+{
+    struct xm2nes_arena *arena = (struct xm2nes_arena *)malloc(sizeof(struct xm2nes_arena));
+    if (!arena)
+        return 0;
+    arena_init(&arena->song);
+    arena_init(&arena->output);
+    arena->channels = 0;
+    arena->channel_count = 0;
+    return arena;
+}
+
+void xm2nes_arena_destroy(struct xm2nes_arena *arena)
+{
+    int i;
+    if (!arena)
+        return;
+    arena_destroy(&arena->song);
+    arena_destroy(&arena->output);
+    for (i = 0; i < arena->channel_count; ++i)
+        arena_destroy(&arena->channels[i]);
+    free(arena->channels);
+    free(arena);
+}
+
+/**
+  Makes sure that \a arena has an arena for each of \a channel_count
+  channels. Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int reserve_channel_arenas(struct xm2nes_arena *arena, int channel_count)
+{
+    struct arena *channels;
+    if (channel_count <= arena->channel_count)
+        return XM_NO_ERROR;
+    channels = (struct arena *)realloc(arena->channels, channel_count * sizeof(struct arena));
+    if (!channels)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    arena->channels = channels;
+    while (arena->channel_count < channel_count)
+        arena_init(&arena->channels[arena->channel_count++]);
+    return XM_NO_ERROR;
+}
+
+/* Frees everything the conversions allocated from \a arena. */
+static void reset_arena(struct xm2nes_arena *arena)
+{
+    int i;
+    arena_reset(&arena->song);
+    arena_reset(&arena->output);
+    for (i = 0; i < arena->channel_count; ++i)
+        arena_reset(&arena->channels[i]);
+}
+
+/* A song whose patterns have been converted and put in a pattern pool.
+   Its memory is in the arena of the conversion. */
+struct song_data {
+    const struct xm *xm;
+    const struct xm2nes_options *options;
+    int unused_channels;
+    int *piece_count; /* converted patterns, or pieces of them, in each channel */
+    struct encoded_pattern **encoded;
+    int *sequence_length; /* pattern table entries played by each channel */
+    unsigned char *order_data;
+    int *order_data_size;
+    int order_stride; /* distance between the channels' order data */
+    int order_start_offset;
+    int song_length;
+    /* With remap_instruments, the instruments map used for channels 0-3,
+       and the original number of each instrument */
+    struct instr_mapping remapped_instr_map[128];
+    unsigned char instrument_remap[256];
+    int instrument_count;
+};
+
+/**
+  Counts how often each target instrument is set in the unique patterns
+  of channels 0-3 of \a xm that are in \a used_patterns_set, and numbers
+  the instruments from the most to the least often set, so that the most
+  common ones get the short SET_INSTRUMENT_COMMAND_BASE form. Stores the
+  instruments map of \a options with the new numbers in \a song, and
+  the original number of each new one, and the number of bytes saved
+  in \a saved. Returns XM_NO_ERROR, or XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int remap_instruments(const struct xm *xm,
+                             const struct xm2nes_options *options,
+                             int *used_patterns_set, struct song_data *song,
+                             int *saved)
+{
+    int counts[256];
+    int new_number[256];
+    int chn, i, j;
+    struct arena *arena = &options->arena->song;
+    struct arena_mark mark;
+    unsigned char *unique_pattern_indexes;
+    int *unique_pattern_map;
+    arena_mark(arena, &mark);
+    unique_pattern_indexes = (unsigned char *)arena_alloc(arena, xm->header.pattern_count);
+    unique_pattern_map = (int *)arena_alloc(arena, xm->header.pattern_count * sizeof(int));
+    if (!unique_pattern_indexes || !unique_pattern_map) {
+        arena_release(arena, &mark);
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (chn = 0; (chn < 4) && (chn < xm->header.channel_count); ++chn) {
+        int unique_pattern_count;
+        if (!((1u << chn) & options->channels))
+            continue;
+        if (find_unique_patterns_for_channel(xm, chn, used_patterns_set,
+                                             unique_pattern_indexes, &unique_pattern_count,
+                                             unique_pattern_map, arena)) {
+            arena_release(arena, &mark);
+            return XM2NES_OUT_OF_MEMORY_ERROR;
+        }
+        for (i = 0; i < unique_pattern_count; ++i) {
+            const struct xm_pattern *pattern = &xm->patterns[unique_pattern_indexes[i]];
+            const struct xm_pattern_slot *slots = xm_pattern_column(pattern, chn);
+            unsigned char lastinstr = 0xFF;
+            int row;
+            /* As convert_xm_pattern_to_nes() sets instruments */
+            for (row = 0; row < pattern->row_count; ++row) {
+                unsigned char instr = slots[row].instrument;
+                if (instr && (instr != lastinstr) && (instr <= 128)) {
+                    ++counts[options->instr_map[instr - 1].target_instr];
+                    lastinstr = instr;
+                }
+            }
+        }
+    }
+    arena_release(arena, &mark);
+
+    /* Selection sort by count, then by number; there are few instruments */
+    *saved = 0;
+    song->instrument_count = 0;
+    for (i = 0; i < 256; ++i)
+        new_number[i] = -1;
+    for (;;) {
+        int best = -1;
+        for (j = 0; j < 256; ++j) {
+            if ((new_number[j] == -1) && counts[j] && ((best == -1) || (counts[j] > counts[best])))
+                best = j;
+        }
+        if (best == -1)
+            break;
+        new_number[best] = song->instrument_count;
+        song->instrument_remap[song->instrument_count++] = best;
+        if ((best >= 0x10) && (new_number[best] < 0x10))
+            *saved += counts[best];
+        else if ((best < 0x10) && (new_number[best] >= 0x10))
+            *saved -= counts[best];
+    }
+    for (i = 0; i < 128; ++i) {
+        song->remapped_instr_map[i] = options->instr_map[i];
+        if (new_number[options->instr_map[i].target_instr] != -1)
+            song->remapped_instr_map[i].target_instr = new_number[options->instr_map[i].target_instr];
+    }
+    return XM_NO_ERROR;
+}
+
+/**
+  Prints the original number of each instrument of \a song, as
+  renumbered by remap_instruments(), so that the player's instrument
+  table can be put in the same order.
+*/
+static void print_instrument_remap(const struct song_data *song,
+                                   const char *label_prefix, struct output *out)
+{
+    char label[256];
+    sprintf(label, "%sinstrument_remap", label_prefix);
+    output_label(out, label);
+    output_chunk(out, song->instrument_remap, song->instrument_count, 16);
+}
+
+/* A message given while converting a channel, kept until all the
+   channels have been converted so that messages come out in channel
+   order even when the channels are converted in parallel. */
+struct channel_message {
+    int report; /* 1 for the report, 0 for the diagnostic callback */
+    char *text;
+    struct channel_message *next;
+};
+
+/* The conversion of one channel of a song, done by convert_channel(). */
+struct channel_work {
+    const struct xm *xm;
+    int channel;
+    const struct xm2nes_options *options;
+    const struct xm2nes_options *channel_options; /* to convert the patterns with */
+    int *used_patterns_set;
+    int order_start_offset;
+    int order_end_offset;
+    struct arena *arena; /* where the results are allocated */
+    /* The results; unused is set if the channel has nothing to convert */
+    int unused;
+    unsigned char *unique_pattern_indexes;
+    int unique_pattern_count;
+    int *unique_pattern_map;
+    struct encoded_pattern *encoded;
+    int piece_count;
+    int *first_piece; /* the first piece of each unique pattern */
+    int encoded_count;
+    int cache_hit_count;
+    int state_saving;
+    int format_counts[PATTERN_FORMAT_COUNT];
+    int format_saving;
+    double step_time[XM2NES_STEP_COUNT];
+    struct channel_message *messages;
+    struct channel_message **last_message;
+    int error; /* set if the conversion failed */
+};
+
+/* Keeps a message, printf-style, for the channel of \a work. */
+static void add_channel_message(struct channel_work *work, int report,
+                                const char *format, ...)
+{
+    char text[1024];
+    struct channel_message *m;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    m = (struct channel_message *)arena_alloc(work->arena, sizeof(struct channel_message));
+    if (m)
+        m->text = arena_strdup(work->arena, text);
+    if (!m || !m->text) {
+        work->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    m->report = report;
+    m->next = 0;
+    *work->last_message = m;
+    work->last_message = &m->next;
+}
+
+/* Diagnostic callback that keeps the warning for later. */
+static void keep_channel_diagnostic(void *context, const char *message)
+{
+    add_channel_message((struct channel_work *)context, 0, "%s", message);
+}
+
+/**
+  Gives the messages kept by the channel of \a work.
+*/
+static void flush_channel_messages(struct channel_work *work)
+{
+    const struct xm2nes_options *options = work->options;
+    struct channel_message *m;
+    for (m = work->messages; m; m = m->next) {
+        if (m->report)
+            fputs(m->text, options->report);
+        else
+            options->diagnostic(options->diagnostic_context, m->text);
+    }
+    work->messages = 0;
+    work->last_message = &work->messages;
+}
+
+/**
+  Finds the unique patterns of the channel of \a work and converts them
+  to NES format, splitting those that are too large and, with
+  adaptive_patterns, choosing the format of each piece. Touches nothing
+  but \a work, the patterns of the song and the cache, so channels can
+  be converted at the same time. Sets the error of \a work if there is
+  no memory left.
+*/
+static void convert_channel(struct channel_work *work)
+{
+    const struct xm *xm = work->xm;
+    const struct xm2nes_options *options = work->options;
+    struct xm2nes_options channel_options = *work->channel_options;
+    struct arena *arena = work->arena;
+    int chn = work->channel;
+    unsigned char *initial_instruments;
+    double start;
+    int ret;
+    int i;
+
+    /* Warnings are kept, to be given in channel order */
+    if (channel_options.diagnostic) {
+        channel_options.diagnostic = keep_channel_diagnostic;
+        channel_options.diagnostic_context = work;
+    }
+
+    start = start_step(options);
+    work->unique_pattern_indexes = (unsigned char *)arena_alloc(arena, xm->header.pattern_count * sizeof(unsigned char));
+    work->unique_pattern_map = (int *)arena_alloc(arena, xm->header.pattern_count * sizeof(int));
+    if (!work->unique_pattern_indexes || !work->unique_pattern_map) {
+        work->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    ret = find_unique_patterns_for_channel(xm, chn, work->used_patterns_set,
+                                           work->unique_pattern_indexes, &work->unique_pattern_count,
+                                           work->unique_pattern_map, arena);
+    if (ret) {
+        work->error = ret;
+        return;
+    }
+    {
+        int has_non_empty_pattern = 0;
+        for (i = 0; i < work->unique_pattern_count; ++i) {
+            int pi = work->unique_pattern_indexes[i];
+            if (!is_pattern_empty_for_channel(&xm->patterns[pi], chn)) {
+                has_non_empty_pattern = 1;
+                break;
+            }
+        }
+        work->step_time[XM2NES_UNIQUE_STEP] += start_step(options) - start;
+        if (!has_non_empty_pattern) {
+            work->unused = 1;
+            return;
+        }
+    }
+
+    if (chn >= 5) {
+        char list[256*4 + 1];
+        int len = 0;
+        for (i = 0; i < work->unique_pattern_count; ++i) {
+            int pi = work->unique_pattern_indexes[i];
+            if (!is_pattern_empty_for_channel(&xm->patterns[pi], chn))
+                len += sprintf(&list[len], " %d", pi);
+        }
+        list[len] = '\0';
+        if (options->diagnostic)
+            add_channel_message(work, 0, "ignoring contents of channel %d; patterns%s", chn, list);
+        work->unused = 1;
+        return;
+    }
+
+    start = start_step(options);
+    work->encoded = (struct encoded_pattern *)arena_alloc(arena, work->unique_pattern_count * sizeof(struct encoded_pattern));
+    work->first_piece = (int *)arena_alloc(arena, (work->unique_pattern_count + 1) * sizeof(int));
+    /* The DMC channel has no instrument state */
+    initial_instruments = (unsigned char *)arena_alloc(arena, work->unique_pattern_count + 1);
+    if (!work->encoded || !work->first_piece || !initial_instruments) {
+        work->error = XM2NES_OUT_OF_MEMORY_ERROR;
+        return;
+    }
+    if (options->track_state && (chn < 4)) {
+        ret = track_channel_state(xm, chn, work->order_start_offset, work->order_end_offset,
+                                  work->unique_pattern_indexes, work->unique_pattern_count,
+                                  work->unique_pattern_map, initial_instruments, arena);
+        if (ret) {
+            work->error = ret;
+            return;
+        }
+    } else {
+        memset(initial_instruments, 0xFF, work->unique_pattern_count);
+    }
+    for (i = 0; i < work->unique_pattern_count; ++i) {
+        struct encoded_pattern p;
+        struct encoded_pattern pieces[MAX_PATTERN_CHUNKS];
+        int count;
+        int pi = work->unique_pattern_indexes[i];
+        if (channel_options.cache) {
+            int cache_hit;
+            ret = convert_xm_pattern_to_nes_cached(
+                channel_options.cache, &xm->patterns[pi], chn, &channel_options,
+                initial_instruments[i], arena, &p, &cache_hit);
+            work->cache_hit_count += cache_hit;
+        } else {
+            struct channel_state initial;
+            initial.instrument = initial_instruments[i];
+            initial.effect_type = 0;
+            initial.effect_param = 0;
+            ret = convert_xm_pattern_to_nes(&xm->patterns[pi], chn, &channel_options,
+                                            0, &initial, arena, &p);
+        }
+        if (ret) {
+            work->error = ret;
+            return;
+        }
+        if ((initial_instruments[i] != 0xFF) && options->report) {
+            /* Convert again without the instrument, to report the saving */
+            struct xm2nes_options quiet_options = channel_options;
+            struct channel_state unknown_state;
+            struct encoded_pattern unknown;
+            quiet_options.diagnostic = 0;
+            unknown_state.instrument = 0xFF;
+            unknown_state.effect_type = 0;
+            unknown_state.effect_param = 0;
+            ret = convert_xm_pattern_to_nes(&xm->patterns[pi], chn, &quiet_options,
+                                            0, &unknown_state, arena, &unknown);
+            if (ret) {
+                work->error = ret;
+                return;
+            }
+            work->state_saving += unknown.size - p.size;
+            arena_shrink(arena, unknown.data, 0);
+        }
+        ++work->encoded_count;
+        ret = split_encoded_pattern(&xm->patterns[pi], chn, &channel_options, &p,
+                                    arena, pieces, &count);
+        if (ret) {
+            work->error = ret;
+            return;
+        }
+        if (count > 1) {
+            struct encoded_pattern *encoded = (struct encoded_pattern *)arena_grow(
+                arena, work->encoded,
+                (work->unique_pattern_count + work->piece_count - i) * sizeof(struct encoded_pattern),
+                (work->unique_pattern_count + work->piece_count - i + count)
+                * sizeof(struct encoded_pattern));
+            if (!encoded) {
+                work->error = XM2NES_OUT_OF_MEMORY_ERROR;
+                return;
+            }
+            work->encoded = encoded;
+            if (options->report) {
+                add_channel_message(work, 1, "%ssong: pattern %d, channel %d: %d bytes split into %d patterns\n",
+                                    options->label_prefix, pi, chn, p.size, count);
+            }
+        }
+        if (options->adaptive_patterns) {
+            int j;
+            for (j = 0; j < count; ++j) {
+                int size = pieces[j].size;
+                int format;
+                ret = choose_pattern_format(&pieces[j], chn, arena, &format);
+                if (ret) {
+                    work->error = ret;
+                    return;
+                }
+                ++work->format_counts[format];
+                work->format_saving += size - pieces[j].size;
+            }
+        }
+        work->first_piece[i] = work->piece_count;
+        memcpy(&work->encoded[work->piece_count], pieces, count * sizeof(struct encoded_pattern));
+        work->piece_count += count;
+    }
+    work->first_piece[work->unique_pattern_count] = work->piece_count;
+    work->step_time[XM2NES_ENCODE_STEP] += start_step(options) - start;
+}
+
+/* State shared by the threads converting the channels of a song. */
+struct channel_batch {
+    struct channel_work *works;
+    int work_count;
+    int next_work;
+    pthread_mutex_t lock;
+};
+
+/* Converts channels from the batch until there are none left. */
+static void *channel_worker(void *arg)
+{
+    struct channel_batch *batch = (struct channel_batch *)arg;
+    for (;;) {
+        int i;
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next_work++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->work_count)
+            break;
+        if (!batch->works[i].unused)
+            convert_channel(&batch->works[i]);
+    }
+    return 0;
+}
+
+/**
+  Converts the channels of \a works, except the unused ones, using up
+  to \a thread_count threads.
+*/
+static void convert_channels(struct channel_work *works, int work_count,
+                             int thread_count)
+{
+    struct channel_batch batch;
+    pthread_t threads[XM2NES_MAX_CHANNELS];
+    int i;
+    batch.works = works;
+    batch.work_count = work_count;
+    batch.next_work = 0;
+    if (thread_count > work_count)
+        thread_count = work_count;
+    if (thread_count > XM2NES_MAX_CHANNELS)
+        thread_count = XM2NES_MAX_CHANNELS;
+    pthread_mutex_init(&batch.lock, 0);
+    for (i = 0; (thread_count > 1) && (i < thread_count); ++i) {
+        if (pthread_create(&threads[i], 0, channel_worker, &batch) != 0)
+            break;
+    }
+    if (i == 0) {
+        /* One thread, or couldn't start any; do the work ourselves */
+        channel_worker(&batch);
+    }
+    thread_count = i;
+    for (i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&batch.lock);
+}
+
+/**
+  Converts the patterns of the given \a xm that are used by the song
+  to NES format, adds them to \a pool, and calculates the order tables.
+  Patterns of \a xm that haven't been decoded yet are decoded.
+  On success, \a song must be freed with destroy_song(). A song of
+  length 0 gets a song_length of 0 and nothing else.
+  Returns XM_NO_ERROR, the error from decoding a pattern, or
+  XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int prepare_song(struct xm *xm,
+                        const struct xm2nes_options *options,
+                        struct pattern_pool *pool,
+                        struct song_data *song)
+{
+    int chn;
     int unused_channels;
     int *used_patterns_set;
     unsigned char **unique_pattern_indexes;
     int *unique_pattern_count;
+    int **unique_pattern_map;
+    struct encoded_pattern **encoded;
+    int *piece_count;
+    int **first_piece;
+    int **sequence;
+    int *sequence_length;
+    int encoded_count = 0;
+    int cache_hit_count = 0;
+    int state_saving = 0;
+    int format_counts[PATTERN_FORMAT_COUNT];
+    int format_saving = 0;
     unsigned char *order_data;
     int *order_data_size;
+    int order_stride;
     int song_length;
     int order_start_offset;
     int order_end_offset;
+    int used_pattern_count = 0;
+    struct xm2nes_options remapped_options;
+    struct channel_work *works;
+    struct xm2nes_channel_stats *cs;
+    struct arena *arena = &options->arena->song;
+    double start;
+    int ret;
+    memset(song, 0, sizeof(*song));
+    song->xm = xm;
+    song->options = options;
     if (xm->header.song_length == 0)
-        return;
+        return XM_NO_ERROR;
 
     order_end_offset = options->order_end_offset;
     if ((order_end_offset == -1) || (options->order_end_offset >= xm->header.song_length))
@@ -526,104 +2492,1000 @@ void convert_xm_to_nes(const struct xm *xm,
     song_length = order_end_offset - order_start_offset + 1;
 
     unused_channels = 0;
-    unique_pattern_indexes = (unsigned char **)malloc(xm->header.channel_count * sizeof(unsigned char *));
-    unique_pattern_count = (int *)malloc(xm->header.channel_count * sizeof(int));
-    order_data = (unsigned char *)malloc(xm->header.channel_count * song_length * sizeof(unsigned char));
-    order_data_size = (int *)malloc(xm->header.channel_count * sizeof(int));
+    memset(format_counts, 0, sizeof(format_counts));
+    ret = reserve_channel_arenas(options->arena, xm->header.channel_count);
+    if (ret)
+        return ret;
+    unique_pattern_indexes = (unsigned char **)arena_alloc(arena, xm->header.channel_count * sizeof(unsigned char *));
+    unique_pattern_count = (int *)arena_alloc(arena, xm->header.channel_count * sizeof(int));
+    unique_pattern_map = (int **)arena_alloc(arena, xm->header.channel_count * sizeof(int *));
+    encoded = (struct encoded_pattern **)arena_alloc(arena, xm->header.channel_count * sizeof(struct encoded_pattern *));
+    piece_count = (int *)arena_alloc(arena, xm->header.channel_count * sizeof(int));
+    first_piece = (int **)arena_alloc(arena, xm->header.channel_count * sizeof(int *));
+    sequence = (int **)arena_alloc(arena, xm->header.channel_count * sizeof(int *));
+    sequence_length = (int *)arena_alloc(arena, xm->header.channel_count * sizeof(int));
+    order_data_size = (int *)arena_alloc(arena, xm->header.channel_count * sizeof(int));
+    if (!unique_pattern_indexes || !unique_pattern_count || !unique_pattern_map
+        || !encoded || !piece_count || !first_piece || !sequence
+        || !sequence_length || !order_data_size) {
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    memset(unique_pattern_indexes, 0, xm->header.channel_count * sizeof(unsigned char *));
+    memset(unique_pattern_map, 0, xm->header.channel_count * sizeof(int *));
+    memset(encoded, 0, xm->header.channel_count * sizeof(struct encoded_pattern *));
+    memset(piece_count, 0, xm->header.channel_count * sizeof(int));
+    memset(first_piece, 0, xm->header.channel_count * sizeof(int *));
+    memset(sequence, 0, xm->header.channel_count * sizeof(int *));
+    memset(sequence_length, 0, xm->header.channel_count * sizeof(int));
 
     /* Step 1. Find the patterns that are actually used. */
-    find_used_patterns(song_length, xm->header.pattern_order_table + order_start_offset, &used_patterns_set);
+    start = start_step(options);
+    ret = find_used_patterns(song_length, xm->header.pattern_order_table + order_start_offset,
+                             arena, &used_patterns_set);
+    if (ret)
+        return ret;
+    {
+        int i;
+        int bits_in_int = sizeof(int) * 8;
+        for (i = 0; i < xm->header.pattern_count; ++i) {
+            if (!(used_patterns_set[i / bits_in_int] & (1u << (i & (bits_in_int-1)))))
+                continue;
+            ++used_pattern_count;
+            ret = xm_decode_pattern(xm, i);
+            if (ret)
+                return ret;
+        }
+    }
+    end_step(options, XM2NES_SCAN_STEP, start);
 
-    /* Step 2. Find, convert and print unique patterns. */
+    /* Step 1b. Number the instruments of channels 0-3 by how often
+       they are set. */
+    remapped_options = *options;
+    if (options->remap_instruments) {
+        int saved;
+        ret = remap_instruments(xm, options, used_patterns_set, song, &saved);
+        if (ret)
+            return ret;
+        remapped_options.instr_map = song->remapped_instr_map;
+        remapped_options.cache = 0; /* the cache is for one instruments map */
+        if (options->report) {
+            fprintf(options->report, "%ssong: %d instruments renumbered by frequency (%d bytes saved)\n",
+                    options->label_prefix, song->instrument_count, saved);
+        }
+    }
+
+    if (options->cache)
+        cache_use_instruments_map(options->cache, options->instr_map);
+
+    /* Step 2. Find and convert unique patterns, with options->jobs
+       threads. The results are gathered in channel order, so the output
+       doesn't depend on which thread finishes first. */
+    works = (struct channel_work *)arena_alloc(arena, xm->header.channel_count * sizeof(struct channel_work));
+    if (!works)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    memset(works, 0, xm->header.channel_count * sizeof(struct channel_work));
     for (chn = 0; chn < xm->header.channel_count; ++chn) {
-	int i;
-        if (!((1 << chn) & options->channels)) {
-            unused_channels |= 1 << chn;
+        struct channel_work *work = &works[chn];
+        work->xm = xm;
+        work->channel = chn;
+        work->options = options;
+        /* The DMC channel's instruments are samples, which keep their numbers */
+        work->channel_options = (chn < 4) ? &remapped_options : options;
+        work->used_patterns_set = used_patterns_set;
+        work->order_start_offset = order_start_offset;
+        work->order_end_offset = order_end_offset;
+        work->arena = &options->arena->channels[chn];
+        work->unused = !((1u << chn) & options->channels);
+        work->last_message = &work->messages;
+    }
+    convert_channels(works, xm->header.channel_count, options->jobs);
+    record_step_memory(options, XM2NES_ENCODE_STEP);
+    for (chn = 0; chn < xm->header.channel_count; ++chn) {
+        struct channel_work *work = &works[chn];
+        int i;
+        flush_channel_messages(work);
+        if (work->error)
+            return work->error;
+        if (options->stats) {
+            for (i = 0; i < XM2NES_STEP_COUNT; ++i)
+                options->stats->step_time[i] += work->step_time[i];
+        }
+        unique_pattern_indexes[chn] = work->unique_pattern_indexes;
+        unique_pattern_count[chn] = work->unique_pattern_count;
+        unique_pattern_map[chn] = work->unique_pattern_map;
+        if (work->unused) {
+            unused_channels |= 1u << chn;
             continue;
         }
+        encoded[chn] = work->encoded;
+        piece_count[chn] = work->piece_count;
+        first_piece[chn] = work->first_piece;
+        encoded_count += work->encoded_count;
+        cache_hit_count += work->cache_hit_count;
+        state_saving += work->state_saving;
+        for (i = 0; i < PATTERN_FORMAT_COUNT; ++i)
+            format_counts[i] += work->format_counts[i];
+        format_saving += work->format_saving;
+        if ((cs = channel_stats(options, chn))) {
+            cs->unique_patterns += unique_pattern_count[chn];
+            cs->duplicate_patterns += used_pattern_count - unique_pattern_count[chn];
+            for (i = 0; i < piece_count[chn]; ++i)
+                cs->encoded_size += encoded[chn][i].size;
+        }
+    }
+    if (options->cache && options->report) {
+        fprintf(options->report, "%ssong: %d of %d patterns taken from the cache\n",
+                options->label_prefix, cache_hit_count, encoded_count);
+    }
+    if (options->track_state && options->report) {
+        fprintf(options->report, "%ssong: instruments carried across patterns (%d bytes saved)\n",
+                options->label_prefix, state_saving);
+    }
+    if (options->adaptive_patterns && options->report) {
+        fprintf(options->report, "%ssong: pattern formats: %d flags, %d dense, %d sparse (%d bytes saved)\n",
+                options->label_prefix, format_counts[FLAGS_PATTERN_FORMAT],
+                format_counts[DENSE_PATTERN_FORMAT], format_counts[SPARSE_PATTERN_FORMAT],
+                format_saving);
+    }
 
-	unique_pattern_indexes[chn] = (unsigned char *)malloc(xm->header.pattern_count * sizeof(unsigned char));
-	find_unique_patterns_for_channel(xm, chn, used_patterns_set,
-                                         unique_pattern_indexes[chn], &unique_pattern_count[chn]);
-
-        {
-            int j;
-            int has_non_empty_pattern = 0;
-            for (j = 0; j < unique_pattern_count[chn]; ++j) {
-                int pi = unique_pattern_indexes[chn][j];
-	        if (!is_pattern_empty_for_channel(&xm->patterns[pi], xm->header.channel_count, chn)) {
-                    has_non_empty_pattern = 1;
-                    break;
+    /* Step 2b. Put the converted patterns in the pattern table, sharing
+       identical patterns between channels, and list the pattern table
+       entries that each channel plays. */
+    start = start_step(options);
+    order_stride = 0;
+    {
+        int shared_count = 0;
+        int shared_size = 0;
+        for (chn = 0; chn < xm->header.channel_count; ++chn) {
+            int *encoded_index;
+            int i, j;
+            if (unused_channels & (1u << chn))
+                continue;
+            encoded_index = (int *)arena_alloc(arena, piece_count[chn] * sizeof(int));
+            if (!encoded_index)
+                return XM2NES_OUT_OF_MEMORY_ERROR;
+            for (i = 0; i < piece_count[chn]; ++i) {
+                int index = pattern_pool_add(pool, &encoded[chn][i],
+                                             options->label_prefix, chn, i);
+                if (index == -1)
+                    return XM2NES_OUT_OF_MEMORY_ERROR;
+                if (index != pool->count - 1) {
+                    ++shared_count;
+                    shared_size += encoded[chn][i].size;
+                    if ((cs = channel_stats(options, chn)))
+                        ++cs->shared_patterns;
                 }
+                encoded_index[i] = index;
             }
-            if (!has_non_empty_pattern) {
-                unused_channels |= 1 << chn;
-                continue;
+            sequence[chn] = (int *)arena_alloc(arena, song_length * (piece_count[chn] - unique_pattern_count[chn] + 1) * sizeof(int));
+            if (!sequence[chn])
+                return XM2NES_OUT_OF_MEMORY_ERROR;
+            for (i = order_start_offset; i <= order_end_offset; ++i) {
+                int u = unique_pattern_map[chn][xm->header.pattern_order_table[i]];
+                if (u == -1)
+                    return XM2NES_INTERNAL_ERROR;
+                for (j = first_piece[chn][u]; j < first_piece[chn][u + 1]; ++j)
+                    sequence[chn][sequence_length[chn]++] = encoded_index[j];
             }
+            if (sequence_length[chn] > order_stride)
+                order_stride = sequence_length[chn];
+        }
+        if (options->report && shared_count) {
+            fprintf(options->report, "%ssong: %d identical patterns shared (%d bytes saved)\n",
+                    options->label_prefix, shared_count, shared_size);
         }
-
-	if (chn >= 5) {
-            int j;
-           fprintf(stderr, "ignoring contents of channel %d; patterns \n", chn);
-            for (j = 0; j < unique_pattern_count[chn]; ++j) {
-                int pi = unique_pattern_indexes[chn][j];
-	        if (!is_pattern_empty_for_channel(&xm->patterns[pi], xm->header.channel_count, chn))
-                    fprintf(stderr, " %d", pi);
-            }
-            fprintf(stderr, "\n");
-	    continue;
-	}
-
-	for (i = 0; i < unique_pattern_count[chn]; ++i) {
-	    unsigned char *data;
-	    int data_size;
-	    char label[256];
-            int pi = unique_pattern_indexes[chn][i];
-	    convert_xm_pattern_to_nes(&xm->patterns[pi], xm->header.channel_count,
-                                      chn, options->instr_map, &data, &data_size);
-	    if (data_size >= 256) {
-                fprintf(stderr, "pattern %d, channel %d exceeds 256 bytes in size (%d)\n", pi, chn, data_size);
-            }
-	    sprintf(label, "%schn%d_ptn%d", options->label_prefix, chn, i);
-	    print_chunk(out, label, data, data_size, 16);
-	    free(data);
-	}
     }
+    end_step(options, XM2NES_UNIQUE_STEP, start);
 
     /* Step 3. Create order tables. */
+    start = start_step(options);
+    order_data = (unsigned char *)arena_alloc(arena, xm->header.channel_count * order_stride + 1);
+    if (!order_data)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
     {
-	int pattern_offset = 0;
+        unsigned char *run_order_data = (unsigned char *)arena_alloc(arena, order_stride + 1);
+        int size = 0;
+        int run_size = 0;
+        if (!run_order_data)
+            return XM2NES_OUT_OF_MEMORY_ERROR;
         for (chn = 0; chn < xm->header.channel_count; ++chn) {
-            if (unused_channels & (1 << chn))
+            int run_order_data_size;
+            if (unused_channels & (1u << chn))
                 continue;
-            calculate_order_table_for_channel(xm, chn, order_start_offset,
-                                              order_end_offset,
-                                              unique_pattern_indexes[chn],
-                                              unique_pattern_count[chn], pattern_offset,
-                                              &order_data[chn * song_length],
-                                              &order_data_size[chn]);
-	    pattern_offset += unique_pattern_count[chn];
+            calculate_order_table_for_channel(sequence[chn], sequence_length[chn],
+                                              run_order_data,
+                                              &run_order_data_size);
+            if (options->order_loops > 0) {
+                ret = calculate_looped_order_table_for_channel(sequence[chn], sequence_length[chn],
+                                                               options->order_loops,
+                                                               &order_data[chn * order_stride],
+                                                               &order_data_size[chn], arena);
+                if (ret)
+                    return ret;
+            } else {
+                memcpy(&order_data[chn * order_stride], run_order_data, run_order_data_size);
+                order_data_size[chn] = run_order_data_size;
+            }
+            size += order_data_size[chn];
+            run_size += run_order_data_size;
+            if ((cs = channel_stats(options, chn)))
+                cs->order_table_size += order_data_size[chn];
+        }
+        if (options->report && (options->order_loops > 0)) {
+            fprintf(options->report, "%ssong: order tables: %d bytes (%d with runs only, %d saved)\n",
+                    options->label_prefix, size, run_size, run_size - size);
+        }
+    }
+    end_step(options, XM2NES_ORDER_STEP, start);
+
+    song->unused_channels = unused_channels;
+    song->piece_count = piece_count;
+    song->encoded = encoded;
+    song->sequence_length = sequence_length;
+    song->order_data = order_data;
+    song->order_data_size = order_data_size;
+    song->order_stride = order_stride;
+    song->order_start_offset = order_start_offset;
+    song->song_length = song_length;
+    return XM_NO_ERROR;
+}
+
+/**
+  Prints the patterns of \a pool, using a chunk dictionary if
+  \a options asks for it.
+*/
+static void print_pool(const struct pattern_pool *pool,
+                       const struct xm2nes_options *options,
+                       const char *label_prefix, struct output *out)
+{
+    if (options->chunk_dictionary) {
+        int size;
+        int dictionary_size;
+        int i;
+        size = 0;
+        for (i = 0; i < pool->count; ++i)
+            size += pool->entries[i].pattern->size;
+        dictionary_size = print_patterns_with_chunk_dictionary(
+            pool, label_prefix, out);
+        if (options->report && !out->error) {
+            fprintf(options->report, "%ssong: chunk dictionary: pattern data %d bytes -> %d bytes (%d saved)\n",
+                    label_prefix, size, dictionary_size, size - dictionary_size);
         }
+    } else {
+        print_patterns(pool, out);
     }
+}
+
+/* Pattern table entries are order table bytes; larger values are commands */
+#define MAX_PATTERN_TABLE_SIZE 0xFB
 
-    /* Step 4. Print the pattern pointer table. */
-    print_pattern_table(xm->header.channel_count, unused_channels,
-                        unique_pattern_count, options->label_prefix, out);
+/* The cost of decoding a row of a song, in each channel. */
+struct row_cost {
+    int frame; /* the frame in which the row is decoded */
+    int order; /* position in the XM order table */
+    int row;
+    int bytes[5];
+    int cycles[5];
+    int total_bytes;
+    int total_cycles;
+};
 
-    /* Step 5. Print song header + order tables. */
-    print_song_struct(xm->header.channel_count, unused_channels,
-                      xm->header.default_tempo, order_data_size,
-                      order_data, song_length,
-                      options->label_prefix, out);
+/* How many of the most costly rows are printed */
+#define WORST_ROW_COUNT 10
 
-    /* Cleanup */
-    for (chn = 0; chn < xm->header.channel_count; ++chn) {
-        if (!(unused_channels & (1 << chn)))
-            free(unique_pattern_indexes[chn]);
-    }
-    free(unique_pattern_indexes);
-    free(unique_pattern_count);
-    free(order_data);
-    free(order_data_size);
-    free(used_patterns_set);
+/**
+  Follows the \a size bytes of \a order_data as the player does, until
+  \a length orders have been read. Stores the pattern table entry
+  of each order in \a entries, and the bytes read to reach it, and
+  their cost according to \a costs, in \a bytes and \a cycles. The
+  bytes read after the last order, up to and including the jump back
+  to the start, are stored after the last order's.
+*/
+static void follow_order_table(const unsigned char *order_data, int size,
+                               int length, const struct decode_costs *costs,
+                               int *entries, int *bytes, int *cycles)
+{
+    int loop_start[MAX_ORDER_LOOP_DEPTH + 1];
+    int loop_count[MAX_ORDER_LOOP_DEPTH + 1];
+    int depth = 0;
+    int pos = 0;
+    int count = 0;
+    int b = 0;
+    int c = 0;
+    while (pos < size) {
+        unsigned char v = order_data[pos++];
+        if ((v == 0xFB) && (depth <= MAX_ORDER_LOOP_DEPTH)) {
+            loop_count[depth] = order_data[pos++];
+            loop_start[depth++] = pos;
+            b += 2;
+            c += costs->loop_start;
+        } else if ((v == 0xFC) && (depth > 0)) {
+            b += 1;
+            c += costs->loop_end;
+            if (--loop_count[depth-1] > 0)
+                pos = loop_start[depth-1];
+            else
+                --depth;
+        } else if (count < length) {
+            entries[count] = v;
+            bytes[count] = b + 1;
+            cycles[count] = c + costs->order;
+            ++count;
+            b = 0;
+            c = 0;
+        }
+    }
+    bytes[length] = b + 2;
+    cycles[length] = c + costs->song_loop;
+}
+
+/**
+  Decodes the row of \a channel that starts at \a data[*pos], as the
+  player does, up to the end of the pattern data at \a end. Adds its
+  cost according to \a costs to \a cycles, and stores a speed change
+  in \a speed. Returns the number of bytes read.
+*/
+static int decode_row(const unsigned char *data, int *pos, int end, int channel,
+                      const struct decode_costs *costs, int *cycles, int *speed)
+{
+    int start = *pos;
+    while (*pos < end) {
+        unsigned char b = data[(*pos)++];
+        if ((channel == 4) && ((b & 0xF0) != SET_SPEED_COMMAND_BASE)
+            && (b != SET_SPEED_COMMAND) && (b != END_ROW_COMMAND)) {
+            /* The DMC channel only has speed commands and samples */
+            *cycles += costs->note;
+            break;
+        } else if (b < SET_INSTRUMENT_COMMAND_BASE) {
+            *cycles += costs->note;
+            break;
+        } else if (b < SET_SPEED_COMMAND_BASE) {
+            *cycles += costs->instrument;
+        } else if (b < SET_VOLUME_COMMAND_BASE) {
+            *cycles += costs->speed;
+            *speed = b & 0x0F;
+        } else if (b < SET_EFFECT_COMMAND_BASE) {
+            *cycles += costs->volume;
+        } else if (b < SET_INSTRUMENT_COMMAND) {
+            *cycles += costs->effect;
+            if (b != SET_EFFECT_COMMAND_BASE)
+                ++*pos; /* parameter */
+        } else if (b == SET_INSTRUMENT_COMMAND) {
+            *cycles += costs->instrument_long;
+            ++*pos;
+        } else if (b == RELEASE_COMMAND) {
+            *cycles += costs->release;
+        } else if (b == SET_SPEED_COMMAND) {
+            *cycles += costs->speed_long;
+            if (*pos < end)
+                *speed = data[(*pos)++];
+        } else {
+            *cycles += costs->end_row;
+            break;
+        }
+    }
+    if (*pos > end)
+        *pos = end;
+    return *pos - start;
+}
+
+static int compare_row_costs(const void *a, const void *b)
+{
+    const struct row_cost *r1 = *(const struct row_cost * const *)a;
+    const struct row_cost *r2 = *(const struct row_cost * const *)b;
+    if (r1->total_cycles != r2->total_cycles)
+        return r2->total_cycles - r1->total_cycles;
+    return r1->frame - r2->frame;
+}
+
+/* Prints the cost of \a r in the \a channels (a bit mask) of a song. */
+static void print_row_cost(const struct row_cost *r, int channels, FILE *out)
+{
+    int chn;
+    fprintf(out, "  frame %d (order %d, row %d): %d cycles, %d bytes;",
+            r->frame, r->order, r->row, r->total_cycles, r->total_bytes);
+    for (chn = 0; chn < 5; ++chn) {
+        if (channels & (1u << chn))
+            fprintf(out, " %d: %d/%d", chn, r->cycles[chn], r->bytes[chn]);
+    }
+    fprintf(out, "\n");
+}
+
+/**
+  Estimates the cost of decoding \a song on the NES, by following its
+  order tables and the patterns of \a pool as the player does, with the
+  song's speed changes applied, and prints it to the decode report of
+  the song's options. The player only decodes data in the first frame
+  of each row. The data read when the song loops back to the start is
+  counted in the first row. Returns XM_NO_ERROR, or
+  XM2NES_OUT_OF_MEMORY_ERROR.
+*/
+static int analyze_decode_cost(const struct song_data *song,
+                                const struct pattern_pool *pool,
+                                int chunk_dictionary)
+{
+    const struct xm *xm = song->xm;
+    const struct xm2nes_options *options = song->options;
+    const struct decode_costs *costs = options->decode_costs;
+    FILE *out = options->decode_report;
+    const char *label_prefix = options->label_prefix;
+    int *entries[5];
+    int entry[5];     /* the order that each channel is playing */
+    int piece_row[5]; /* the row in that order's pattern */
+    /* The decoder state of each channel, which is kept when a pattern
+       runs on into the next XM order */
+    int pos[5];
+    int flags[5];
+    int format[5];
+    int skip[5];
+    int *order_bytes[5];
+    int *order_cycles[5];
+    struct row_cost *rows;
+    struct row_cost **worst;
+    int row_count = 0;
+    int channel_bytes[5];
+    int channel_cycles[5];
+    int channel_max_bytes[5];
+    int channel_max_cycles[5];
+    int total_bytes = 0;
+    int total_cycles = 0;
+    int over_budget = 0;
+    int channels = 0;
+    int speed = xm->header.default_tempo;
+    int frame = 0;
+    int row_count_pos = options->adaptive_patterns ? 1 : 0; /* after the format */
+    int chn, k, i;
+    struct arena *arena = &options->arena->song;
+    struct arena_mark mark;
+
+    for (k = 0; k < song->song_length; ++k)
+        row_count += xm->patterns[xm->header.pattern_order_table[song->order_start_offset + k]].row_count;
+    arena_mark(arena, &mark);
+    rows = (struct row_cost *)arena_alloc(arena, (row_count + 1) * sizeof(struct row_cost));
+    if (!rows)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    memset(rows, 0, (row_count + 1) * sizeof(struct row_cost));
+    for (chn = 0; chn < 5; ++chn) {
+        entries[chn] = 0;
+        order_bytes[chn] = 0;
+        order_cycles[chn] = 0;
+        channel_bytes[chn] = 0;
+        channel_cycles[chn] = 0;
+        channel_max_bytes[chn] = 0;
+        channel_max_cycles[chn] = 0;
+        if ((chn >= xm->header.channel_count) || (song->unused_channels & (1u << chn)))
+            continue;
+        entries[chn] = (int *)arena_alloc(arena, song->sequence_length[chn] * sizeof(int));
+        order_bytes[chn] = (int *)arena_alloc(arena, (song->sequence_length[chn] + 1) * sizeof(int));
+        order_cycles[chn] = (int *)arena_alloc(arena, (song->sequence_length[chn] + 1) * sizeof(int));
+        if (!entries[chn] || !order_bytes[chn] || !order_cycles[chn]) {
+            arena_release(arena, &mark);
+            return XM2NES_OUT_OF_MEMORY_ERROR;
+        }
+        channels |= 1u << chn;
+        follow_order_table(&song->order_data[chn * song->order_stride], song->order_data_size[chn],
+                           song->sequence_length[chn], costs, entries[chn], order_bytes[chn], order_cycles[chn]);
+        entry[chn] = 0;
+        piece_row[chn] = 0;
+        pos[chn] = 0;
+        flags[chn] = 0;
+        format[chn] = FLAGS_PATTERN_FORMAT;
+        skip[chn] = 0;
+    }
+
+    /* Decode the rows in the order the player does. A channel moves to
+       its next order when the rows of its pattern run out, which is
+       before the XM order ends if the pattern has been split. */
+    i = 0;
+    for (k = 0; k < song->song_length; ++k) {
+        int pattern_row_count = xm->patterns[xm->header.pattern_order_table[song->order_start_offset + k]].row_count;
+        int row;
+        for (row = 0; row < pattern_row_count; ++row, ++i) {
+            struct row_cost *r = &rows[i];
+            r->frame = frame;
+            r->order = song->order_start_offset + k;
+            r->row = row;
+            for (chn = 0; chn < 5; ++chn) {
+                const struct encoded_pattern *p;
+                int e;
+                if (!entries[chn] || (entry[chn] >= song->sequence_length[chn]))
+                    continue;
+                e = entry[chn];
+                p = pool->entries[entries[chn][e]].pattern;
+                if (piece_row[chn] == 0) {
+                    r->bytes[chn] += order_bytes[chn][e] + 1; /* row count */
+                    r->cycles[chn] += order_cycles[chn][e] + costs->pattern;
+                    if (e == 0) {
+                        r->bytes[chn] += order_bytes[chn][song->sequence_length[chn]];
+                        r->cycles[chn] += order_cycles[chn][song->sequence_length[chn]];
+                    }
+                    pos[chn] = 1;
+                    format[chn] = FLAGS_PATTERN_FORMAT;
+                    skip[chn] = 0;
+                    if (options->adaptive_patterns) {
+                        format[chn] = p->data[0];
+                        r->bytes[chn] += 1;
+                        r->cycles[chn] += costs->format;
+                        pos[chn] = 2;
+                    }
+                }
+                if ((format[chn] == FLAGS_PATTERN_FORMAT) && ((piece_row[chn] % 8) == 0)) {
+                    if (chunk_dictionary) {
+                        r->bytes[chn] += 1;
+                        r->cycles[chn] += costs->chunk;
+                    }
+                    flags[chn] = (pos[chn] < p->size) ? p->data[pos[chn]++] : 0;
+                    r->bytes[chn] += 1;
+                    r->cycles[chn] += costs->flags;
+                }
+                r->cycles[chn] += costs->row;
+                if (format[chn] == FLAGS_PATTERN_FORMAT) {
+                    if (flags[chn] & (1 << (piece_row[chn] % 8)))
+                        r->bytes[chn] += decode_row(p->data, &pos[chn], p->size, chn, costs,
+                                                   &r->cycles[chn], &speed);
+                } else if (skip[chn] > 0) {
+                    --skip[chn];
+                } else if ((format[chn] == SPARSE_PATTERN_FORMAT) && (pos[chn] + 1 < p->size)
+                           && (p->data[pos[chn]] == SKIP_ROWS_COMMAND)) {
+                    /* A count of 0 means 256 rows */
+                    skip[chn] = (p->data[pos[chn] + 1] ? p->data[pos[chn] + 1] : 256) - 1;
+                    pos[chn] += 2;
+                    r->bytes[chn] += 2;
+                    r->cycles[chn] += costs->skip;
+                } else {
+                    r->bytes[chn] += decode_row(p->data, &pos[chn], p->size, chn, costs,
+                                               &r->cycles[chn], &speed);
+                }
+                /* A row count of 0 means 256 rows */
+                if (++piece_row[chn] == (p->data[row_count_pos] ? p->data[row_count_pos] : 256)) {
+                    piece_row[chn] = 0;
+                    ++entry[chn];
+                }
+            }
+            for (chn = 0; chn < 5; ++chn) {
+                r->total_bytes += r->bytes[chn];
+                r->total_cycles += r->cycles[chn];
+                channel_bytes[chn] += r->bytes[chn];
+                channel_cycles[chn] += r->cycles[chn];
+                if (r->bytes[chn] > channel_max_bytes[chn])
+                    channel_max_bytes[chn] = r->bytes[chn];
+                if (r->cycles[chn] > channel_max_cycles[chn])
+                    channel_max_cycles[chn] = r->cycles[chn];
+            }
+            total_bytes += r->total_bytes;
+            total_cycles += r->total_cycles;
+            if (costs->frame_budget && (r->total_cycles > costs->frame_budget))
+                ++over_budget;
+            frame += speed ? speed : 1;
+        }
+    }
+
+    worst = (struct row_cost **)arena_alloc(arena, (row_count + 1) * sizeof(struct row_cost *));
+    if (!worst) {
+        arena_release(arena, &mark);
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    }
+    for (i = 0; i < row_count; ++i)
+        worst[i] = &rows[i];
+    qsort(worst, row_count, sizeof(struct row_cost *), compare_row_costs);
+
+    fprintf(out, "%ssong: decode cost: %d rows in %d frames, %d bytes, %d cycles\n",
+            label_prefix, row_count, frame, total_bytes, total_cycles);
+    for (chn = 0; chn < 5; ++chn) {
+        if (!entries[chn])
+            continue;
+        fprintf(out, "%ssong: channel %d: %d bytes, %d cycles; at most %d bytes and %d cycles in a frame\n",
+                label_prefix, chn, channel_bytes[chn], channel_cycles[chn],
+                channel_max_bytes[chn], channel_max_cycles[chn]);
+    }
+    if (costs->frame_budget) {
+        fprintf(out, "%ssong: %d frames exceed the budget of %d cycles\n",
+                label_prefix, over_budget, costs->frame_budget);
+    }
+    fprintf(out, "%ssong: most costly frames (cycles/bytes per channel):\n", label_prefix);
+    for (i = 0; (i < row_count) && (i < WORST_ROW_COUNT); ++i)
+        print_row_cost(worst[i], channels, out);
+    if (options->decode_report_rows) {
+        fprintf(out, "%ssong: all rows:\n", label_prefix);
+        for (i = 0; i < row_count; ++i)
+            print_row_cost(&rows[i], channels, out);
+    }
+
+    arena_release(arena, &mark);
+    return XM_NO_ERROR;
+}
+
+/**
+  Converts the given \a xm to NES format, passing the song to \a out.
+  Patterns of \a xm that are used by the song and haven't been decoded
+  yet are decoded. Returns XM_NO_ERROR, the error from decoding
+  a pattern, XM2NES_OUT_OF_MEMORY_ERROR, or XM2NES_PATTERN_TABLE_ERROR
+  if the song has too many distinct patterns; nothing is output then.
+*/
+static int convert_song(struct xm *xm,
+                        const struct xm2nes_options *options,
+                        struct output *out)
+{
+    struct pattern_pool pool;
+    struct song_data song;
+    double start;
+    int ret;
+    pattern_pool_init(&pool, &options->arena->song);
+    ret = prepare_song(xm, options, &pool, &song);
+    if (ret || !song.song_length)
+        return ret;
+    if (pool.count > MAX_PATTERN_TABLE_SIZE) {
+        /* Larger indexes would be read as commands, or wrap around */
+        diagnostic(options, "%d patterns exceed the pattern table limit of %d",
+                   pool.count, MAX_PATTERN_TABLE_SIZE);
+        return XM2NES_PATTERN_TABLE_ERROR;
+    }
+
+    start = start_step(options);
+    print_pool(&pool, options, options->label_prefix, out);
+
+    /* Print the pattern pointer table. */
+    print_pattern_table(&pool, options->label_prefix, out);
+
+    /* Print song header + order tables. */
+    print_song_struct(xm->header.channel_count, song.unused_channels,
+                      xm->header.default_tempo, song.order_data_size,
+                      song.order_data, song.order_stride, options->chunk_dictionary,
+                      options->label_prefix, options->label_prefix, out);
+    if (options->remap_instruments)
+        print_instrument_remap(&song, options->label_prefix, out);
+    end_step(options, XM2NES_OUTPUT_STEP, start);
+
+    if (options->decode_costs && options->decode_report)
+        return analyze_decode_cost(&song, &pool, options->chunk_dictionary);
+
+    return XM_NO_ERROR;
+}
+
+/**
+  Returns the size of the pattern data and pattern table that \a song
+  would have on its own, or -1 if there is no memory left.
+*/
+static int separate_pattern_data_size(const struct song_data *song)
+{
+    struct arena *arena = &song->options->arena->song;
+    struct arena_mark mark;
+    struct pattern_pool pool;
+    int chn;
+    int size = 0;
+    int i;
+    arena_mark(arena, &mark);
+    pattern_pool_init(&pool, arena);
+    for (chn = 0; chn < song->xm->header.channel_count; ++chn) {
+        if (song->unused_channels & (1u << chn))
+            continue;
+        for (i = 0; i < song->piece_count[chn]; ++i) {
+            if (pattern_pool_add(&pool, &song->encoded[chn][i], "", chn, i) == -1) {
+                arena_release(arena, &mark);
+                return -1;
+            }
+        }
+    }
+    for (i = 0; i < pool.count; ++i)
+        size += pool.entries[i].pattern->size + 2;
+    arena_release(arena, &mark);
+    return size;
+}
+
+/**
+  Converts the \a count modules \a xms, each with its own \a options,
+  to a bank that stores the patterns of all the songs in one pattern
+  table, labelled with \a label_prefix. Each song gets its own song
+  struct, labelled with its own prefix. The chunk dictionary, pattern
+  format, report and diagnostic settings are taken from the first
+  song's options. Returns XM2NES_PATTERN_TABLE_ERROR, without output,
+  if the songs have too many distinct patterns between them.
+*/
+static int convert_bank(struct xm *xms, const struct xm2nes_options *options,
+                        int count, const char *label_prefix, struct output *out)
+{
+    struct pattern_pool pool;
+    struct song_data *songs;
+    int separate_size = 0;
+    int size = 0;
+    int ret = XM_NO_ERROR;
+    double start;
+    int i;
+    pattern_pool_init(&pool, &options[0].arena->song);
+    songs = (struct song_data *)arena_alloc(&options[0].arena->song, count * sizeof(struct song_data));
+    if (!songs)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    for (i = 0; i < count; ++i) {
+        ret = prepare_song(&xms[i], &options[i], &pool, &songs[i]);
+        if (ret)
+            break;
+        if (songs[i].song_length) {
+            int song_size = separate_pattern_data_size(&songs[i]);
+            if (song_size == -1) {
+                ret = XM2NES_OUT_OF_MEMORY_ERROR;
+                break;
+            }
+            separate_size += song_size;
+        } else
+            diagnostic(&options[0], "%ssong is empty; it is left out", options[i].label_prefix);
+    }
+    if (ret)
+        return ret;
+    if (pool.count > MAX_PATTERN_TABLE_SIZE) {
+        /* Larger indexes would be read as commands, or wrap around */
+        diagnostic(&options[0], "%d patterns exceed the pattern table limit of %d",
+                   pool.count, MAX_PATTERN_TABLE_SIZE);
+        return XM2NES_PATTERN_TABLE_ERROR;
+    }
+
+    start = start_step(&options[0]);
+    print_pool(&pool, &options[0], label_prefix, out);
+    print_pattern_table(&pool, label_prefix, out);
+    for (i = 0; i < count; ++i) {
+        const struct song_data *song = &songs[i];
+        if (!song->song_length)
+            continue;
+        print_song_struct(song->xm->header.channel_count, song->unused_channels,
+                          song->xm->header.default_tempo, song->order_data_size,
+                          song->order_data, song->order_stride,
+                          options[0].chunk_dictionary, options[i].label_prefix,
+                          label_prefix, out);
+        if (options[i].remap_instruments)
+            print_instrument_remap(song, options[i].label_prefix, out);
+    }
+    end_step(&options[0], XM2NES_OUTPUT_STEP, start);
+
+    for (i = 0; i < count; ++i) {
+        if (songs[i].song_length && options[i].decode_costs && options[i].decode_report) {
+            ret = analyze_decode_cost(&songs[i], &pool, options[0].chunk_dictionary);
+            if (ret)
+                return ret;
+        }
+    }
+
+    if (options[0].report) {
+        for (i = 0; i < pool.count; ++i)
+            size += pool.entries[i].pattern->size + 2;
+        fprintf(options[0].report, "bank: %d songs, pattern data %d bytes (%d converted separately, %d saved)\n",
+                count, size, separate_size, separate_size - size);
+    }
+
+    return XM_NO_ERROR;
+}
+
+/**
+  Converts the \a count modules \a xms, with the corresponding
+  \a options, to \a out (and, for binary output, \a symbols_out).
+  If \a bank_prefix isn't 0, the modules form a bank; see
+  convert_bank(). Otherwise \a count must be 1. A label prefix or
+  instruments map that isn't given defaults to none and to the
+  identity mapping. All the memory of the conversion comes from the
+  arena of the first options, or from a temporary one if there is
+  none, and is freed at the end.
+*/
+static int convert(struct xm *xms, const struct xm2nes_options *options,
+                   int count, const char *bank_prefix,
+                   struct output_sink out, struct output_sink symbols_out,
+                   int binary)
+{
+    struct xm2nes_options *resolved;
+    struct instr_mapping default_instr_map[128];
+    struct xm2nes_arena *arena = options[0].arena;
+    struct output o;
+    int ret = XM_NO_ERROR;
+    int i, j;
+    if (bank_prefix && (strlen(bank_prefix) > XM2NES_MAX_LABEL_PREFIX_LENGTH))
+        return XM2NES_LABEL_PREFIX_ERROR;
+    if (!arena)
+        arena = xm2nes_arena_create();
+    if (!arena)
+        return XM2NES_OUT_OF_MEMORY_ERROR;
+    init_instruments_map(default_instr_map);
+    resolved = (struct xm2nes_options *)arena_alloc(&arena->song, count * sizeof(struct xm2nes_options));
+    if (!resolved)
+        ret = XM2NES_OUT_OF_MEMORY_ERROR;
+    for (i = 0; resolved && (i < count); ++i) {
+        resolved[i] = options[i];
+        resolved[i].arena = arena;
+        if (!resolved[i].label_prefix)
+            resolved[i].label_prefix = "";
+        else if (strlen(resolved[i].label_prefix) > XM2NES_MAX_LABEL_PREFIX_LENGTH)
+            ret = XM2NES_LABEL_PREFIX_ERROR;
+        if (!resolved[i].instr_map)
+            resolved[i].instr_map = default_instr_map;
+        /* The songs of a bank share the pattern format, and the chunk
+           dictionary only stores patterns in the flags format */
+        resolved[i].chunk_dictionary = options[0].chunk_dictionary;
+        resolved[i].adaptive_patterns = options[0].adaptive_patterns && !options[0].chunk_dictionary;
+        /* The songs of a bank need distinct labels */
+        for (j = 0; j < i; ++j) {
+            if (!strcmp(resolved[i].label_prefix, resolved[j].label_prefix))
+                ret = XM2NES_LABEL_PREFIX_ERROR;
+        }
+    }
+    if (ret == XM_NO_ERROR) {
+        output_init(&o, out, symbols_out, binary, &arena->output);
+        if (bank_prefix)
+            ret = convert_bank(xms, resolved, count, bank_prefix, &o);
+        else
+            ret = convert_song(xms, resolved, &o);
+        if ((ret == XM_NO_ERROR) || !binary) {
+            double start = start_step(&resolved[0]);
+            int finish_ret = output_finish(&o);
+            end_step(&resolved[0], XM2NES_OUTPUT_STEP, start);
+            if (ret == XM_NO_ERROR)
+                ret = finish_ret;
+        }
+    }
+    if (arena == options[0].arena)
+        reset_arena(arena);
+    else
+        xm2nes_arena_destroy(arena);
+    return ret;
+}
+
+/**
+  Converts the given \a xm to NES format; writes the 6502 assembly
+  language representation of the song to \a out.
+  Patterns of \a xm that are used by the song and haven't been decoded
+  yet are decoded. Returns XM_NO_ERROR, the error from decoding
+  a pattern, or XM2NES_PATTERN_TABLE_ERROR if the song has more
+  distinct patterns than the pattern table can hold.
+*/
+int convert_xm_to_nes(struct xm *xm,
+                      const struct xm2nes_options *options,
+                      FILE *out)
+{
+    struct output_sink out_sink;
+    struct output_sink no_sink;
+    memset(&out_sink, 0, sizeof(out_sink));
+    memset(&no_sink, 0, sizeof(no_sink));
+    out_sink.fp = out;
+    return convert(xm, options, 1, 0, out_sink, no_sink, /*binary=*/0);
+}
+
+/**
+  Like convert_xm_to_nes(), but writes the song as a binary blob to
+  \a out, and the offsets of its labels and of the pointers that must
+  be patched with the blob's address to \a symbols_out.
+*/
+int convert_xm_to_nes_binary(struct xm *xm,
+                             const struct xm2nes_options *options,
+                             FILE *out, FILE *symbols_out)
+{
+    struct output_sink out_sink;
+    struct output_sink symbols_sink;
+    memset(&out_sink, 0, sizeof(out_sink));
+    memset(&symbols_sink, 0, sizeof(symbols_sink));
+    out_sink.fp = out;
+    symbols_sink.fp = symbols_out;
+    return convert(xm, options, 1, 0, out_sink, symbols_sink, /*binary=*/1);
+}
+
+/**
+  Converts the \a count modules \a xms, each with the corresponding
+  \a options, to one set of 6502 assembly data written to \a out: the
+  patterns of all the songs are stored once, in a pattern table
+  labelled with \a label_prefix, and each song has a song struct
+  labelled with the label prefix of its options, which must differ.
+  The chunk dictionary, report and diagnostic settings are taken from
+  the first song's options. Returns XM_NO_ERROR, the error from decoding
+  a pattern, XM2NES_LABEL_PREFIX_ERROR, or XM2NES_PATTERN_TABLE_ERROR.
+*/
+int convert_xm_bank_to_nes(struct xm *xms,
+                           const struct xm2nes_options *options,
+                           int count, const char *label_prefix,
+                           FILE *out)
+{
+    struct output_sink out_sink;
+    struct output_sink no_sink;
+    memset(&out_sink, 0, sizeof(out_sink));
+    memset(&no_sink, 0, sizeof(no_sink));
+    out_sink.fp = out;
+    return convert(xms, options, count, label_prefix, out_sink, no_sink, /*binary=*/0);
+}
+
+/**
+  Like convert_xm_bank_to_nes(), but writes binary output, as
+  convert_xm_to_nes_binary() does.
+*/
+int convert_xm_bank_to_nes_binary(struct xm *xms,
+                                  const struct xm2nes_options *options,
+                                  int count, const char *label_prefix,
+                                  FILE *out, FILE *symbols_out)
+{
+    struct output_sink out_sink;
+    struct output_sink symbols_sink;
+    memset(&out_sink, 0, sizeof(out_sink));
+    memset(&symbols_sink, 0, sizeof(symbols_sink));
+    out_sink.fp = out;
+    symbols_sink.fp = symbols_out;
+    return convert(xms, options, count, label_prefix, out_sink, symbols_sink, /*binary=*/1);
+}
+
+/**
+  Converts the XM defined by the \a size bytes of \a data to NES
+  format. If \a symbols_out is 0, the 6502 assembly language
+  representation of the song is stored in \a out; otherwise, as for
+  convert_xm_to_nes_binary(), \a out receives the binary blob and
+  \a symbols_out the symbol file. Warnings are passed to
+  options->diagnostic. Doesn't use any global state, so it can be
+  called from several threads at once (with different caches and
+  arenas).
+  Returns XM_NO_ERROR, an XM_*_ERROR code if \a data isn't a valid XM,
+  XM2NES_OUT_OF_MEMORY_ERROR, XM2NES_PATTERN_TABLE_ERROR, or
+  XM2NES_BUFFER_TOO_SMALL_ERROR if the output didn't fit in a buffer
+  supplied by the caller; the buffer's size is then the size needed. On failure, buffers allocated by the
+  conversion are freed.
+*/
+int xm2nes_convert_memory(const unsigned char *data, size_t size,
+                          const struct xm2nes_options *options,
+                          struct xm2nes_buffer *out,
+                          struct xm2nes_buffer *symbols_out)
+{
+    struct xm xm;
+    struct output_sink out_sink;
+    struct output_sink symbols_sink;
+    int ret;
+    memset(&out_sink, 0, sizeof(out_sink));
+    memset(&symbols_sink, 0, sizeof(symbols_sink));
+    out_sink.buffer = out;
+    symbols_sink.buffer = symbols_out;
+    /* So that the buffers' size and allocated fields are valid, even if
+       the conversion fails before any output */
+    sink_init(&out_sink);
+    sink_init(&symbols_sink);
+    ret = xm_read_memory(data, size, XM_LAZY_PATTERNS, &xm);
+    if (ret == XM_NO_ERROR)
+        ret = convert(&xm, options, 1, 0, out_sink, symbols_sink, symbols_out != 0);
+    xm_destroy(&xm);
+    if (ret && (ret != XM2NES_BUFFER_TOO_SMALL_ERROR)) {
+        if (out->allocated) {
+            free(out->data);
+            out->data = 0;
+        }
+        if (symbols_out && symbols_out->allocated) {
+            free(symbols_out->data);
+            symbols_out->data = 0;
+        }
+    }
+    return ret;
+}
+
+/**
+  Returns a description of the error code \a error.
+*/
+const char *xm2nes_error_message(int error)
+{
+    switch (error) {
+        case XM_NO_ERROR: return "no error";
+        case XM_FORMAT_ERROR: return "not an XM file";
+        case XM_VERSION_ERROR: return "unsupported XM version";
+        case XM_HEADER_SIZE_ERROR: return "unsupported XM header size";
+        case XM_PREMATURE_END_OF_FILE_ERROR: return "premature end of file";
+        case XM_ORDER_ERROR: return "order table refers to a missing pattern";
+        case XM2NES_BUFFER_TOO_SMALL_ERROR: return "output buffer too small";
+        case XM2NES_INSTRUMENTS_MAP_ERROR: return "invalid instruments map";
+        case XM2NES_LABEL_PREFIX_ERROR: return "label prefix too long, or used by two songs";
+        case XM2NES_DECODE_COSTS_ERROR: return "invalid decode costs";
+        case XM2NES_OUT_OF_MEMORY_ERROR: return "out of memory";
+        case XM2NES_PATTERN_TABLE_ERROR: return "too many patterns for the pattern table";
+        case XM2NES_INTERNAL_ERROR: return "internal error";
+    }
+    return "unknown error";
+}
+
+/**
+  Returns the name of the conversion step \a step.
+*/
+const char *xm2nes_step_name(int step)
+{
+    switch (step) {
+        case XM2NES_SCAN_STEP: return "scan";
+        case XM2NES_UNIQUE_STEP: return "unique";
+        case XM2NES_ENCODE_STEP: return "encode";
+        case XM2NES_ORDER_STEP: return "order";
+        case XM2NES_OUTPUT_STEP: return "output";
+    }
+    return "unknown";
 }
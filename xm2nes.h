@@ -20,6 +20,11 @@
 
 #include "xm.h"
 #include "instrmap.h"
+#include "decodecost.h"
+
+struct xm2nes_cache;
+struct xm2nes_arena;
+struct xm2nes_stats;
 
 struct xm2nes_options {
     int channels;
@@ -27,10 +32,102 @@ struct xm2nes_options {
     const char *label_prefix;
     int order_start_offset;
     int order_end_offset;
+    int chunk_dictionary; /* store repeated 8-row chunks once */
+    int order_loops;      /* max nesting of order table loops, 0 = runs only */
+    int remap_instruments; /* number instruments by how often they are set */
+    int track_state;      /* carry the instrument across patterns */
+    int adaptive_patterns; /* store each pattern in its smallest row format */
+    int jobs;             /* threads to convert the channels with; 0 or 1 = none */
+    FILE *report;         /* where size reports are printed, or 0 */
+    struct xm2nes_cache *cache; /* converted patterns to reuse, or 0 */
+    struct xm2nes_arena *arena; /* memory to reuse, or 0 */
+    /* Called with each warning about the conversion, if not 0 */
+    void (*diagnostic)(void *context, const char *message);
+    void *diagnostic_context;
+    struct xm2nes_stats *stats; /* where to add the time of each step, or 0 */
+    /* If not 0, the cost of decoding the song on the NES is estimated
+       with these costs and printed to decode_report */
+    const struct decode_costs *decode_costs;
+    FILE *decode_report;
+    int decode_report_rows; /* also print the cost of every row */
+};
+
+/* The steps of a conversion */
+#define XM2NES_SCAN_STEP 0   /* finding and decoding the used patterns */
+#define XM2NES_UNIQUE_STEP 1 /* finding unique and shared patterns */
+#define XM2NES_ENCODE_STEP 2 /* converting patterns to NES format */
+#define XM2NES_ORDER_STEP 3  /* creating the order tables */
+#define XM2NES_OUTPUT_STEP 4 /* printing the song */
+#define XM2NES_STEP_COUNT 5
+
+#define XM2NES_MAX_CHANNELS XM_MAX_CHANNELS
+
+/* What a conversion made of one channel */
+struct xm2nes_channel_stats {
+    int unique_patterns;    /* patterns converted */
+    int duplicate_patterns; /* used patterns equal to another in the channel */
+    int shared_patterns;    /* converted patterns stored once for another one */
+    int encoded_size;       /* bytes of the converted patterns */
+    int order_table_size;   /* bytes of the order table */
+};
+
+/* Statistics of conversions. The time, in seconds, that each step
+   takes is added to step_time, and the counts of each channel to
+   channels, so the struct must be cleared before the first conversion.
+   With jobs, the time of channels converted in parallel is added up.
+   step_memory holds the most bytes of the arena that a conversion had
+   allocated by the end of each step. */
+struct xm2nes_stats {
+    double step_time[XM2NES_STEP_COUNT];
+    size_t step_memory[XM2NES_STEP_COUNT];
+    struct xm2nes_channel_stats channels[XM2NES_MAX_CHANNELS];
 };
 
-void convert_xm_to_nes(const struct xm *,
-                       const struct xm2nes_options *,
-                       FILE *);
+/* Output of xm2nes_convert_memory(). If data is 0, the buffer is
+   allocated, and must be freed with free(); otherwise it holds
+   capacity bytes. size is the size of the output, even if it is
+   larger than capacity. */
+struct xm2nes_buffer {
+    unsigned char *data;
+    size_t capacity;
+    size_t size;
+    int allocated; /* whether data was allocated by the conversion */
+};
+
+/* Errors, in addition to the XM_*_ERROR codes of xm_read() */
+#define XM2NES_BUFFER_TOO_SMALL_ERROR 16
+#define XM2NES_INSTRUMENTS_MAP_ERROR 17
+#define XM2NES_LABEL_PREFIX_ERROR 18
+#define XM2NES_DECODE_COSTS_ERROR 19
+#define XM2NES_OUT_OF_MEMORY_ERROR XM_OUT_OF_MEMORY_ERROR /* also returned by xm_read() */
+#define XM2NES_PATTERN_TABLE_ERROR 21 /* more than 251 distinct patterns */
+#define XM2NES_INTERNAL_ERROR 22 /* a bug in xm2nes */
+
+#define XM2NES_MAX_LABEL_PREFIX_LENGTH 200
+
+int convert_xm_to_nes(struct xm *,
+                      const struct xm2nes_options *,
+                      FILE *);
+int convert_xm_to_nes_binary(struct xm *,
+                             const struct xm2nes_options *,
+                             FILE *, FILE *);
+int convert_xm_bank_to_nes(struct xm *,
+                           const struct xm2nes_options *,
+                           int, const char *, FILE *);
+int convert_xm_bank_to_nes_binary(struct xm *,
+                                  const struct xm2nes_options *,
+                                  int, const char *, FILE *, FILE *);
+int xm2nes_convert_memory(const unsigned char *, size_t,
+                          const struct xm2nes_options *,
+                          struct xm2nes_buffer *, struct xm2nes_buffer *);
+const char *xm2nes_error_message(int);
+const char *xm2nes_step_name(int);
+
+struct xm2nes_cache *xm2nes_cache_create(void);
+void xm2nes_cache_prune(struct xm2nes_cache *);
+void xm2nes_cache_destroy(struct xm2nes_cache *);
+
+struct xm2nes_arena *xm2nes_arena_create(void);
+void xm2nes_arena_destroy(struct xm2nes_arena *);
 
 #endif